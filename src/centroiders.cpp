@@ -109,6 +109,37 @@ int BasicThresholdOnePass(unsigned char *image, int imageWidth, int imageHeight)
     return mean + (std * 5);
 }
 
+/**
+ * Estimate the standard deviation of the error in a centroid along each axis, from two sources:
+ * - Shot noise. If the variance of each pixel is about its value, the variance of a center of
+ *   gravity is the brightness-weighted second moment of the star divided by the square of its total
+ *   brightness.
+ * - Sampling. Only the pixels above the threshold are used, so a star that is a single pixel could
+ *   be centered anywhere around it. Call that half a pixel, shrinking with the square root of the
+ *   number of pixels.
+ * So wide, dim stars are uncertain, and big, bright ones are not.
+ * @param xCoord,yCoord The centroid, in the same coordinates as `starIndices`
+ */
+static decimal CentroidPositionUncertainty(const unsigned char *image, int imageWidth,
+                                           const std::vector<int> &starIndices,
+                                           decimal xCoord, decimal yCoord) {
+    if (starIndices.empty()) {
+        return 0;
+    }
+    decimal magSum = 0;
+    decimal secondMomentSum = 0;
+    for (int index : starIndices) {
+        decimal dx = index % imageWidth - xCoord;
+        decimal dy = index / imageWidth - yCoord;
+        magSum += image[index];
+        secondMomentSum += image[index] * (dx*dx + dy*dy);
+    }
+    // the second moment is summed over both axes, so halve it to get the variance along one axis
+    decimal shotVariance = magSum > 0 ? secondMomentSum / 2 / (magSum*magSum) : 0;
+    decimal samplingVariance = DECIMAL(0.25) / starIndices.size();
+    return DECIMAL_SQRT(shotVariance + samplingVariance);
+}
+
 struct CentroidParams {
     decimal yCoordMagSum;
     decimal xCoordMagSum;
@@ -120,6 +151,8 @@ struct CentroidParams {
     int cutoff;
     bool isValid;
     std::unordered_set<int> checkedIndices;
+    /// indices of the current star
+    std::vector<int> starIndices;
 };
 
 //recursive helper here
@@ -131,6 +164,7 @@ void CogHelper(CentroidParams *p, long i, unsigned char *image, int imageWidth,
             p->isValid = false;
         }
         p->checkedIndices.insert(i);
+        p->starIndices.push_back(i);
         if (i % imageWidth > p->xMax) {
             p->xMax = i % imageWidth;
         } else if (i % imageWidth < p->xMin) {
@@ -176,6 +210,7 @@ std::vector<Star> CenterOfGravityAlgorithm::Go(unsigned char *image, int imageWi
             p.yMax = i / imageWidth;
             p.yMin = i / imageWidth;
             p.isValid = true;
+            p.starIndices.clear();
 
             int sizeBefore = p.checkedIndices.size();
 
@@ -188,7 +223,9 @@ std::vector<Star> CenterOfGravityAlgorithm::Go(unsigned char *image, int imageWi
             decimal yCoord = (p.yCoordMagSum / (p.magSum * DECIMAL(1.0)));
 
             if (p.isValid) {
-                result.push_back(Star(xCoord + DECIMAL(0.5), yCoord + DECIMAL(0.5), (xDiameter)/DECIMAL(2.0), (yDiameter)/DECIMAL(2.0), p.checkedIndices.size() - sizeBefore));
+                Star star(xCoord + DECIMAL(0.5), yCoord + DECIMAL(0.5), (xDiameter)/DECIMAL(2.0), (yDiameter)/DECIMAL(2.0), p.checkedIndices.size() - sizeBefore);
+                star.positionUncertainty = CentroidPositionUncertainty(image, imageWidth, p.starIndices, xCoord, yCoord);
+                result.push_back(star);
             }
         }
     }
@@ -317,7 +354,9 @@ Stars IterativeWeightedCenterOfGravityAlgorithm::Go(unsigned char *image, int im
                 guessYCoord = yTemp;
             }
             if (p.isValid) {
-                result.push_back(Star(guessXCoord + DECIMAL(0.5), guessYCoord + DECIMAL(0.5), xDiameter/DECIMAL(2.0), yDiameter/DECIMAL(2.0), starIndices.size()));
+                Star star(guessXCoord + DECIMAL(0.5), guessYCoord + DECIMAL(0.5), xDiameter/DECIMAL(2.0), yDiameter/DECIMAL(2.0), starIndices.size());
+                star.positionUncertainty = CentroidPositionUncertainty(image, imageWidth, starIndices, guessXCoord, guessYCoord);
+                result.push_back(star);
             }
         }
     }
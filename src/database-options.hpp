@@ -6,10 +6,27 @@
 LOST_CLI_OPTION("min-mag"                , decimal      , minMag                , 100   , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
 LOST_CLI_OPTION("max-stars"              , int        , maxStars                , 10000 , atoi(optarg)   , kNoDefaultArgument)
 LOST_CLI_OPTION("min-separation"         , decimal      , minSeparation         , 0.08  , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("catalog-magnitudes"     , bool       , catalogMagnitudes       , false , atobool(optarg), true)
 LOST_CLI_OPTION("kvector"                , bool       , kvector                 , false , atobool(optarg), true)
 LOST_CLI_OPTION("kvector-min-distance"   , decimal      , kvectorMinDistance    , 0.5   , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
 LOST_CLI_OPTION("kvector-max-distance"   , decimal      , kvectorMaxDistance    , 15    , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
 LOST_CLI_OPTION("kvector-distance-bins"  , long       , kvectorNumDistanceBins  , 10000 , atol(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("compact-kvector"        , bool       , compactKvector          , false , atobool(optarg), true)
+LOST_CLI_OPTION("compact-kvector-bins"   , long       , compactKvectorNumBins   , 500   , atol(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("compact-kvector-distance-bits", int  , compactKvectorDistanceBits, 2   , atoi(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("triple-inner"           , bool       , tripleInner             , false , atobool(optarg), true)
+LOST_CLI_OPTION("triple-inner-min-distance", decimal    , tripleInnerMinDistance  , 0.5   , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("triple-inner-max-distance", decimal    , tripleInnerMaxDistance  , 10    , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("triple-inner-bins"      , long       , tripleInnerNumBins      , 10000 , atol(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("tetra"                  , bool       , tetra                   , false , atobool(optarg), true)
+LOST_CLI_OPTION("tetra-max-angle"        , decimal      , tetraMaxAngle         , 12    , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("tetra-pattern-stars-per-fov", decimal  , tetraPatternStarsPerFov , 10  , STR_TO_DECIMAL(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("tetra-bins"             , long       , tetraNumBins            , 50    , atol(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("sky-index"              , bool       , skyIndex                , false , atobool(optarg), true)
+LOST_CLI_OPTION("sky-index-bands"        , long       , skyIndexNumBands        , 90    , atol(optarg)   , kNoDefaultArgument)
+LOST_CLI_OPTION("neighbor-adjacency"     , bool       , neighborAdjacency       , false , atobool(optarg), true)
+LOST_CLI_OPTION("neighbor-adjacency-max-distance", decimal, neighborAdjacencyMaxDistance, 15, STR_TO_DECIMAL(optarg), kNoDefaultArgument)
+LOST_CLI_OPTION("threads"                , int        , threads                 , 0     , atoi(optarg)   , kNoDefaultArgument)
 LOST_CLI_OPTION("swap-integer-endianness", bool       , swapIntegerEndianness   , false , atobool(optarg), true)
 LOST_CLI_OPTION("swap-decimal-endianness", bool       , swapDecimalEndianness   , false , atobool(optarg), true)
 LOST_CLI_OPTION("output"                 , std::string, outputPath              , "-"   , optarg         , kNoDefaultArgument)
@@ -3,10 +3,18 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 #include <vector>
 #include <cstdint>
 #include <algorithm>
+#include <numeric>
+#include <array>
 #include <iostream>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 
 #include "attitude-utils.hpp"
 #include "serialize-helpers.hpp"
@@ -26,8 +34,39 @@ struct KVectorPair {
     decimal distance;
 };
 
+/// By distance, then by the stars' catalog indices, so the order doesn't depend on how the pairs are sorted
 bool CompareKVectorPairs(const KVectorPair &p1, const KVectorPair &p2) {
-    return p1.distance < p2.distance;
+    return std::tie(p1.distance, p1.index1, p1.index2) < std::tie(p2.distance, p2.index1, p2.index2);
+}
+
+/**
+ * Run task(0), task(1), ..., task(numTasks-1) on numThreads threads, each thread taking the next task
+ * that hasn't been started yet when it finishes one.
+ * @param numThreads Zero or negative means one per CPU
+ */
+static void ParallelFor(long numTasks, int numThreads, const std::function<void(long)> &task) {
+    if (numThreads <= 0) {
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    numThreads = (int)std::min((long)numThreads, numTasks);
+    if (numThreads <= 1) {
+        for (long i = 0; i < numTasks; i++) {
+            task(i);
+        }
+        return;
+    }
+    std::atomic<long> nextTask(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&]() {
+            for (long i = nextTask++; i < numTasks; i = nextTask++) {
+                task(i);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
 }
 
 // just the index part of the kvector, doesn't store the sorted list it refers to. This makes it
@@ -101,9 +140,7 @@ void SerializeKVectorIndex(SerializeContext *ser, const std::vector<decimal> &va
     SerializePrimitive<int32_t>(ser, numBins);
 
     // kvector index field
-    for (const int32_t &bin : kVector) {
-        SerializePrimitive<int32_t>(ser, bin);
-    }
+    SerializeArray<int32_t>(ser, kVector.data(), kVector.size());
 }
 
 /// Construct from serialized buffer.
@@ -172,35 +209,141 @@ long KVectorIndex::BinFor(decimal query) const {
      | sizeof kvectorIndex      | kVectorIndex | Serialized KVector index                                    |
      | 2*sizeof(int16)*numPairs | pairs        | Bulk pair data                                              |
  */
-std::vector<KVectorPair> CatalogToPairDistances(const Catalog &catalog, decimal minDistance, decimal maxDistance) {
-    std::vector<KVectorPair> result;
+/// How many consecutive catalog stars each task of CatalogToPairDistances finds the pairs of
+const long kPairDistanceChunkSize = 256;
+/// Most cubes along each axis of the grid in CatalogToPairDistances, so coordinates fit in a cell key
+const long kPairDistanceMaxGridSide = 1L << 20;
+
+/**
+ * Every pair of catalog stars between minDistance and maxDistance apart, ordered by the catalog index
+ * of the first star then of the second, the same as a double loop over the catalog would give.
+ * Instead of looking at every pair, the stars are put in a grid of cubes over the unit sphere, each
+ * at least as wide as the straight-line distance between two stars maxDistance apart, so a star's
+ * pairs are all in its own cube or the 26 around it. Only cubes with stars in them are stored, so
+ * memory doesn't depend on how small maxDistance is.
+ * @param numThreads Zero or negative means one per CPU
+ */
+std::vector<KVectorPair> CatalogToPairDistances(const Catalog &catalog, decimal minDistance, decimal maxDistance,
+                                                int numThreads) {
+    // a little wider than the chord, to be safe from rounding
+    decimal cellSize = std::max(2*DECIMAL_SIN(std::min(maxDistance, DECIMAL_M_PI)/2) + DECIMAL(1e-6),
+                                DECIMAL(2.0)/kPairDistanceMaxGridSide);
+    long gridSide = std::max(1L, std::min(kPairDistanceMaxGridSide, (long)DECIMAL_CEIL(2/cellSize)));
+    auto cellCoordinate = [cellSize, gridSide](decimal x) {
+        return std::max(0L, std::min(gridSide-1, (long)DECIMAL_FLOOR((x+1)/cellSize)));
+    };
+    auto cellKey = [](long x, long y, long z) {
+        return ((uint64_t)x << 42) | ((uint64_t)y << 21) | (uint64_t)z;
+    };
+    // catalog indices of the stars in each nonempty cell, in increasing order
+    std::unordered_map<uint64_t, std::vector<int16_t>> cells;
+    std::vector<std::array<long, 3>> starCells;
     for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
-        for (int16_t k = i+1; k < (int16_t)catalog.size(); k++) {
+        const Vec3 &spatial = catalog[i].spatial;
+        std::array<long, 3> cell = {{ cellCoordinate(spatial.x), cellCoordinate(spatial.y), cellCoordinate(spatial.z) }};
+        cells[cellKey(cell[0], cell[1], cell[2])].push_back(i);
+        starCells.push_back(cell);
+    }
+    // pairs further apart than this are skipped without computing their angle
+    decimal minCos = DECIMAL_COS(std::min(maxDistance, DECIMAL_M_PI)) - DECIMAL(1e-9);
+
+    long numChunks = (catalog.size() + kPairDistanceChunkSize - 1) / kPairDistanceChunkSize;
+    std::vector<std::vector<KVectorPair>> chunks(numChunks);
+    ParallelFor(numChunks, numThreads, [&](long chunk) {
+        std::vector<int16_t> partners;
+        long end = std::min((long)catalog.size(), (chunk+1)*kPairDistanceChunkSize);
+        for (int16_t i = chunk*kPairDistanceChunkSize; i < end; i++) {
+            partners.clear();
+            const std::array<long, 3> &cell = starCells[i];
+            for (long x = std::max(0L, cell[0]-1); x <= std::min(gridSide-1, cell[0]+1); x++) {
+                for (long y = std::max(0L, cell[1]-1); y <= std::min(gridSide-1, cell[1]+1); y++) {
+                    for (long z = std::max(0L, cell[2]-1); z <= std::min(gridSide-1, cell[2]+1); z++) {
+                        auto stars = cells.find(cellKey(x, y, z));
+                        if (stars != cells.end()) {
+                            partners.insert(partners.end(),
+                                            std::upper_bound(stars->second.begin(), stars->second.end(), i),
+                                            stars->second.end());
+                        }
+                    }
+                }
+            }
+            std::sort(partners.begin(), partners.end());
 
-            KVectorPair pair = { i, k, AngleUnit(catalog[i].spatial, catalog[k].spatial) };
-            assert(isfinite(pair.distance));
-            assert(pair.distance >= 0);
-            assert(pair.distance <= DECIMAL_M_PI);
+            for (int16_t k : partners) {
+                if (catalog[i].spatial * catalog[k].spatial < minCos) {
+                    continue;
+                }
+                KVectorPair pair = { i, k, AngleUnit(catalog[i].spatial, catalog[k].spatial) };
+                assert(isfinite(pair.distance));
+                assert(pair.distance >= 0);
+                assert(pair.distance <= DECIMAL_M_PI);
 
-            if (pair.distance >= minDistance && pair.distance <= maxDistance) {
-                // we'll sort later
-                result.push_back(pair);
+                if (pair.distance >= minDistance && pair.distance <= maxDistance) {
+                    // we'll sort later
+                    chunks[chunk].push_back(pair);
+                }
             }
         }
+    });
+
+    size_t numPairs = 0;
+    for (const std::vector<KVectorPair> &chunk : chunks) {
+        numPairs += chunk.size();
+    }
+    std::vector<KVectorPair> result;
+    result.reserve(numPairs);
+    for (std::vector<KVectorPair> &chunk : chunks) {
+        result.insert(result.end(), chunk.begin(), chunk.end());
+        std::vector<KVectorPair>().swap(chunk); // so there's only ever one copy of most pairs
     }
     return result;
 }
 
+/**
+ * Sort pairs with CompareKVectorPairs. Equal parts are sorted on separate threads, then neighboring
+ * parts are merged, also in parallel, until there's just one left.
+ */
+static void SortPairDistances(std::vector<KVectorPair> *pairs, int numThreads) {
+    if (numThreads <= 0) {
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    std::vector<size_t> bounds;
+    for (int part = 0; part <= numThreads; part++) {
+        bounds.push_back(pairs->size() * part / numThreads);
+    }
+    ParallelFor(numThreads, numThreads, [&](long part) {
+        std::sort(pairs->begin() + bounds[part], pairs->begin() + bounds[part+1], CompareKVectorPairs);
+    });
+    while (bounds.size() > 2) {
+        long numMerges = (bounds.size() - 1) / 2;
+        ParallelFor(numMerges, numThreads, [&](long merge) {
+            std::inplace_merge(pairs->begin() + bounds[2*merge], pairs->begin() + bounds[2*merge+1],
+                               pairs->begin() + bounds[2*merge+2], CompareKVectorPairs);
+        });
+        std::vector<size_t> merged;
+        for (size_t i = 0; i < bounds.size(); i += 2) {
+            merged.push_back(bounds[i]);
+        }
+        if (merged.back() != bounds.back()) {
+            merged.push_back(bounds.back());
+        }
+        bounds = merged;
+    }
+}
+
 /**
  * Serialize a pair-distance KVector into buffer.
  * Use SerializeLengthPairDistanceKVector to determine how large the buffer needs to be. See command line documentation for other options.
+ * @param numThreads Threads to find and sort the pairs with. Zero or negative means one per CPU. The
+ * result is the same for any number of threads.
  */
-void SerializePairDistanceKVector(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance, long numBins) {
+void SerializePairDistanceKVector(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance, long numBins,
+                                  int numThreads) {
     std::vector<int32_t> kVector(numBins+1); // numBins = length, all elements zero
-    std::vector<KVectorPair> pairs = CatalogToPairDistances(catalog, minDistance, maxDistance);
+    std::vector<KVectorPair> pairs = CatalogToPairDistances(catalog, minDistance, maxDistance, numThreads);
 
     // sort pairs in increasing order.
-    std::sort(pairs.begin(), pairs.end(), CompareKVectorPairs);
+    SortPairDistances(&pairs, numThreads);
     std::vector<decimal> distances;
 
     for (const KVectorPair &pair : pairs) {
@@ -211,6 +354,7 @@ void SerializePairDistanceKVector(SerializeContext *ser, const Catalog &catalog,
     SerializeKVectorIndex(ser, distances, minDistance, maxDistance, numBins);
 
     // bulk pairs field
+    ser->Reserve(pairs.size()*2*sizeof(int16_t));
     for (const KVectorPair &pair : pairs) {
         SerializePrimitive<int16_t>(ser, pair.index1);
         SerializePrimitive<int16_t>(ser, pair.index2);
@@ -245,6 +389,68 @@ const int16_t *PairDistanceKVectorDatabase::FindPairsLiberal(
     return &pairs[lowerIndex * 2];
 }
 
+/**
+ * Run FindPairsLiberal for many [min,max] ranges at once, merging the results.
+ * Instead of one span per range, returns non-overlapping spans sorted by position in the pairs
+ * array, each with the number of ranges that include it. Reading the spans in order sweeps through
+ * the pairs array once, and pairs returned by several overlapping ranges are only read once.
+ */
+std::vector<PairDistanceSpan> PairDistanceKVectorDatabase::FindPairsLiberalBatch(
+    const std::vector<std::pair<decimal, decimal>> &ranges) const {
+
+    // +1 where a range's pairs start, -1 where they end
+    std::vector<std::pair<const int16_t *, int>> events;
+    events.reserve(2*ranges.size());
+    for (const std::pair<decimal, decimal> &range : ranges) {
+        const int16_t *end;
+        const int16_t *begin = FindPairsLiberal(range.first, range.second, &end);
+        if (end > begin) {
+            events.emplace_back(begin, 1);
+            events.emplace_back(end, -1);
+        }
+    }
+    std::sort(events.begin(), events.end());
+
+    std::vector<PairDistanceSpan> result;
+    int multiplicity = 0;
+    for (size_t i = 0; i < events.size(); i++) {
+        multiplicity += events[i].second;
+        if (multiplicity > 0 && i+1 < events.size() && events[i+1].first > events[i].first) {
+            result.push_back({ events[i].first, events[i+1].first, multiplicity });
+        }
+    }
+    assert(multiplicity == 0);
+    return result;
+}
+
+/**
+ * The most pairs involving any one star that FindPairsLiberal can return for a query range no
+ * wider than \p queryWidth. That is, how many votes a single query can give a single star.
+ * Reads every pair in the database, so callers should only do this once.
+ */
+long PairDistanceKVectorDatabase::MaxPairsPerStarInQuery(decimal queryWidth) const {
+    // A liberal query returns whole bins, and a range this wide touches at most this many of them
+    // (one extra in case of rounding).
+    long binsPerQuery = (long)DECIMAL_CEIL(queryWidth / index.BinWidth()) + 2;
+    std::vector<long> counts(INT16_MAX+1, 0);
+    long result = 0;
+    // slide a window of binsPerQuery bins over the pairs, adding one bin and removing another each step
+    for (long bin = 0; bin <= index.NumBins(); bin++) {
+        for (long i = bin == 0 ? 0 : index.NumValuesUpTo(bin-1); i < index.NumValuesUpTo(bin); i++) {
+            result = std::max(result, ++counts[pairs[2*i]]);
+            result = std::max(result, ++counts[pairs[2*i+1]]);
+        }
+        long oldBin = bin - binsPerQuery + 1;
+        if (oldBin >= 0) {
+            for (long i = oldBin == 0 ? 0 : index.NumValuesUpTo(oldBin-1); i < index.NumValuesUpTo(oldBin); i++) {
+                counts[pairs[2*i]]--;
+                counts[pairs[2*i+1]]--;
+            }
+        }
+    }
+    return result;
+}
+
 const int16_t *PairDistanceKVectorDatabase::FindPairsExact(const Catalog &catalog,
                                                            decimal minQueryDistance, decimal maxQueryDistance, const int16_t **end) const {
 
@@ -294,6 +500,919 @@ std::vector<decimal> PairDistanceKVectorDatabase::StarDistances(int16_t star, co
     return result;
 }
 
+const int32_t CompactPairDistanceDatabase::kMagicValue = 0x2536f00b;
+
+/// Appends bits to a byte array, least significant bit first.
+class CompactPairBitWriter {
+public:
+    explicit CompactPairBitWriter(std::vector<unsigned char> *bytes) : bytes(bytes) { };
+
+    void Write(uint32_t value, int numBits) {
+        for (int i = 0; i < numBits; i++) {
+            if (numBitsInLastByte == 0) {
+                bytes->push_back(0);
+            }
+            bytes->back() |= ((value >> i) & 1) << numBitsInLastByte;
+            numBitsInLastByte = (numBitsInLastByte + 1) % 8;
+        }
+    };
+
+    /// Write `value` as that many zeros followed by a one
+    void WriteUnary(uint32_t value) {
+        for (uint32_t i = 0; i < value; i++) {
+            Write(0, 1);
+        }
+        Write(1, 1);
+    };
+
+    /// Pad out to the next byte
+    void Flush() { numBitsInLastByte = 0; };
+private:
+    std::vector<unsigned char> *bytes;
+    int numBitsInLastByte = 0;
+};
+
+/// Number of zero bits below the lowest one bit of a nonzero `value`
+static inline int CountTrailingZeros(uint64_t value) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(value);
+#else
+    int result = 0;
+    while ((value & 1) == 0) {
+        value >>= 1;
+        result++;
+    }
+    return result;
+#endif
+}
+
+/// Reads bits written by CompactPairBitWriter
+class CompactPairBitReader {
+public:
+    explicit CompactPairBitReader(const unsigned char *bytes) : next(bytes) { };
+
+    /// @param numBits At most kCompactPairMaxReadBits
+    uint64_t Read(int numBits) {
+        if (numBufferedBits < numBits) {
+            Refill();
+        }
+        uint64_t result = buffer & ((UINT64_C(1) << numBits) - 1);
+        buffer >>= numBits;
+        numBufferedBits -= numBits;
+        return result;
+    };
+
+    uint32_t ReadUnary() {
+        uint32_t result = 0;
+        while (buffer == 0) {
+            result += numBufferedBits;
+            numBufferedBits = 0;
+            Refill();
+        }
+        int numZeros = CountTrailingZeros(buffer);
+        buffer >>= numZeros + 1;
+        numBufferedBits -= numZeros + 1;
+        return result + numZeros;
+    };
+private:
+    /// Fill the buffer up to at least kCompactPairMaxReadBits bits, a whole word at a time
+    void Refill() {
+        // the stream is little-endian no matter the host or database endianness. Compilers turn this
+        // into a single load on little-endian hosts.
+        uint64_t word = 0;
+        for (int i = 0; i < 8; i++) {
+            word |= (uint64_t)next[i] << (8*i);
+        }
+        buffer |= word << numBufferedBits;
+        next += (63 - numBufferedBits) / 8;
+        numBufferedBits |= 56;
+        // the last byte may not have fit entirely
+        buffer &= (UINT64_C(1) << numBufferedBits) - 1;
+    };
+
+    const unsigned char *next;
+    uint64_t buffer = 0;
+    int numBufferedBits = 0;
+};
+
+/// Most bits CompactPairBitReader::Read can read at once, because Refill leaves at least this many
+const int kCompactPairMaxReadBits = 56;
+/// CompactPairBitReader::Refill can read this far past the last byte of a bin
+const int kCompactPairStreamPadding = 8;
+/// Most bits of a star number, since catalog indices are int16
+const int kCompactPairMaxStarBits = 15;
+/// Most bits of a quantized distance
+const int kCompactPairMaxDistanceBits = 16;
+
+/// Number of bits needed to store each of `values` with the given Rice parameter
+static long RiceCodedBits(const std::vector<uint32_t> &values, int riceParameter) {
+    long result = 0;
+    for (uint32_t value : values) {
+        result += (value >> riceParameter) + 1 + riceParameter;
+    }
+    return result;
+}
+
+/// Number of bits needed to store every integer in [0,value]
+static int BitsFor(uint32_t value) {
+    int result = 0;
+    while (value >> result != 0) {
+        result++;
+    }
+    return result;
+}
+
+/**
+ Compact pair distance database layout.
+
+     | size (bytes)    | name           | description                                             |
+     |-----------------+----------------+---------------------------------------------------------|
+     | sizeof decimal  | min            | Lower bound on stored distances                         |
+     | sizeof decimal  | max            | Upper bound on stored distances                         |
+     | 4               | numBins        | Number of distance bins, evenly spaced in [min,max]     |
+     | 4               | numStars       | Catalog size                                            |
+     | 4               | distanceBits   | Bits of each quantized distance                         |
+     | 2*numStars      | catalogIndices | Catalog index of each star, sorted by declination       |
+     | 2*numStars      | starNumbers    | Position of each catalog star in catalogIndices         |
+     | 4*(numBins+1)   | binStarts      | Index of the first pair in each bin, plus the end       |
+     | 4*(numBins+1)   | binOffsets     | Offset in `stream` of each bin, plus the end            |
+     | numBins         | riceParameters | Rice parameter of each bin                              |
+     | numBins         | offsetBits     | Bits of each offset in each bin, see below              |
+     | n+8             | stream         | The bins, each starting at a byte boundary, and padding |
+
+ Stars are numbered by their position in catalogIndices, so that stars close together in the sky
+ have close numbers. Each pair (a,b), with a<b, is stored as a and the offset b-a-1, which is much
+ smaller than the catalog size because b is within the max distance of a, and smaller still in bins
+ of shorter distances.
+
+ Within each bin, pairs are sorted by a, then by offset. For each pair, the difference between its
+ a and the last pair's a (or 0, for the first pair) is Rice coded: The difference shifted right by
+ the bin's Rice parameter is written in unary (that many zeros, then a one), followed by that many
+ low bits of the difference. Then come the offset, in the bin's offsetBits, and the distance within the
+ bin as a fraction of the bin width, quantized to distanceBits bits. All bits are stored least
+ significant first.
+ */
+
+/**
+ * Serialize a compact pair distance database.
+ * @param numBins Number of distance bins. More bins take more space, but need less distance bits.
+ * @param distanceBits Bits to quantize each distance within its bin to. Zero means don't store
+ * distances, so queries always return whole bins.
+ * @param numThreads Threads to find the pairs with, as in SerializePairDistanceKVector
+ */
+void SerializeCompactPairDistance(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance,
+                                  long numBins, int distanceBits, int numThreads) {
+    assert(numBins > 0);
+    assert(distanceBits >= 0 && distanceBits <= kCompactPairMaxDistanceBits);
+    decimal binWidth = (maxDistance - minDistance) / numBins;
+
+    // Number stars by declination. Each star is only paired with stars within maxDistance in
+    // declination, so the offsets are much smaller than the catalog size.
+    std::vector<int16_t> catalogIndices(catalog.size());
+    std::iota(catalogIndices.begin(), catalogIndices.end(), 0);
+    std::stable_sort(catalogIndices.begin(), catalogIndices.end(), [&catalog](int16_t a, int16_t b) {
+        return catalog[a].spatial.z < catalog[b].spatial.z;
+    });
+    std::vector<int16_t> numbers(catalog.size());
+    for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+        numbers[catalogIndices[i]] = i;
+    }
+
+    // (a, offset, quantized distance) of each pair, by bin
+    std::vector<std::vector<std::array<uint32_t, 3>>> bins(numBins);
+    for (const KVectorPair &pair : CatalogToPairDistances(catalog, minDistance, maxDistance, numThreads)) {
+        uint32_t a = std::min(numbers[pair.index1], numbers[pair.index2]);
+        uint32_t offset = std::max(numbers[pair.index1], numbers[pair.index2]) - a - 1;
+
+        decimal position = (pair.distance - minDistance) / binWidth;
+        long bin = std::min(numBins-1, (long)position);
+        uint32_t quantized = std::min((1L << distanceBits) - 1,
+                                      (long)((position - bin) * (1L << distanceBits)));
+        bins[bin].push_back({{ a, offset, quantized }});
+    }
+    std::vector<int32_t> binStarts;
+    std::vector<int32_t> binOffsets;
+    std::vector<uint8_t> riceParameters;
+    std::vector<uint8_t> offsetBits;
+    std::vector<unsigned char> stream;
+    CompactPairBitWriter writer(&stream);
+    int32_t numPairs = 0;
+    for (std::vector<std::array<uint32_t, 3>> &bin : bins) {
+        std::sort(bin.begin(), bin.end());
+        std::vector<uint32_t> differences;
+        uint32_t maxOffset = 0;
+        for (size_t i = 0; i < bin.size(); i++) {
+            differences.push_back(bin[i][0] - (i == 0 ? 0 : bin[i-1][0]));
+            maxOffset = std::max(maxOffset, bin[i][1]);
+        }
+        int riceParameter = 0;
+        for (int candidate = 1; candidate <= kCompactPairMaxStarBits; candidate++) {
+            if (RiceCodedBits(differences, candidate) < RiceCodedBits(differences, riceParameter)) {
+                riceParameter = candidate;
+            }
+        }
+
+        binStarts.push_back(numPairs);
+        binOffsets.push_back(stream.size());
+        riceParameters.push_back(riceParameter);
+        offsetBits.push_back(BitsFor(maxOffset));
+        for (size_t i = 0; i < bin.size(); i++) {
+            writer.WriteUnary(differences[i] >> riceParameter);
+            writer.Write(differences[i], riceParameter);
+            writer.Write(bin[i][1], offsetBits.back());
+            writer.Write(bin[i][2], distanceBits);
+        }
+        writer.Flush();
+        numPairs += bin.size();
+    }
+    binStarts.push_back(numPairs);
+    binOffsets.push_back(stream.size());
+    stream.resize(stream.size() + kCompactPairStreamPadding, 0);
+
+    SerializePrimitive<decimal>(ser, minDistance);
+    SerializePrimitive<decimal>(ser, maxDistance);
+    SerializePrimitive<int32_t>(ser, numBins);
+    SerializePrimitive<int32_t>(ser, catalog.size());
+    SerializePrimitive<int32_t>(ser, distanceBits);
+    SerializeArray<int16_t>(ser, catalogIndices.data(), catalogIndices.size());
+    SerializeArray<int16_t>(ser, numbers.data(), numbers.size());
+    SerializeArray<int32_t>(ser, binStarts.data(), binStarts.size());
+    SerializeArray<int32_t>(ser, binOffsets.data(), binOffsets.size());
+    SerializeArray<uint8_t>(ser, riceParameters.data(), riceParameters.size());
+    SerializeArray<uint8_t>(ser, offsetBits.data(), offsetBits.size());
+    SerializeArray<unsigned char>(ser, stream.data(), stream.size());
+}
+
+/// Create the database from a serialized buffer.
+CompactPairDistanceDatabase::CompactPairDistanceDatabase(DeserializeContext *des) {
+    min = DeserializePrimitive<decimal>(des);
+    max = DeserializePrimitive<decimal>(des);
+    numBins = DeserializePrimitive<int32_t>(des);
+    numStars = DeserializePrimitive<int32_t>(des);
+    distanceBits = DeserializePrimitive<int32_t>(des);
+    binWidth = (max - min) / numBins;
+    catalogIndices = DeserializeArray<int16_t>(des, numStars);
+    starNumbers = DeserializeArray<int16_t>(des, numStars);
+    binStarts = DeserializeArray<int32_t>(des, numBins+1);
+    binOffsets = DeserializeArray<int32_t>(des, numBins+1);
+    riceParameters = DeserializeArray<uint8_t>(des, numBins);
+    offsetBits = DeserializeArray<uint8_t>(des, numBins);
+    stream = DeserializeArray<unsigned char>(des, binOffsets[numBins] + kCompactPairStreamPadding);
+    assert(2*kCompactPairMaxStarBits + distanceBits <= kCompactPairMaxReadBits);
+}
+
+/// The bin containing the given distance, which must be in [min,max]
+long CompactPairDistanceDatabase::Bin(decimal distance) const {
+    return std::max(0L, std::min(numBins-1, (long)((distance - min) / binWidth)));
+}
+
+/**
+ * Find all the pairs with distance in [minQueryDistance,maxQueryDistance], and possibly some up to
+ * a bin width divided by 2^distanceBits outside the range.
+ * @param pairs[out] Replaced by the catalog indices of the stars in each pair, two per pair, like
+ * PairDistanceKVectorDatabase::FindPairsLiberal returns. In no particular order.
+ */
+void CompactPairDistanceDatabase::FindPairsLiberal(decimal minQueryDistance, decimal maxQueryDistance,
+                                                   std::vector<int16_t> *pairs) const {
+    assert(maxQueryDistance > minQueryDistance);
+    pairs->clear();
+    if (minQueryDistance > max || maxQueryDistance < min) {
+        return;
+    }
+    long lowerBin = Bin(std::max(min, minQueryDistance));
+    long upperBin = Bin(std::min(max, maxQueryDistance));
+    // the query range, in units of quantized distance from the start of the lower bin
+    decimal quantumWidth = binWidth / (1L << distanceBits);
+    decimal lowerQuantum = (minQueryDistance - min - lowerBin*binWidth) / quantumWidth;
+    decimal upperQuantum = (maxQueryDistance - min - lowerBin*binWidth) / quantumWidth;
+
+    pairs->resize(2*(binStarts[upperBin+1] - binStarts[lowerBin]));
+    int16_t *out = pairs->data();
+    for (long bin = lowerBin; bin <= upperBin; bin++) {
+        CompactPairBitReader reader(&stream[binOffsets[bin]]);
+        int riceParameter = riceParameters[bin];
+        int binOffsetBits = offsetBits[bin];
+        // the low bits of the difference, the offset, and the distance can all be read at once
+        int fieldBits = riceParameter + binOffsetBits + distanceBits;
+        long binQuantum = (bin - lowerBin) << distanceBits;
+        uint32_t star1 = 0;
+        for (int32_t i = binStarts[bin]; i < binStarts[bin+1]; i++) {
+            star1 += reader.ReadUnary() << riceParameter;
+            uint64_t fields = reader.Read(fieldBits);
+            star1 += fields & ((1u << riceParameter) - 1);
+            uint32_t offset = (fields >> riceParameter) & ((1u << binOffsetBits) - 1);
+            long quantum = binQuantum + (long)(fields >> (riceParameter + binOffsetBits));
+            // the pair's distance is somewhere in [quantum,quantum+1)
+            if (quantum + 1 < lowerQuantum || quantum > upperQuantum) {
+                continue;
+            }
+            *out++ = catalogIndices[star1];
+            *out++ = catalogIndices[star1 + offset + 1];
+        }
+    }
+    pairs->resize(out - pairs->data());
+}
+
+/**
+ * Find all the stars separated from `catalogIndex` by a distance in
+ * [minQueryDistance,maxQueryDistance], and possibly some slightly outside the range, like
+ * FindPairsLiberal.
+ *
+ * Faster than FindPairsLiberal followed by searching for pairs involving the star, because pairs
+ * are sorted by their first star within each bin, so decoding each bin can stop early.
+ * @param partners[out] Replaced by the catalog indices of the other star in each pair.
+ */
+void CompactPairDistanceDatabase::FindPartnersLiberal(int16_t catalogIndex,
+                                                      decimal minQueryDistance, decimal maxQueryDistance,
+                                                      std::vector<int16_t> *partners) const {
+    assert(maxQueryDistance > minQueryDistance);
+    partners->clear();
+    if (minQueryDistance > max || maxQueryDistance < min) {
+        return;
+    }
+    long lowerBin = Bin(std::max(min, minQueryDistance));
+    long upperBin = Bin(std::min(max, maxQueryDistance));
+    decimal quantumWidth = binWidth / (1L << distanceBits);
+    decimal lowerQuantum = (minQueryDistance - min - lowerBin*binWidth) / quantumWidth;
+    decimal upperQuantum = (maxQueryDistance - min - lowerBin*binWidth) / quantumWidth;
+
+    uint32_t number = starNumbers[catalogIndex];
+    for (long bin = lowerBin; bin <= upperBin; bin++) {
+        CompactPairBitReader reader(&stream[binOffsets[bin]]);
+        int riceParameter = riceParameters[bin];
+        int binOffsetBits = offsetBits[bin];
+        int fieldBits = riceParameter + binOffsetBits + distanceBits;
+        long binQuantum = (bin - lowerBin) << distanceBits;
+        uint32_t star1 = 0;
+        for (int32_t i = binStarts[bin]; i < binStarts[bin+1]; i++) {
+            star1 += reader.ReadUnary() << riceParameter;
+            uint64_t fields = reader.Read(fieldBits);
+            star1 += fields & ((1u << riceParameter) - 1);
+            // the first star of a pair is always the smaller number, so no later pair in this bin involves the star
+            if (star1 > number) {
+                break;
+            }
+            uint32_t star2 = star1 + ((fields >> riceParameter) & ((1u << binOffsetBits) - 1)) + 1;
+            if (star1 != number && star2 != number) {
+                continue;
+            }
+            long quantum = binQuantum + (long)(fields >> (riceParameter + binOffsetBits));
+            if (quantum + 1 < lowerQuantum || quantum > upperQuantum) {
+                continue;
+            }
+            partners->push_back(catalogIndices[star1 == number ? star2 : star1]);
+        }
+    }
+}
+
+const int32_t TripleInnerKVectorDatabase::kMagicValue = 0x3a7b1c02;
+
+/**
+ * Compute the inner angles of the (planar) triangle with the given corners.
+ * @param angles[out] The angle at each corner, in the same order as the corners are passed.
+ */
+void TriangleInnerAngles(const Vec3 &a, const Vec3 &b, const Vec3 &c, decimal *angles) {
+    angles[0] = Angle(b - a, c - a);
+    angles[1] = Angle(a - b, c - b);
+    angles[2] = DECIMAL_M_PI - angles[0] - angles[1];
+}
+
+struct KVectorTriple {
+    int16_t index[3];
+    decimal smallestAngle;
+};
+
+bool CompareKVectorTriples(const KVectorTriple &t1, const KVectorTriple &t2) {
+    return t1.smallestAngle < t2.smallestAngle;
+}
+
+/**
+ triple inner K-vector database layout.
+
+     | size (bytes)               | name         | description                                     |
+     |----------------------------+--------------+-------------------------------------------------|
+     | sizeof decimal             | minDistance  | Lower bound on the sides of stored triangles    |
+     | sizeof decimal             | maxDistance  | Upper bound on the sides of stored triangles    |
+     | sizeof kvectorIndex        | kVectorIndex | Serialized KVector index, on the smallest angle |
+     | 3*sizeof(int16)*numTriples | triples      | Bulk triple data                                |
+ */
+
+/**
+ * Serialize a triple inner angle KVector into buffer.
+ * Every triple of catalog stars whose pairwise distances are all between minDistance and
+ * maxDistance is stored. The number of triples grows very quickly with maxDistance and the size of
+ * the catalog. See command line documentation for other options.
+ */
+void SerializeTripleInnerKVector(SerializeContext *ser, const Catalog &catalog, decimal minDistance, decimal maxDistance, long numBins) {
+    decimal minCos = DECIMAL_COS(maxDistance);
+    decimal maxCos = DECIMAL_COS(minDistance);
+    auto inRange = [&catalog, minCos, maxCos](int16_t i, int16_t j) {
+        decimal cos = catalog[i].spatial * catalog[j].spatial;
+        return cos >= minCos && cos <= maxCos;
+    };
+
+    std::vector<KVectorTriple> triples;
+    for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+        // only consider stars after `i`, so that each triple is generated exactly once
+        std::vector<int16_t> neighbors;
+        for (int16_t j = i+1; j < (int16_t)catalog.size(); j++) {
+            if (inRange(i, j)) {
+                neighbors.push_back(j);
+            }
+        }
+        for (int j = 0; j < (int)neighbors.size(); j++) {
+            for (int k = j+1; k < (int)neighbors.size(); k++) {
+                if (!inRange(neighbors[j], neighbors[k])) {
+                    continue;
+                }
+                int16_t corners[3] = { i, neighbors[j], neighbors[k] };
+                decimal angles[3];
+                TriangleInnerAngles(catalog[i].spatial,
+                                    catalog[neighbors[j]].spatial,
+                                    catalog[neighbors[k]].spatial,
+                                    angles);
+                int order[3] = { 0, 1, 2 };
+                std::sort(order, order+3, [&angles](int a, int b) { return angles[a] < angles[b]; });
+
+                KVectorTriple triple;
+                for (int corner = 0; corner < 3; corner++) {
+                    triple.index[corner] = corners[order[corner]];
+                }
+                // the smallest angle of a triangle is at most 60 degrees, floating point aside
+                triple.smallestAngle = std::min(angles[order[0]], DECIMAL_M_PI/3);
+                triples.push_back(triple);
+            }
+        }
+    }
+
+    std::sort(triples.begin(), triples.end(), CompareKVectorTriples);
+    std::vector<decimal> smallestAngles;
+    for (const KVectorTriple &triple : triples) {
+        smallestAngles.push_back(triple.smallestAngle);
+    }
+
+    SerializePrimitive<decimal>(ser, minDistance);
+    SerializePrimitive<decimal>(ser, maxDistance);
+    // index field
+    SerializeKVectorIndex(ser, smallestAngles, DECIMAL(0.0), DECIMAL_M_PI/3, numBins);
+    // bulk triples field
+    ser->Reserve(triples.size()*3*sizeof(int16_t));
+    for (const KVectorTriple &triple : triples) {
+        for (int corner = 0; corner < 3; corner++) {
+            SerializePrimitive<int16_t>(ser, triple.index[corner]);
+        }
+    }
+}
+
+/// Create the database from a serialized buffer.
+TripleInnerKVectorDatabase::TripleInnerKVectorDatabase(DeserializeContext *des)
+    : minDistance(DeserializePrimitive<decimal>(des)),
+      maxDistance(DeserializePrimitive<decimal>(des)),
+      index(KVectorIndex(des)) {
+
+    triples = DeserializeArray<int16_t>(des, 3*index.NumValues());
+}
+
+/**
+ * Return at least all the star triples whose smallest inner angle is between min and max
+ * @param end[out] Is set to an "off-the-end" pointer, one past the last triple being returned by the query.
+ * @return A pointer to the start of the matched triples. Each triple is stored as three 16-bit catalog indices, ordered by the inner angle at that star, smallest first.
+ */
+const int16_t *TripleInnerKVectorDatabase::FindTriplesLiberal(
+    decimal minQueryAngle, decimal maxQueryAngle, const int16_t **end) const {
+
+    long upperIndex = -1;
+    long lowerIndex = index.QueryLiberal(minQueryAngle, maxQueryAngle, &upperIndex);
+    *end = &triples[upperIndex * 3];
+    return &triples[lowerIndex * 3];
+}
+
+const int32_t TetraDatabase::kMagicValue = 0x7e7a0001;
+
+/**
+ * Compute the angle between every pair of stars in a Tetra pattern.
+ * @param spatials kTetraPatternSize unit vectors
+ * @param edges[out] kTetraNumEdges angles, sorted in ascending order
+ */
+void TetraPatternEdges(const Vec3 *spatials, decimal *edges) {
+    int numEdges = 0;
+    for (int i = 0; i < kTetraPatternSize; i++) {
+        for (int j = i+1; j < kTetraPatternSize; j++) {
+            edges[numEdges++] = AngleUnit(spatials[i], spatials[j]);
+        }
+    }
+    std::sort(edges, edges + kTetraNumEdges);
+}
+
+/// Quantize an edge ratio (which is always in [0,1]) into one of numBins bins
+static long TetraBin(decimal ratio, long numBins) {
+    long bin = (long)(ratio * numBins);
+    return std::max(0L, std::min(bin, numBins - 1));
+}
+
+/// Combine the bins of all kTetraNumEdges-1 edge ratios of a pattern into one integer key
+static uint64_t TetraKey(const long *bins, long numBins) {
+    uint64_t key = 0;
+    for (int i = kTetraNumEdges-2; i >= 0; i--) {
+        key = key*numBins + bins[i];
+    }
+    return key;
+}
+
+/// The slot where probing for a key starts. Collisions are resolved by linear probing.
+static long TetraSlot(uint64_t key, long tableSize) {
+    // Fibonacci hashing; the middle bits of the product are the best mixed.
+    return (long)(((key * 0x9E3779B97F4A7C15ULL) >> 16) % (uint64_t)tableSize);
+}
+
+/**
+ * Choose the catalog stars that Tetra patterns are built from: The brightest stars, thinned out so
+ * that no two are within `separation` of each other. Otherwise the number of patterns would blow
+ * up in dense parts of the sky.
+ */
+static std::vector<int16_t> TetraPatternStars(const Catalog &catalog, decimal separation) {
+    std::vector<int16_t> byBrightness;
+    for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+        byBrightness.push_back(i);
+    }
+    std::stable_sort(byBrightness.begin(), byBrightness.end(), [&catalog](int16_t a, int16_t b) {
+        return catalog[a].magnitude < catalog[b].magnitude;
+    });
+
+    decimal maxCos = DECIMAL_COS(separation);
+    std::vector<int16_t> result;
+    for (int16_t candidate : byBrightness) {
+        bool tooClose = false;
+        for (int16_t kept : result) {
+            if (catalog[candidate].spatial * catalog[kept].spatial > maxCos) {
+                tooClose = true;
+                break;
+            }
+        }
+        if (!tooClose) {
+            result.push_back(candidate);
+        }
+    }
+    return result;
+}
+
+/**
+ Tetra database layout. The table has no particular alignment requirements beyond those of int16.
+
+     | size (bytes)                    | name        | description                                   |
+     |---------------------------------+-------------+-----------------------------------------------|
+     | 4                               | numBins     | How many bins each edge ratio is quantized to |
+     | sizeof decimal                  | maxAngle    | Upper bound on the longest edge of a pattern  |
+     | 4                               | numPatterns | Number of non-empty slots in the table        |
+     | 4                               | tableSize   | Number of slots in the table                  |
+     | 2*kTetraPatternSize*tableSize   | table       | Catalog indices of each pattern, or -1s       |
+ */
+
+/**
+ * Serialize a Tetra pattern database.
+ * @param maxAngle The longest edge allowed in any pattern. Should be no larger than the FOV.
+ * @param patternStarsPerFov Roughly how many pattern stars there should be in a circle of diameter maxAngle. More pattern stars make identification more likely to succeed, at the cost of a much larger database.
+ * @param numBins How many bins each edge ratio is quantized to when computing keys.
+ */
+void SerializeTetraDatabase(SerializeContext *ser, const Catalog &catalog,
+                            decimal maxAngle, decimal patternStarsPerFov, long numBins) {
+    assert(numBins > 0);
+    assert(patternStarsPerFov > 0);
+
+    // the same density heuristic as the original Tetra implementation
+    decimal separation = DECIMAL(0.6) * maxAngle / DECIMAL_SQRT(patternStarsPerFov);
+    std::vector<int16_t> patternStars = TetraPatternStars(catalog, separation);
+    decimal minCos = DECIMAL_COS(maxAngle);
+
+    std::vector<int16_t> patterns; // kTetraPatternSize indices per pattern
+    for (int a = 0; a < (int)patternStars.size(); a++) {
+        const Vec3 &aSpatial = catalog[patternStars[a]].spatial;
+        // only consider stars after `a`, so that each pattern is generated exactly once
+        std::vector<int16_t> neighbors;
+        for (int b = a+1; b < (int)patternStars.size(); b++) {
+            if (aSpatial * catalog[patternStars[b]].spatial >= minCos) {
+                neighbors.push_back(patternStars[b]);
+            }
+        }
+
+        for (int i = 0; i < (int)neighbors.size(); i++) {
+            for (int j = i+1; j < (int)neighbors.size(); j++) {
+                if (catalog[neighbors[i]].spatial * catalog[neighbors[j]].spatial < minCos) {
+                    continue;
+                }
+                for (int k = j+1; k < (int)neighbors.size(); k++) {
+                    if (catalog[neighbors[i]].spatial * catalog[neighbors[k]].spatial < minCos
+                        || catalog[neighbors[j]].spatial * catalog[neighbors[k]].spatial < minCos) {
+                        continue;
+                    }
+                    patterns.push_back(patternStars[a]);
+                    patterns.push_back(neighbors[i]);
+                    patterns.push_back(neighbors[j]);
+                    patterns.push_back(neighbors[k]);
+                }
+            }
+        }
+    }
+
+    long numPatterns = patterns.size() / kTetraPatternSize;
+    // keep the load factor under one half, so that probe sequences stay short
+    long tableSize = 2*numPatterns + 1;
+    std::vector<int16_t> table(tableSize*kTetraPatternSize, -1);
+    for (long p = 0; p < numPatterns; p++) {
+        const int16_t *pattern = &patterns[p*kTetraPatternSize];
+        Vec3 spatials[kTetraPatternSize];
+        for (int i = 0; i < kTetraPatternSize; i++) {
+            spatials[i] = catalog[pattern[i]].spatial;
+        }
+        decimal edges[kTetraNumEdges];
+        TetraPatternEdges(spatials, edges);
+        long bins[kTetraNumEdges-1];
+        for (int i = 0; i < kTetraNumEdges-1; i++) {
+            bins[i] = TetraBin(edges[i] / edges[kTetraNumEdges-1], numBins);
+        }
+
+        long slot = TetraSlot(TetraKey(bins, numBins), tableSize);
+        while (table[slot*kTetraPatternSize] != -1) {
+            slot = (slot+1) % tableSize;
+        }
+        std::copy(pattern, pattern+kTetraPatternSize, &table[slot*kTetraPatternSize]);
+    }
+
+    SerializePrimitive<int32_t>(ser, numBins);
+    SerializePrimitive<decimal>(ser, maxAngle);
+    SerializePrimitive<int32_t>(ser, numPatterns);
+    SerializePrimitive<int32_t>(ser, tableSize);
+    SerializeArray<int16_t>(ser, table.data(), table.size());
+}
+
+/// Create the database from a serialized buffer.
+TetraDatabase::TetraDatabase(DeserializeContext *des) {
+    numBins = DeserializePrimitive<int32_t>(des);
+    maxAngle = DeserializePrimitive<decimal>(des);
+    numPatterns = DeserializePrimitive<int32_t>(des);
+    tableSize = DeserializePrimitive<int32_t>(des);
+    table = DeserializeArray<int16_t>(des, tableSize*kTetraPatternSize);
+}
+
+/**
+ * Find all stored patterns whose edge ratios are each within ratioTolerance of the given ones.
+ * @param edgeRatios kTetraNumEdges-1 ratios in ascending order: Each edge but the longest, divided by the longest.
+ * @return Pointers to the kTetraPatternSize catalog indices of each matching pattern. The stars within a pattern are in no particular order.
+ */
+std::vector<const int16_t *> TetraDatabase::FindPatterns(const Catalog &catalog,
+                                                         const decimal *edgeRatios, decimal ratioTolerance) const {
+    std::vector<const int16_t *> result;
+
+    long minBins[kTetraNumEdges-1];
+    long maxBins[kTetraNumEdges-1];
+    long bins[kTetraNumEdges-1];
+    for (int i = 0; i < kTetraNumEdges-1; i++) {
+        minBins[i] = TetraBin(edgeRatios[i] - ratioTolerance, numBins);
+        maxBins[i] = TetraBin(edgeRatios[i] + ratioTolerance, numBins);
+        bins[i] = minBins[i];
+    }
+
+    // visit every key in the tolerance box, odometer-style
+    while (true) {
+        uint64_t key = TetraKey(bins, numBins);
+        for (long slot = TetraSlot(key, tableSize);
+             table[slot*kTetraPatternSize] != -1;
+             slot = (slot+1) % tableSize) {
+
+            const int16_t *pattern = &table[slot*kTetraPatternSize];
+            Vec3 spatials[kTetraPatternSize];
+            for (int i = 0; i < kTetraPatternSize; i++) {
+                spatials[i] = catalog[pattern[i]].spatial;
+            }
+            decimal edges[kTetraNumEdges];
+            TetraPatternEdges(spatials, edges);
+
+            bool matches = true;
+            long patternBins[kTetraNumEdges-1];
+            for (int i = 0; i < kTetraNumEdges-1; i++) {
+                decimal ratio = edges[i] / edges[kTetraNumEdges-1];
+                patternBins[i] = TetraBin(ratio, numBins);
+                if (DECIMAL_ABS(ratio - edgeRatios[i]) > ratioTolerance) {
+                    matches = false;
+                }
+            }
+            // Probe sequences of different keys may overlap. Only returning patterns from the probe
+            // sequence of their own key ensures that no pattern is returned twice.
+            if (matches && TetraKey(patternBins, numBins) == key) {
+                result.push_back(pattern);
+            }
+        }
+
+        int i = 0;
+        while (i < kTetraNumEdges-1 && bins[i] == maxBins[i]) {
+            bins[i] = minBins[i];
+            i++;
+        }
+        if (i == kTetraNumEdges-1) {
+            break;
+        }
+        bins[i]++;
+    }
+
+    return result;
+}
+
+const int32_t SkyIndexDatabase::kMagicValue = 0x5c1d0001;
+
+/// Number of right ascension cells in a band, chosen so the cells are about as wide as they are tall
+static long SkyIndexBandCells(long band, long numBands) {
+    decimal bandHeight = DECIMAL_M_PI / numBands;
+    decimal centerDe = -DECIMAL_M_PI/2 + (band + DECIMAL(0.5))*bandHeight;
+    return std::max(1L, (long)DECIMAL_ROUND(2*DECIMAL_M_PI*DECIMAL_COS(centerDe) / bandHeight));
+}
+
+/// The band containing the given declination
+static long SkyIndexBand(decimal de, long numBands) {
+    long band = (long)((de + DECIMAL_M_PI/2) / (DECIMAL_M_PI / numBands));
+    return std::max(0L, std::min(band, numBands-1));
+}
+
+/// The cell, within its band, containing the given right ascension
+static long SkyIndexBandCell(decimal ra, long numBandCells) {
+    long cell = (long)DECIMAL_FLOOR(ra / (2*DECIMAL_M_PI) * numBandCells);
+    return ((cell % numBandCells) + numBandCells) % numBandCells;
+}
+
+/**
+ Sky index layout.
+
+     | size (bytes)     | name       | description                                                 |
+     |------------------+------------+-------------------------------------------------------------|
+     | 4                | numBands   | Number of declination bands                                 |
+     | 4                | numCells   | Total number of cells in all bands                          |
+     | 4*(numBands+1)   | bandStarts | Index of the first cell of each band, plus one past the end |
+     | 4*(numCells+1)   | cellStarts | Index in `stars` of the first star of each cell, plus end   |
+     | 2*catalog size   | stars      | Catalog indices, grouped by cell                            |
+ */
+
+/**
+ * Serialize a sky index of every star in the catalog.
+ * @param numBands How many declination bands to split the sky into. The cells are about 180/numBands degrees across.
+ */
+void SerializeSkyIndex(SerializeContext *ser, const Catalog &catalog, long numBands) {
+    assert(numBands > 0);
+
+    std::vector<int32_t> bandStarts;
+    long numCells = 0;
+    for (long band = 0; band < numBands; band++) {
+        bandStarts.push_back(numCells);
+        numCells += SkyIndexBandCells(band, numBands);
+    }
+    bandStarts.push_back(numCells);
+
+    std::vector<std::vector<int16_t>> cells(numCells);
+    for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+        decimal ra, de;
+        SpatialToSpherical(catalog[i].spatial, &ra, &de);
+        long band = SkyIndexBand(de, numBands);
+        cells[bandStarts[band] + SkyIndexBandCell(ra, SkyIndexBandCells(band, numBands))].push_back(i);
+    }
+
+    SerializePrimitive<int32_t>(ser, numBands);
+    SerializePrimitive<int32_t>(ser, numCells);
+    SerializeArray<int32_t>(ser, bandStarts.data(), bandStarts.size());
+    int32_t cellStart = 0;
+    for (const std::vector<int16_t> &cell : cells) {
+        SerializePrimitive<int32_t>(ser, cellStart);
+        cellStart += cell.size();
+    }
+    SerializePrimitive<int32_t>(ser, cellStart);
+    for (const std::vector<int16_t> &cell : cells) {
+        SerializeArray<int16_t>(ser, cell.data(), cell.size());
+    }
+}
+
+/// Create the database from a serialized buffer.
+SkyIndexDatabase::SkyIndexDatabase(DeserializeContext *des) {
+    numBands = DeserializePrimitive<int32_t>(des);
+    numCells = DeserializePrimitive<int32_t>(des);
+    bandStarts = DeserializeArray<int32_t>(des, numBands+1);
+    cellStarts = DeserializeArray<int32_t>(des, numCells+1);
+    stars = DeserializeArray<int16_t>(des, cellStarts[numCells]);
+}
+
+/**
+ * Return at least all the catalog stars within `radius` of `center`.
+ * Also returns some stars a bit further away, from the cells on the edge of the cone.
+ * @param center Unit vector
+ */
+std::vector<int16_t> SkyIndexDatabase::ConeQuery(const Vec3 &center, decimal radius) const {
+    std::vector<int16_t> result;
+    decimal ra, de;
+    SpatialToSpherical(center, &ra, &de);
+
+    decimal minDe = de - radius;
+    decimal maxDe = de + radius;
+    // If the cone contains a pole, every band it touches is covered all the way around.
+    bool containsPole = minDe <= -DECIMAL_M_PI/2 || maxDe >= DECIMAL_M_PI/2;
+    // The cone is widest in right ascension at this declination
+    decimal widestDe = containsPole ? 0 : DECIMAL_ASIN(std::max(DECIMAL(-1.0), std::min(DECIMAL(1.0), DECIMAL_SIN(de) / DECIMAL_COS(radius))));
+
+    decimal bandHeight = DECIMAL_M_PI / numBands;
+    for (long band = SkyIndexBand(minDe, numBands); band <= SkyIndexBand(maxDe, numBands); band++) {
+        long numBandCells = bandStarts[band+1] - bandStarts[band];
+        long firstCell = 0;
+        long numQueryCells = numBandCells;
+        if (!containsPole) {
+            // Only the part of the band the cone overlaps, where it's widest within the band
+            decimal bandMinDe = std::max(minDe, -DECIMAL_M_PI/2 + band*bandHeight);
+            decimal bandMaxDe = std::min(maxDe, -DECIMAL_M_PI/2 + (band+1)*bandHeight);
+            decimal bandWidestDe = std::max(bandMinDe, std::min(bandMaxDe, widestDe));
+            // From the spherical law of cosines, for the point on the edge of the cone at that declination
+            decimal cosRaRadius = (DECIMAL_COS(radius) - DECIMAL_SIN(bandWidestDe)*DECIMAL_SIN(de))
+                / (DECIMAL_COS(bandWidestDe)*DECIMAL_COS(de));
+            if (cosRaRadius > -1) {
+                decimal raRadius = DECIMAL_ACOS(std::min(DECIMAL(1.0), cosRaRadius));
+                firstCell = SkyIndexBandCell(ra - raRadius, numBandCells);
+                long lastCell = SkyIndexBandCell(ra + raRadius, numBandCells);
+                numQueryCells = std::min(numBandCells, (lastCell - firstCell + numBandCells) % numBandCells + 1);
+            }
+        }
+        for (long i = 0; i < numQueryCells; i++) {
+            long cell = bandStarts[band] + (firstCell + i) % numBandCells;
+            result.insert(result.end(), &stars[cellStarts[cell]], &stars[cellStarts[cell+1]]);
+        }
+    }
+    return result;
+}
+
+const int32_t NeighborAdjacencyDatabase::kMagicValue = 0x4e1b0001;
+
+/**
+ Neighbor adjacency layout.
+
+     | size (bytes)          | name        | description                                            |
+     |-----------------------+-------------+--------------------------------------------------------|
+     | sizeof decimal        | maxDistance | Upper bound on stored neighbor distances               |
+     | 4                     | numStars    | Number of catalog stars                                |
+     | 4*(numStars+1)        | starts      | Index of the first neighbor of each star, plus the end |
+     | sizeof decimal*num    | distances   | Distance to each neighbor, increasing within each star |
+     | 2*num                 | neighbors   | Catalog index of each neighbor                         |
+ */
+
+/**
+ * Serialize the neighbors of every star in the catalog.
+ * @param maxDistance Stars further apart than this (radians) are not neighbors.
+ * @param numThreads Threads to find the pairs with, as in SerializePairDistanceKVector
+ */
+void SerializeNeighborAdjacency(SerializeContext *ser, const Catalog &catalog, decimal maxDistance, int numThreads) {
+    std::vector<std::vector<std::pair<decimal, int16_t>>> adjacency(catalog.size());
+    for (const KVectorPair &pair : CatalogToPairDistances(catalog, 0, maxDistance, numThreads)) {
+        adjacency[pair.index1].emplace_back(pair.distance, pair.index2);
+        adjacency[pair.index2].emplace_back(pair.distance, pair.index1);
+    }
+    for (std::vector<std::pair<decimal, int16_t>> &neighbors : adjacency) {
+        std::sort(neighbors.begin(), neighbors.end());
+    }
+
+    SerializePrimitive<decimal>(ser, maxDistance);
+    SerializePrimitive<int32_t>(ser, catalog.size());
+    int32_t start = 0;
+    for (const std::vector<std::pair<decimal, int16_t>> &neighbors : adjacency) {
+        SerializePrimitive<int32_t>(ser, start);
+        start += neighbors.size();
+    }
+    SerializePrimitive<int32_t>(ser, start);
+    ser->Reserve(start*(sizeof(decimal) + sizeof(int16_t)));
+    for (const std::vector<std::pair<decimal, int16_t>> &neighbors : adjacency) {
+        for (const std::pair<decimal, int16_t> &neighbor : neighbors) {
+            SerializePrimitive<decimal>(ser, neighbor.first);
+        }
+    }
+    for (const std::vector<std::pair<decimal, int16_t>> &neighbors : adjacency) {
+        for (const std::pair<decimal, int16_t> &neighbor : neighbors) {
+            SerializePrimitive<int16_t>(ser, neighbor.second);
+        }
+    }
+}
+
+/// Create the database from a serialized buffer.
+NeighborAdjacencyDatabase::NeighborAdjacencyDatabase(DeserializeContext *des) {
+    maxDistance = DeserializePrimitive<decimal>(des);
+    numStars = DeserializePrimitive<int32_t>(des);
+    starts = DeserializeArray<int32_t>(des, numStars+1);
+    distances = DeserializeArray<decimal>(des, starts[numStars]);
+    neighbors = DeserializeArray<int16_t>(des, starts[numStars]);
+}
+
+/**
+ * Return exactly the neighbors of `star` whose distance from it is in [min,max], closest first.
+ * @param end[out] Is set to an off-the-end pointer of the returned neighbors
+ */
+const int16_t *NeighborAdjacencyDatabase::FindNeighbors(int16_t star, decimal min, decimal max,
+                                                        const int16_t **end) const {
+    assert(star >= 0 && star < numStars);
+    const decimal *first = std::lower_bound(&distances[starts[star]], &distances[starts[star+1]], min);
+    const decimal *last = std::upper_bound(first, &distances[starts[star+1]], max);
+    *end = &neighbors[last - distances];
+    return &neighbors[first - distances];
+}
+
 /**
    MultiDatabase memory layout:
 
@@ -350,17 +1469,50 @@ const unsigned char *MultiDatabase::SubDatabasePointer(int32_t magicValue) const
     assert(false);
 }
 
+/**
+ * Serialize the header of a sub-database. Serialize the sub-database itself right afterwards, then
+ * call SerializeMultiDatabaseEntryEnd(), which fills in its length. This way, sub-databases can be
+ * serialized straight into the multi-database, without a copy of each one.
+ * @return Where the length is, to pass to SerializeMultiDatabaseEntryEnd()
+ */
+size_t SerializeMultiDatabaseEntryStart(SerializeContext *ser, int32_t magicValue, uint32_t flags) {
+    SerializePrimitive<int32_t>(ser, magicValue);
+    SerializePrimitive<uint32_t>(ser, flags);
+    size_t lengthOffset = ser->Size();
+    SerializePrimitive<uint32_t>(ser, 0); // filled in once we know it
+    SerializePadding<uint64_t>(ser);
+    return lengthOffset;
+}
+
+/// Fill in the length of the sub-database started by SerializeMultiDatabaseEntryStart()
+void SerializeMultiDatabaseEntryEnd(SerializeContext *ser, size_t lengthOffset) {
+    size_t databaseOffset = (lengthOffset + sizeof(uint32_t) + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+    size_t length = ser->Size() - databaseOffset;
+    if (length > UINT32_MAX) {
+        std::cerr << "Sub-database is " << length << " bytes long, but at most " << UINT32_MAX << " are allowed." << std::endl;
+        exit(1);
+    }
+    unsigned char lengthBytes[sizeof(uint32_t)];
+    uint32_t length32 = length;
+    memcpy(lengthBytes, &length32, sizeof(uint32_t));
+    SwapEndiannessIfNecessary<uint32_t>(lengthBytes, ser);
+    ser->Overwrite(lengthOffset, lengthBytes, sizeof(uint32_t));
+}
+
+/// Mark the end of a multi-database, after all its sub-databases
+void SerializeMultiDatabaseEnd(SerializeContext *ser) {
+    SerializePrimitive<int32_t>(ser, 0); // caboose
+}
+
 void SerializeMultiDatabase(SerializeContext *ser,
                             const MultiDatabaseDescriptor &dbs,
                             uint32_t flags) {
     for (const MultiDatabaseEntry &multiDbEntry : dbs) {
-        SerializePrimitive<int32_t>(ser, multiDbEntry.magicValue);
-        SerializePrimitive<uint32_t>(ser, flags);
-        SerializePrimitive<uint32_t>(ser, multiDbEntry.bytes.size());
-        SerializePadding<uint64_t>(ser);
-        std::copy(multiDbEntry.bytes.cbegin(), multiDbEntry.bytes.cend(), std::back_inserter(ser->buffer));
+        size_t lengthOffset = SerializeMultiDatabaseEntryStart(ser, multiDbEntry.magicValue, flags);
+        ser->Write(multiDbEntry.bytes.data(), multiDbEntry.bytes.size());
+        SerializeMultiDatabaseEntryEnd(ser, lengthOffset);
     }
-    SerializePrimitive<int32_t>(ser, 0); // caboose
+    SerializeMultiDatabaseEnd(ser);
 }
 
 }
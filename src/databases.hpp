@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <vector>
+#include <utility>
 
 #include "star-utils.hpp"
 #include "serialize-helpers.hpp"
@@ -29,6 +30,10 @@ public:
     /// The number of data points in the data referred to by the kvector
     long NumValues() const { return numValues; };
     long NumBins() const { return numBins; };
+    /// The width of each bin
+    decimal BinWidth() const { return binWidth; };
+    /// The number of data points in bins up to and including \p bin
+    long NumValuesUpTo(long bin) const { return bins[bin]; };
     /// Upper bound on elements
     decimal Max() const { return max; };
     // Lower bound on elements
@@ -44,7 +49,18 @@ private:
     const int32_t *bins;
 };
 
-void SerializePairDistanceKVector(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance, long numBins);
+void SerializePairDistanceKVector(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance, long numBins,
+                                  int numThreads = 1);
+
+/// A run of consecutive pairs in a PairDistanceKVectorDatabase, returned by a batched query
+struct PairDistanceSpan {
+    /// First catalog index of the first pair in the span
+    const int16_t *begin;
+    /// Off-the-end pointer
+    const int16_t *end;
+    /// How many of the batched queries returned these pairs
+    int multiplicity;
+};
 
 /**
  * A database storing distances between pairs of stars.
@@ -56,6 +72,7 @@ public:
     explicit PairDistanceKVectorDatabase(DeserializeContext *des);
 
     const int16_t *FindPairsLiberal(decimal min, decimal max, const int16_t **end) const;
+    std::vector<PairDistanceSpan> FindPairsLiberalBatch(const std::vector<std::pair<decimal, decimal>> &ranges) const;
     const int16_t *FindPairsExact(const Catalog &, decimal min, decimal max, const int16_t **end) const;
     std::vector<decimal> StarDistances(int16_t star, const Catalog &) const;
 
@@ -65,6 +82,7 @@ public:
     decimal MinDistance() const { return index.Min(); };
     /// Exact number of stored pairs
     long NumPairs() const;
+    long MaxPairsPerStarInQuery(decimal queryWidth) const;
 
     /// Magic value to use when storing inside a MultiDatabase
     static const int32_t kMagicValue; // 0x2536f009
@@ -76,22 +94,189 @@ private:
     const int16_t *pairs;
 };
 
-// /**
-//  * @brief Stores "inner angles" between star triples
-//  * @details Unsensitive to first-order error in basic camera
-//  * parameters (eg, wrong FOV or principal point), can be sensitive to second-order errors (eg,
-//  * camera distortion, which may cause the effective FOV or principal point to be different in
-//  * different parts of the image). Used for Mortari's Non-Dimensional Star-ID
-//  */
-// class TripleInnerKVectorDatabase {
-// public:
-//     explicit TripleInnerKVectorDatabase(const unsigned char *databaseBytes);
-
-//     void FindTriplesLiberal(decimal min, decimal max, long **begin, long **end) const;
-// private:
-//     KVectorIndex index;
-//     int16_t *triples;
-// };
+void SerializeCompactPairDistance(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance,
+                                  long numBins, int distanceBits, int numThreads = 1);
+
+/**
+ * A smaller version of PairDistanceKVectorDatabase, for when memory is tight.
+ * Pairs are split into bins by distance, like in a kvector. Within each bin, pairs are sorted and
+ * only the differences between consecutive pairs are stored, using a variable number of bits. Each
+ * pair also stores its distance within the bin, quantized to a few bits, so that queries can leave
+ * out pairs at the ends of the range without looking up the catalog. Pairs are decoded as they are
+ * queried, so queries return a copy instead of pointers into the database.
+ * @warning Queries may return pairs a bin width divided by 2^distanceBits outside the range
+ */
+class CompactPairDistanceDatabase {
+public:
+    explicit CompactPairDistanceDatabase(DeserializeContext *des);
+
+    void FindPairsLiberal(decimal min, decimal max, std::vector<int16_t> *pairs) const;
+    void FindPartnersLiberal(int16_t catalogIndex, decimal min, decimal max, std::vector<int16_t> *partners) const;
+
+    /// Upper bound on stored star pair distances
+    decimal MaxDistance() const { return max; };
+    /// Lower bound on stored star pair distances
+    decimal MinDistance() const { return min; };
+    /// Exact number of stored pairs
+    long NumPairs() const { return binStarts[numBins]; };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x2536f00b
+private:
+    long Bin(decimal distance) const;
+
+    decimal min;
+    decimal max;
+    decimal binWidth;
+    long numBins;
+    long numStars;
+    int distanceBits;
+    /// Catalog index of each star, by its number in the database
+    const int16_t *catalogIndices;
+    /// Number of each star in the database, by its catalog index
+    const int16_t *starNumbers;
+    /// Index of the first pair in each bin, plus one past the end
+    const int32_t *binStarts;
+    /// Offset into `stream` of the first byte of each bin
+    const int32_t *binOffsets;
+    /// Number of low bits stored directly (rather than in unary) for each difference in each bin
+    const uint8_t *riceParameters;
+    /// Number of bits of each offset in each bin
+    const uint8_t *offsetBits;
+    const unsigned char *stream;
+};
+
+/// Number of stars in each Tetra pattern
+const int kTetraPatternSize = 4;
+/// Number of edges between the stars of a Tetra pattern
+const int kTetraNumEdges = kTetraPatternSize*(kTetraPatternSize-1)/2;
+
+void TetraPatternEdges(const Vec3 *spatials, decimal *edges);
+
+void SerializeTetraDatabase(SerializeContext *, const Catalog &,
+                            decimal maxAngle, decimal patternStarsPerFov, long numBins);
+
+/**
+ * A database of 4-star patterns stored in an open-addressing hash table, used by Tetra.
+ * Each pattern is keyed by its 5 edge ratios (every edge divided by the longest one), each
+ * quantized into one of numBins bins. A query computes the key of an observed pattern and jumps
+ * straight to the matching slots, instead of doing a range query per edge like pair-distance
+ * algorithms do.
+ */
+class TetraDatabase {
+public:
+    explicit TetraDatabase(DeserializeContext *des);
+
+    std::vector<const int16_t *> FindPatterns(const Catalog &, const decimal *edgeRatios, decimal ratioTolerance) const;
+
+    /// Upper bound on the longest edge of any stored pattern
+    decimal MaxAngle() const { return maxAngle; };
+    /// Exact number of stored patterns
+    long NumPatterns() const { return numPatterns; };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x7e7a0001
+private:
+    long numBins;
+    decimal maxAngle;
+    long numPatterns;
+    long tableSize;
+    /// kTetraPatternSize catalog indices per slot. An empty slot starts with -1.
+    const int16_t *table;
+};
+
+void TriangleInnerAngles(const Vec3 &, const Vec3 &, const Vec3 &, decimal *angles);
+
+void SerializeTripleInnerKVector(SerializeContext *, const Catalog &, decimal minDistance, decimal maxDistance, long numBins);
+
+/**
+ * @brief Stores "inner angles" between star triples
+ * @details Unsensitive to first-order error in basic camera
+ * parameters (eg, wrong FOV or principal point), can be sensitive to second-order errors (eg,
+ * camera distortion, which may cause the effective FOV or principal point to be different in
+ * different parts of the image). Used for Mortari's Non-Dimensional Star-ID
+ *
+ * Each triple is keyed by its smallest inner angle. The stars of each triple are stored ordered by
+ * the inner angle at that star, smallest first.
+ */
+class TripleInnerKVectorDatabase {
+public:
+    explicit TripleInnerKVectorDatabase(DeserializeContext *des);
+
+    const int16_t *FindTriplesLiberal(decimal min, decimal max, const int16_t **end) const;
+
+    /// Upper bound on the distance between any two stars of a stored triple
+    decimal MaxDistance() const { return maxDistance; };
+    /// Lower bound on the distance between any two stars of a stored triple
+    decimal MinDistance() const { return minDistance; };
+    /// Exact number of stored triples
+    long NumTriples() const { return index.NumValues(); };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x3a7b1c02
+private:
+    decimal minDistance;
+    decimal maxDistance;
+    KVectorIndex index;
+    const int16_t *triples;
+};
+
+void SerializeSkyIndex(SerializeContext *, const Catalog &, long numBands);
+
+/**
+ * A coarse spatial index over the celestial sphere, for finding the catalog stars near a direction.
+ * The sky is split into declination bands of equal height, and each band into right ascension cells
+ * of roughly the same width, so that cells are about square. Each cell lists the stars inside it.
+ */
+class SkyIndexDatabase {
+public:
+    explicit SkyIndexDatabase(DeserializeContext *des);
+
+    std::vector<int16_t> ConeQuery(const Vec3 &center, decimal radius) const;
+
+    /// Number of declination bands
+    long NumBands() const { return numBands; };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x5c1d0001
+private:
+    long numBands;
+    long numCells;
+    /// Index of the first cell of each band, plus one past the end
+    const int32_t *bandStarts;
+    /// Index into `stars` of the first star of each cell, plus one past the end
+    const int32_t *cellStarts;
+    const int16_t *stars;
+};
+
+void SerializeNeighborAdjacency(SerializeContext *, const Catalog &, decimal maxDistance, int numThreads = 1);
+
+/**
+ * For each catalog star, every other star within some max distance of it, sorted by distance.
+ * Finding the stars at a certain distance from one known star is then a binary search over that
+ * star's few dozen neighbors, instead of a pair-distance query which returns pairs involving any star.
+ */
+class NeighborAdjacencyDatabase {
+public:
+    explicit NeighborAdjacencyDatabase(DeserializeContext *des);
+
+    const int16_t *FindNeighbors(int16_t star, decimal min, decimal max, const int16_t **end) const;
+
+    /// Upper bound on the distance to any stored neighbor
+    decimal MaxDistance() const { return maxDistance; };
+    /// Number of catalog stars, i.e., the number of neighbor lists
+    long NumStars() const { return numStars; };
+
+    /// Magic value to use when storing inside a MultiDatabase
+    static const int32_t kMagicValue; // 0x4e1b0001
+private:
+    decimal maxDistance;
+    long numStars;
+    /// Index of the first neighbor of each star, plus one past the end
+    const int32_t *starts;
+    const decimal *distances;
+    const int16_t *neighbors;
+};
 
 /**
  * A database that contains multiple databases
@@ -122,6 +307,9 @@ public:
 
 typedef std::vector<MultiDatabaseEntry> MultiDatabaseDescriptor;
 
+size_t SerializeMultiDatabaseEntryStart(SerializeContext *, int32_t magicValue, uint32_t flags);
+void SerializeMultiDatabaseEntryEnd(SerializeContext *, size_t lengthOffset);
+void SerializeMultiDatabaseEnd(SerializeContext *);
 void SerializeMultiDatabase(SerializeContext *, const MultiDatabaseDescriptor &dbs, uint32_t flags);
 
 }
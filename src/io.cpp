@@ -9,10 +9,14 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <vector>
 #include <string>
 #include <fstream>
+#include <sstream>
 #include <iostream>
 #include <memory>
 #include <cstring>
@@ -273,31 +277,69 @@ typedef StarIdAlgorithm *(*StarIdAlgorithmFactory)();
 
 typedef AttitudeEstimationAlgorithm *(*AttitudeEstimationAlgorithmFactory)();
 
-SerializeContext serFromDbValues(const DatabaseOptions &values) {
-    return SerializeContext(values.swapIntegerEndianness, values.swapDecimalEndianness);
+SerializeContext serFromDbValues(const DatabaseOptions &values, SerializeSink *sink) {
+    return SerializeContext(values.swapIntegerEndianness, values.swapDecimalEndianness, sink);
 }
 
-MultiDatabaseDescriptor GenerateDatabases(const Catalog &catalog, const DatabaseOptions &values) {
-    MultiDatabaseDescriptor dbEntries;
+void GenerateDatabases(SerializeContext *ser, const Catalog &catalog, const DatabaseOptions &values, uint32_t flags) {
+    // the catalog alone is not useful to any star-id algorithm
+    if (!values.kvector && !values.compactKvector && !values.tripleInner && !values.tetra
+        && !values.skyIndex && !values.neighborAdjacency) {
+        std::cerr << "No database builder selected -- no database generated." << std::endl;
+        exit(1);
+    }
 
-    SerializeContext catalogSer = serFromDbValues(values);
-    // TODO decide why we have this inclMagnitude and inclName and if we should change that
-    SerializeCatalog(&catalogSer, catalog, false, true);
-    dbEntries.emplace_back(kCatalogMagicValue, catalogSer.buffer);
+    // each database is serialized straight into the multi-database
+    size_t lengthOffset = SerializeMultiDatabaseEntryStart(ser, kCatalogMagicValue, flags);
+    // TODO decide why we have this inclName and if we should change that
+    SerializeCatalog(ser, catalog, values.catalogMagnitudes, true);
+    SerializeMultiDatabaseEntryEnd(ser, lengthOffset);
 
     if (values.kvector) {
         decimal minDistance = DegToRad(values.kvectorMinDistance);
         decimal maxDistance = DegToRad(values.kvectorMaxDistance);
         long numBins = values.kvectorNumDistanceBins;
-        SerializeContext ser = serFromDbValues(values);
-        SerializePairDistanceKVector(&ser, catalog, minDistance, maxDistance, numBins);
-        dbEntries.emplace_back(PairDistanceKVectorDatabase::kMagicValue, ser.buffer);
-    } else {
-        std::cerr << "No database builder selected -- no database generated." << std::endl;
-        exit(1);
+        lengthOffset = SerializeMultiDatabaseEntryStart(ser, PairDistanceKVectorDatabase::kMagicValue, flags);
+        SerializePairDistanceKVector(ser, catalog, minDistance, maxDistance, numBins, values.threads);
+        SerializeMultiDatabaseEntryEnd(ser, lengthOffset);
+    }
+
+    if (values.compactKvector) {
+        lengthOffset = SerializeMultiDatabaseEntryStart(ser, CompactPairDistanceDatabase::kMagicValue, flags);
+        SerializeCompactPairDistance(ser, catalog,
+                                     DegToRad(values.kvectorMinDistance), DegToRad(values.kvectorMaxDistance),
+                                     values.compactKvectorNumBins, values.compactKvectorDistanceBits, values.threads);
+        SerializeMultiDatabaseEntryEnd(ser, lengthOffset);
+    }
+
+    if (values.tripleInner) {
+        decimal minDistance = DegToRad(values.tripleInnerMinDistance);
+        decimal maxDistance = DegToRad(values.tripleInnerMaxDistance);
+        lengthOffset = SerializeMultiDatabaseEntryStart(ser, TripleInnerKVectorDatabase::kMagicValue, flags);
+        SerializeTripleInnerKVector(ser, catalog, minDistance, maxDistance, values.tripleInnerNumBins);
+        SerializeMultiDatabaseEntryEnd(ser, lengthOffset);
     }
 
-    return dbEntries;
+    if (values.tetra) {
+        decimal maxAngle = DegToRad(values.tetraMaxAngle);
+        lengthOffset = SerializeMultiDatabaseEntryStart(ser, TetraDatabase::kMagicValue, flags);
+        SerializeTetraDatabase(ser, catalog, maxAngle, values.tetraPatternStarsPerFov, values.tetraNumBins);
+        SerializeMultiDatabaseEntryEnd(ser, lengthOffset);
+    }
+
+    if (values.skyIndex) {
+        lengthOffset = SerializeMultiDatabaseEntryStart(ser, SkyIndexDatabase::kMagicValue, flags);
+        SerializeSkyIndex(ser, catalog, values.skyIndexNumBands);
+        SerializeMultiDatabaseEntryEnd(ser, lengthOffset);
+    }
+
+    if (values.neighborAdjacency) {
+        lengthOffset = SerializeMultiDatabaseEntryStart(ser, NeighborAdjacencyDatabase::kMagicValue, flags);
+        SerializeNeighborAdjacency(ser, catalog, DegToRad(values.neighborAdjacencyMaxDistance), values.threads);
+        SerializeMultiDatabaseEntryEnd(ser, lengthOffset);
+    }
+
+    SerializeMultiDatabaseEnd(ser);
 }
 
 /// Print information about the camera in machine and human-readable form.
@@ -596,6 +638,7 @@ GeneratedPipelineInput::GeneratedPipelineInput(const Catalog &catalog,
                 // clamp to within 2 standard deviations for some reason:
                 inputStar.position.x += std::max(std::min(perturbation1DDistribution(*rng), 2*perturbationStddev), -2*perturbationStddev);
                 inputStar.position.y += std::max(std::min(perturbation1DDistribution(*rng), 2*perturbationStddev), -2*perturbationStddev);
+                inputStar.positionUncertainty = perturbationStddev;
             }
             // If it got perturbed outside of the sensor, don't add it.
             if (camera.InSensor(inputStar.position)
@@ -833,10 +876,223 @@ Pipeline::Pipeline(CentroidAlgorithm *centroidAlgorithm,
         this->attitudeEstimationAlgorithm = std::unique_ptr<AttitudeEstimationAlgorithm>(attitudeEstimationAlgorithm);
     }
     if (database) {
-        this->database = std::unique_ptr<unsigned char[]>(database);
+        this->database = std::unique_ptr<DatabaseBuffer>(new DatabaseBuffer(database));
+    }
+    LoadDatabaseCatalog();
+}
+
+/**
+ * Deserialize the catalog out of the database, if there is both, and give the star-id algorithm a
+ * view of it, so that neither is redone on every frame.
+ */
+void Pipeline::LoadDatabaseCatalog() {
+    databaseCatalog = nullptr;
+    catalogView = nullptr;
+    if (database) {
+        MultiDatabase multiDatabase(database->Bytes());
+        const unsigned char *catalogBuffer = multiDatabase.SubDatabasePointer(kCatalogMagicValue);
+        if (catalogBuffer != NULL) {
+            DeserializeContext des(catalogBuffer);
+            databaseCatalog = std::unique_ptr<Catalog>(new Catalog(DeserializeCatalog(&des, NULL, NULL)));
+            catalogView = std::unique_ptr<CatalogView>(new CatalogView(*databaseCatalog));
+        }
+    }
+    if (starIdAlgorithm) {
+        starIdAlgorithm->SetCatalogView(catalogView.get());
+    }
+}
+
+DatabaseBuffer::~DatabaseBuffer() {
+    if (mappedLength > 0) {
+        munmap(bytes, mappedLength);
+    } else {
+        delete[] bytes;
+    }
+}
+
+
+/// Read a whole database file into memory
+static std::unique_ptr<DatabaseBuffer> ReadDatabase(const std::string &path) {
+    std::fstream fs;
+    fs.open(path, std::fstream::in | std::fstream::binary);
+    fs.seekg(0, fs.end);
+    long length = fs.tellg();
+    fs.seekg(0, fs.beg);
+    if (fs.fail()) {
+        std::cerr << "Error reading database! " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    std::cerr << "Reading " << length << " bytes of database" << std::endl;
+    unsigned char *bytes = new unsigned char[length];
+    fs.read((char *)bytes, length);
+    std::cerr << "Done" << std::endl;
+    return std::unique_ptr<DatabaseBuffer>(new DatabaseBuffer(bytes));
+}
+
+/**
+ * Map a database file read-only into memory, so that nothing is read until a star-id algorithm
+ * touches it, and processes using the same file share the pages in the page cache.
+ * @param shared Use MAP_SHARED instead of MAP_PRIVATE. Since the mapping is read-only, either way
+ * shares the page cache; MAP_SHARED also sees changes to the file made while it's mapped.
+ * @param populate Read the whole file in up front (MAP_POPULATE), so later accesses don't page fault
+ * @param advice madvise hint: "normal", "random", "sequential", "willneed", or empty for none
+ */
+static std::unique_ptr<DatabaseBuffer> MapDatabase(const std::string &path, bool shared, bool populate,
+                                                   const std::string &advice) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        std::cerr << "Error reading database! " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    size_t length = fileStat.st_size;
+    std::cerr << "Mapping " << length << " bytes of database" << std::endl;
+
+    int flags = shared ? MAP_SHARED : MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (populate) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    void *mapped = mmap(NULL, length, PROT_READ, flags, fd, 0);
+    // the mapping keeps the file open
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Error mapping database! " << strerror(errno) << std::endl;
+        exit(1);
+    }
+
+    int adviceFlag;
+    if (advice == "") {
+        adviceFlag = -1;
+    } else if (advice == "normal") {
+        adviceFlag = MADV_NORMAL;
+    } else if (advice == "random") {
+        adviceFlag = MADV_RANDOM;
+    } else if (advice == "sequential") {
+        adviceFlag = MADV_SEQUENTIAL;
+    } else if (advice == "willneed") {
+        adviceFlag = MADV_WILLNEED;
+    } else {
+        std::cerr << "Illegal database advice." << std::endl;
+        exit(1);
+    }
+    if (adviceFlag >= 0 && madvise(mapped, length, adviceFlag) != 0) {
+        // just a hint, so carry on without it
+        std::cerr << "WARNING: madvise failed: " << strerror(errno) << std::endl;
+    }
+    return std::unique_ptr<DatabaseBuffer>(new DatabaseBuffer((unsigned char *)mapped, length));
+}
+
+/// Read or map the database, as the options say
+static std::unique_ptr<DatabaseBuffer> LoadDatabase(const PipelineOptions &values) {
+    if (values.databaseMmap == "") {
+        return ReadDatabase(values.databasePath);
+    } else if (values.databaseMmap != "private" && values.databaseMmap != "shared") {
+        std::cerr << "Illegal database mmap mode." << std::endl;
+        exit(1);
     }
+    return MapDatabase(values.databasePath, values.databaseMmap == "shared",
+                       values.databasePopulate, values.databaseAdvice);
 }
 
+static IdentifyRemainingMode IdentifyRemainingModeFromOptions(const PipelineOptions &values) {
+    if (values.identifyRemaining == "projection") {
+        return IdentifyRemainingMode::Projection;
+    } else if (values.identifyRemaining != "pair-distance") {
+        std::cout << "Illegal identify remaining method." << std::endl;
+        exit(1);
+    }
+    return IdentifyRemainingMode::PairDistance;
+}
+
+/// Split a comma separated list from the command line
+static std::vector<std::string> SplitCommas(const std::string &list) {
+    std::vector<std::string> result;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        result.push_back(item);
+    }
+    return result;
+}
+
+/**
+ * Create the star-id algorithm called `name` on the command line, or NULL if there is none by that name.
+ * @param withFallback Whether algorithms which take a fallback algorithm (tracking and incremental)
+ * should fall back to pyramid, or to nothing.
+ */
+static StarIdAlgorithm *StarIdAlgorithmFromName(const std::string &name, const PipelineOptions &values,
+                                                IdentifyRemainingMode identifyRemaining, bool withFallback) {
+    StarIdAlgorithm *fallback = NULL;
+    if (withFallback && (name == "tracking" || name == "incremental")) {
+        fallback = StarIdAlgorithmFromName("py", values, identifyRemaining, false);
+        fallback->SetDeadline(values.starIdDeadlineUs);
+    }
+
+    if (name == "dummy") {
+        return new DummyStarIdAlgorithm();
+    } else if (name == "gv") {
+        return new GeometricVotingStarIdAlgorithm(DegToRad(values.angularTolerance), values.gvEarlyTermination);
+    } else if (name == "py") {
+        return new PyramidStarIdAlgorithm(DegToRad(values.angularTolerance), values.estimatedNumFalseStars, values.maxMismatchProb, 1000, identifyRemaining,
+                                          values.pyramidBrightestFirst, values.pyramidMagnitudeMargin, values.pyramidToleranceSigmas);
+    } else if (name == "nd") {
+        return new NonDimensionalStarIdAlgorithm(DegToRad(values.angularTolerance), values.focalLengthTolerance, 1000);
+    } else if (name == "tetra") {
+        return new TetraStarIdAlgorithm(DegToRad(values.angularTolerance), 1000);
+    } else if (name == "tracking") {
+        if (isnan(values.trackingRa) != isnan(values.trackingDe)) {
+            std::cerr << "--tracking-ra and --tracking-de must be given together." << std::endl;
+            exit(1);
+        }
+        if (values.trackingAngularRate * values.trackingFrameInterval < 0) {
+            std::cerr << "--tracking-angular-rate times --tracking-frame-interval must not be negative." << std::endl;
+            exit(1);
+        }
+        // without a prior, the first frame goes straight to the fallback
+        Attitude prior = Attitude();
+        if (!isnan(values.trackingRa)) {
+            prior = Attitude(SphericalToQuaternion(DegToRad(values.trackingRa),
+                                                   DegToRad(values.trackingDe),
+                                                   DegToRad(values.trackingRoll)));
+        }
+        return new TrackingStarIdAlgorithm(
+            DegToRad(values.angularTolerance), prior,
+            DegToRad(values.trackingAngularRate), values.trackingFrameInterval, fallback);
+    } else if (name == "incremental") {
+        return new IncrementalStarIdAlgorithm(
+            DegToRad(values.angularTolerance), values.incrementalMaxPixelMotion, fallback);
+    }
+    return NULL;
+}
+
+/**
+ * Create a CascadeStarIdAlgorithm from --cascade-stages, a comma separated list of star-id algorithm
+ * names, each optionally followed by a colon and that stage's deadline in microseconds.
+ */
+static StarIdAlgorithm *CascadeFromOptions(const PipelineOptions &values, IdentifyRemainingMode identifyRemaining) {
+    std::vector<StarIdAlgorithm *> stages;
+    for (const std::string &stage : SplitCommas(values.cascadeStages)) {
+        size_t colon = stage.find(':');
+        std::string name = stage.substr(0, colon);
+        // the stages fall back to each other instead
+        StarIdAlgorithm *algorithm = StarIdAlgorithmFromName(name, values, identifyRemaining, false);
+        if (algorithm == NULL) {
+            std::cout << "Illegal cascade stage: " << stage << std::endl;
+            exit(1);
+        }
+        if (colon != std::string::npos) {
+            algorithm->SetDeadline(atol(stage.substr(colon + 1).c_str()));
+        }
+        stages.push_back(algorithm);
+    }
+    if (stages.empty()) {
+        std::cout << "Cascade needs at least one stage." << std::endl;
+        exit(1);
+    }
+    return new CascadeStarIdAlgorithm(stages, values.cascadeMinStars);
+}
 
 /// Create a pipeline from command line options.
 Pipeline SetPipeline(const PipelineOptions &values) {
@@ -865,32 +1121,42 @@ Pipeline SetPipeline(const PipelineOptions &values) {
 
     // database stage
     if (values.databasePath != "") {
-        std::fstream fs;
-        fs.open(values.databasePath, std::fstream::in | std::fstream::binary);
-        fs.seekg(0, fs.end);
-        long length = fs.tellg();
-        fs.seekg(0, fs.beg);
-        if (fs.fail()) {
-            std::cerr << "Error reading database! " << strerror(errno) << std::endl;
-            exit(1);
+        result.database = LoadDatabase(values);
+    }
+
+    IdentifyRemainingMode identifyRemaining = IdentifyRemainingModeFromOptions(values);
+
+    // tracking tracks from the attitude estimated in the last frame, so without attitude estimation
+    // it would fall back every frame after the first
+    bool usesTracking = values.idAlgo == "tracking";
+    if (values.idAlgo == "cascade") {
+        for (const std::string &stage : SplitCommas(values.cascadeStages)) {
+            usesTracking = usesTracking || stage.substr(0, stage.find(':')) == "tracking";
         }
-        std::cerr << "Reading " << length << " bytes of database" << std::endl;
-        result.database = std::unique_ptr<unsigned char[]>(new unsigned char[length]);
-        fs.read((char *)result.database.get(), length);
-        std::cerr << "Done" << std::endl;
-    }
-
-    if (values.idAlgo == "dummy") {
-        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(new DummyStarIdAlgorithm());
-    } else if (values.idAlgo == "gv") {
-        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(new GeometricVotingStarIdAlgorithm(DegToRad(values.angularTolerance)));
-    } else if (values.idAlgo == "py") {
-        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(new PyramidStarIdAlgorithm(DegToRad(values.angularTolerance), values.estimatedNumFalseStars, values.maxMismatchProb, 1000));
-    } else if (values.idAlgo != "") {
-        std::cout << "Illegal id algorithm." << std::endl;
+    }
+    if (usesTracking && values.attitudeAlgo == "") {
+        std::cerr << "The tracking star-id algorithm (also as a cascade stage) needs --attitude-algo." << std::endl;
         exit(1);
     }
 
+    if (values.idAlgo == "cascade") {
+        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(CascadeFromOptions(values, identifyRemaining));
+    } else if (values.idAlgo != "") {
+        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(StarIdAlgorithmFromName(values.idAlgo, values, identifyRemaining, true));
+        if (!result.starIdAlgorithm) {
+            std::cout << "Illegal id algorithm." << std::endl;
+            exit(1);
+        }
+    }
+    if (result.starIdAlgorithm) {
+        result.starIdAlgorithm->SetDeadline(values.starIdDeadlineUs);
+    }
+    if (result.starIdAlgorithm && values.starIdCache > 0) {
+        result.starIdAlgorithm = std::unique_ptr<StarIdAlgorithm>(new CachedStarIdAlgorithm(
+            DegToRad(values.angularTolerance), values.starIdCache, result.starIdAlgorithm.release()));
+    }
+    result.LoadDatabaseCatalog();
+
     if (values.attitudeAlgo == "dqm") {
         result.attitudeEstimationAlgorithm = std::unique_ptr<AttitudeEstimationAlgorithm>(new DavenportQAlgorithm());
     } else if (values.attitudeAlgo == "triad") {
@@ -922,11 +1188,8 @@ PipelineOutput Pipeline::Go(const PipelineInput &input) {
 
     // if database is provided, that's where we get catalog from.
     if (database) {
-        MultiDatabase multiDatabase(database.get());
-        const unsigned char *catalogBuffer = multiDatabase.SubDatabasePointer(kCatalogMagicValue);
-        if (catalogBuffer != NULL) {
-            DeserializeContext des(catalogBuffer);
-            result.catalog = DeserializeCatalog(&des, NULL, NULL);
+        if (databaseCatalog) {
+            result.catalog = *databaseCatalog;
         } else {
             std::cerr << "WARNING: That database does not include a catalog. Proceeding with the full catalog." << std::endl;
             result.catalog = input.GetCatalog();
@@ -982,8 +1245,10 @@ PipelineOutput Pipeline::Go(const PipelineInput &input) {
         // TODO: don't copy the vector!
         std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
 
+        result.starIdStats = std::unique_ptr<StarIdStats>(new StarIdStats());
         result.starIds = std::unique_ptr<StarIdentifiers>(new std::vector<StarIdentifier>(
-            starIdAlgorithm->Go(database.get(), *inputStars, result.catalog, *input.InputCamera())));
+            starIdAlgorithm->Go(database->Bytes(), *inputStars, result.catalog, *input.InputCamera(),
+                                result.starIdStats.get())));
 
         std::chrono::time_point<std::chrono::steady_clock> end = std::chrono::steady_clock::now();
         result.starIdTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
@@ -1003,6 +1268,11 @@ PipelineOutput Pipeline::Go(const PipelineInput &input) {
 
         std::chrono::time_point<std::chrono::steady_clock> end = std::chrono::steady_clock::now();
         result.attitudeEstimationTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+        // track from this attitude in the next frame, or from nothing if it couldn't be estimated
+        if (starIdAlgorithm) {
+            starIdAlgorithm->SetPriorAttitude(*result.attitude);
+        }
     } else if (attitudeEstimationAlgorithm) {
         std::cerr << "ERROR: Attitude estimation algorithm set, but either star IDs or camera are missing. One reason this can happen: Setting a centroid algorithm and attitude algorithm, but no star-id algorithm -- that can't work because the input star-ids won't properly correspond to the output centroids!" << std::endl;
         exit(1);
@@ -1639,6 +1909,66 @@ static void PipelineComparatorPrintSpeed(std::ostream &os,
     }
 }
 
+/// Print the average and max of a star-id counter across all images.
+static void PrintStarIdCounter(std::ostream &os, const std::string &name, const std::vector<long long> &values) {
+    long long sum = 0;
+    long long max = 0;
+    for (long long value : values) {
+        sum += value;
+        max = std::max(max, value);
+    }
+    // fractional, since many algorithms only try one or two patterns per image
+    os << "starid_" << name << "_average " << (values.empty() ? 0 : (decimal)sum / values.size()) << std::endl;
+    os << "starid_" << name << "_max " << max << std::endl;
+}
+
+/// Print statistics about how much work the star-id algorithm did.
+static void PipelineComparatorPrintStarIdStats(std::ostream &os,
+                                               const PipelineInputList &,
+                                               const std::vector<PipelineOutput> &actual,
+                                               const PipelineOptions &) {
+    std::vector<long long> patternsTried;
+    std::vector<long long> databaseQueries;
+    std::vector<long long> candidatesExamined;
+    std::vector<long long> firstMatchTimes;
+    int numTimedOut = 0;
+    int numCacheHits = 0;
+    // number of images identified by each stage of a cascade
+    std::map<int, int> cascadeStages;
+    for (const PipelineOutput &output : actual) {
+        if (!output.starIdStats) {
+            continue;
+        }
+        if (output.starIdStats->cascadeStage >= 0) {
+            cascadeStages[output.starIdStats->cascadeStage]++;
+        }
+        patternsTried.push_back(output.starIdStats->patternsTried);
+        databaseQueries.push_back(output.starIdStats->databaseQueries);
+        candidatesExamined.push_back(output.starIdStats->candidatesExamined);
+        if (output.starIdStats->firstMatchTimeNs > 0) {
+            firstMatchTimes.push_back(output.starIdStats->firstMatchTimeNs);
+        }
+        if (output.starIdStats->timedOut) {
+            numTimedOut++;
+        }
+        if (output.starIdStats->cacheHit) {
+            numCacheHits++;
+        }
+    }
+    PrintStarIdCounter(os, "patterns_tried", patternsTried);
+    PrintStarIdCounter(os, "database_queries", databaseQueries);
+    PrintStarIdCounter(os, "candidates_examined", candidatesExamined);
+    os << "starid_num_images_matched " << firstMatchTimes.size() << std::endl;
+    os << "starid_num_images_timed_out " << numTimedOut << std::endl;
+    os << "starid_num_cache_hits " << numCacheHits << std::endl;
+    for (const auto &stage : cascadeStages) {
+        os << "starid_cascade_stage_" << stage.first << "_num_images " << stage.second << std::endl;
+    }
+    if (firstMatchTimes.size() > 0) {
+        PrintTimeStats(os, "starid_first_match", firstMatchTimes);
+    }
+}
+
 // TODO: add these debug comparators back in!
 // void PipelineComparatorPrintPairDistance(std::ostream &os,
 //                                          const PipelineInputList &expected,
@@ -1795,9 +2125,159 @@ void PipelineComparison(const PipelineInputList &expected,
                               PipelineComparatorPrintSpeed, values.printSpeed, false);
     }
 
+    if (values.printStarIdStats != "") {
+        LOST_PIPELINE_COMPARE(actual[0].starIdStats,
+                              "--print-starid-stats requires a star-id algorithm to have run.",
+                              PipelineComparatorPrintStarIdStats, values.printStarIdStats, false);
+    }
+
 #undef LOST_PIPELINE_COMPARE
 }
 
+/// The smallest of `sortedTimes` which at least `fraction` of them are less than or equal to
+static long long Percentile(const std::vector<long long> &sortedTimes, decimal fraction) {
+    assert(sortedTimes.size() > 0);
+    int index = std::max(0, (int)std::ceil(fraction * sortedTimes.size()) - 1);
+    return sortedTimes[index];
+}
+
+/**
+ * Time star-id algorithms on their own, without generating, centroiding, or printing anything in
+ * between. Centroid-only inputs are generated up front for each combination of false star count
+ * and centroid perturbation, then every algorithm runs on each input several times, with a new
+ * instance of the algorithm each time. For each algorithm and combination, prints the latency
+ * percentiles over all runs, plus the work counters and correctness of the first run of each input.
+ */
+void BenchmarkStarId(const PipelineOptions &values) {
+    if (values.databasePath == "") {
+        std::cerr << "ERROR: --benchmark-star-id requires a --database." << std::endl;
+        exit(1);
+    }
+    std::unique_ptr<DatabaseBuffer> database = LoadDatabase(values);
+    Catalog catalog;
+    MultiDatabase multiDatabase(database->Bytes());
+    const unsigned char *catalogBuffer = multiDatabase.SubDatabasePointer(kCatalogMagicValue);
+    if (catalogBuffer != NULL) {
+        DeserializeContext des(catalogBuffer);
+        catalog = DeserializeCatalog(&des, NULL, NULL);
+    } else {
+        catalog = CatalogRead();
+    }
+    // built once, like the pipeline does, so it isn't timed with each run
+    CatalogView catalogView(catalog);
+
+    std::vector<std::string> algoNames = SplitCommas(values.benchmarkStarIdAlgos != ""
+                                                     ? values.benchmarkStarIdAlgos
+                                                     : values.idAlgo);
+    IdentifyRemainingMode identifyRemaining = IdentifyRemainingModeFromOptions(values);
+    // Some algorithms remember earlier inputs (eg, incremental), so each run gets a new instance, or
+    // later runs would be timed with whatever the earlier, unrelated inputs left behind.
+    auto newAlgo = [&values, identifyRemaining, &catalogView](const std::string &name) {
+        StarIdAlgorithm *algo = name == "cascade"
+            ? CascadeFromOptions(values, identifyRemaining)
+            : StarIdAlgorithmFromName(name, values, identifyRemaining, true);
+        if (algo == NULL) {
+            std::cout << "Illegal id algorithm: " << name << std::endl;
+            exit(1);
+        }
+        algo->SetDeadline(values.starIdDeadlineUs);
+        algo->SetCatalogView(&catalogView);
+        return std::unique_ptr<StarIdAlgorithm>(algo);
+    };
+    // fail on unknown names before generating any inputs
+    for (const std::string &name : algoNames) {
+        newAlgo(name);
+    }
+    if (algoNames.empty()) {
+        std::cerr << "ERROR: --benchmark-star-id requires --star-id-algo or --benchmark-star-id-algos." << std::endl;
+        exit(1);
+    }
+
+    UserSpecifiedOutputStream pos(values.benchmarkStarId, false);
+    std::ostream &os = pos.Stream();
+    decimal focalLength = FocalLengthFromOptions(values, values.generateXRes);
+    Camera camera(focalLength, values.generateXRes, values.generateYRes);
+    Attitude motionBlurDirection = Attitude(SphericalToQuaternion(DegToRad(values.generateBlurRa),
+                                                                  DegToRad(values.generateBlurDe),
+                                                                  DegToRad(values.generateBlurRoll)));
+
+    for (const std::string &falseStarsString : SplitCommas(values.benchmarkFalseStars)) {
+        for (const std::string &perturbationString : SplitCommas(values.benchmarkPerturbations)) {
+            int numFalseStars = atoi(falseStarsString.c_str());
+            decimal perturbation = STR_TO_DECIMAL(perturbationString);
+
+            // same seed for every combination, so they differ only in false stars and perturbation
+            std::default_random_engine attitudeRng(values.generateSeed);
+            std::default_random_engine noiseRng(values.generateSeed);
+            PipelineInputList inputs;
+            for (int i = 0; i < values.benchmarkImages; i++) {
+                inputs.push_back(std::unique_ptr<PipelineInput>(new GeneratedPipelineInput(
+                    CatalogRead(), RandomAttitude(&attitudeRng), camera, &noiseRng,
+                    true,
+                    values.generateZeroMagPhotons, values.generateSpreadStdDev,
+                    values.generateSaturationPhotons, values.generateDarkCurrent,
+                    values.generateReadNoiseStdDev, motionBlurDirection, values.generateExposure,
+                    values.generateReadoutTime, values.generateShotNoise, values.generateOversampling,
+                    numFalseStars,
+                    (values.generateFalseMinMag * 100), (values.generateFalseMaxMag * 100),
+                    (values.generateCutoffMag * 100),
+                    perturbation)));
+            }
+
+            for (size_t a = 0; a < algoNames.size(); a++) {
+                std::vector<long long> times;
+                long long patternsTried = 0;
+                int numImagesCorrect = 0;
+                int numImagesIncorrect = 0;
+                int numTimedOut = 0;
+                for (const std::unique_ptr<PipelineInput> &input : inputs) {
+                    for (int repeat = 0; repeat < std::max(1, values.benchmarkRepeats); repeat++) {
+                        std::unique_ptr<StarIdAlgorithm> algo = newAlgo(algoNames[a]);
+                        StarIdStats stats;
+                        std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+                        StarIdentifiers starIds = algo->Go(database->Bytes(), *input->InputStars(), catalog,
+                                                               *input->InputCamera(), &stats);
+                        std::chrono::time_point<std::chrono::steady_clock> end = std::chrono::steady_clock::now();
+                        times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+                        if (repeat > 0) {
+                            continue;
+                        }
+
+                        patternsTried += stats.patternsTried;
+                        numTimedOut += stats.timedOut;
+                        StarIdComparison comparison =
+                            StarIdsCompare(*input->ExpectedStarIds(), starIds,
+                                           input->GetCatalog(), catalog,
+                                           values.centroidCompareThreshold,
+                                           *input->ExpectedStars(), *input->InputStars());
+                        // same definitions as --compare-star-ids
+                        if (comparison.numCorrect > 0 && comparison.numIncorrect == 0) {
+                            numImagesCorrect++;
+                        }
+                        if (comparison.numIncorrect > 0) {
+                            numImagesIncorrect++;
+                        }
+                    }
+                }
+                if (times.empty()) {
+                    continue;
+                }
+                std::sort(times.begin(), times.end());
+
+                std::string prefix = "starid_benchmark_" + algoNames[a]
+                    + "_false_" + falseStarsString + "_perturb_" + perturbationString;
+                os << prefix << "_p50_ns " << Percentile(times, DECIMAL(0.50)) << std::endl;
+                os << prefix << "_p95_ns " << Percentile(times, DECIMAL(0.95)) << std::endl;
+                os << prefix << "_p99_ns " << Percentile(times, DECIMAL(0.99)) << std::endl;
+                os << prefix << "_patterns_tried_average " << (decimal)patternsTried / inputs.size() << std::endl;
+                os << prefix << "_num_images_correct " << numImagesCorrect << std::endl;
+                os << prefix << "_num_images_incorrect " << numImagesIncorrect << std::endl;
+                os << prefix << "_num_images_timed_out " << numTimedOut << std::endl;
+            }
+        }
+    }
+}
+
 // TODO: Add CLI options for all the inspectors!
 
 // typedef void (*CatalogInspector)(const Catalog &);
@@ -198,6 +198,9 @@ struct PipelineOutput {
     long long starIdTimeNs = -1;
     long long attitudeEstimationTimeNs = -1;
 
+    /// Counters from the star-id stage. Null if it was not run.
+    std::unique_ptr<StarIdStats> starIdStats = nullptr;
+
     /**
      * @brief The catalog that the indices in starIds refer to
      * @todo Don't store it here
@@ -226,6 +229,29 @@ std::ostream &operator<<(std::ostream &, const Camera &);
 // PIPELINE //
 //////////////
 
+/**
+ * The raw bytes of a database file, kept in memory for as long as this exists.
+ * Either read into a buffer of its own, or mapped read-only into memory, in which case pages are
+ * only read from disk when first used, and every process mapping the same file shares one copy.
+ */
+class DatabaseBuffer {
+public:
+    /// Take ownership of bytes allocated with new[]
+    explicit DatabaseBuffer(unsigned char *bytes) : bytes(bytes), mappedLength(0) { };
+    /// Take ownership of a mapping of the given length made with mmap
+    DatabaseBuffer(unsigned char *bytes, size_t mappedLength) : bytes(bytes), mappedLength(mappedLength) { };
+    ~DatabaseBuffer();
+
+    DatabaseBuffer(const DatabaseBuffer &) = delete;
+    DatabaseBuffer &operator=(const DatabaseBuffer &) = delete;
+
+    const unsigned char *Bytes() const { return bytes; };
+private:
+    unsigned char *bytes;
+    /// Zero if `bytes` was allocated with new[]
+    size_t mappedLength;
+};
+
 /**
  * @brief A set of algorithms that describes all or part of the star-tracking "pipeline"
  * @details A centroiding algorithm identifies the (x,y) pixel coordinates of each star detected in the raw image. The star id algorithm then determines which centroid corresponds to which catalog star. Finally, the attitude estimation algorithm determines the orientation of the camera based on the centroids and identified stars.
@@ -246,9 +272,15 @@ private:
     int centroidMinMagnitude = 0;
     int centroidMinStars = 0;
 
+    void LoadDatabaseCatalog();
+
     std::unique_ptr<StarIdAlgorithm> starIdAlgorithm;
     std::unique_ptr<AttitudeEstimationAlgorithm> attitudeEstimationAlgorithm;
-    std::unique_ptr<unsigned char[]> database;
+    std::unique_ptr<DatabaseBuffer> database;
+    /// The catalog in the database, deserialized once when it was loaded. Null if it has none.
+    std::unique_ptr<Catalog> databaseCatalog;
+    /// View of databaseCatalog shared with the star-id algorithm
+    std::unique_ptr<CatalogView> catalogView;
 };
 
 Pipeline SetPipeline(const PipelineOptions &values);
@@ -258,6 +290,8 @@ void PipelineComparison(const PipelineInputList &expected,
                         const std::vector<PipelineOutput> &actual,
                         const PipelineOptions &values);
 
+void BenchmarkStarId(const PipelineOptions &values);
+
 /**
  * Compare expected and actual star identifications.
  * Useful for debugging and benchmarking.
@@ -291,11 +325,11 @@ public:
 #undef LOST_CLI_OPTION
 };
 
-SerializeContext serFromDbValues(const DatabaseOptions &values);
+SerializeContext serFromDbValues(const DatabaseOptions &values, SerializeSink *sink = nullptr);
 
-/// Appropriately create descriptors for all requested databases according to command-line options.
+/// Serialize a multi-database with all databases requested by command-line options.
 /// @sa SerializeMultiDatabase
-MultiDatabaseDescriptor GenerateDatabases(const Catalog &, const DatabaseOptions &values);
+void GenerateDatabases(SerializeContext *, const Catalog &, const DatabaseOptions &values, uint32_t flags);
 
 /////////////////////
 // INSPECT CATALOG //
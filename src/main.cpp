@@ -31,26 +31,39 @@ static void DatabaseBuild(const DatabaseOptions &values) {
     Catalog narrowedCatalog = NarrowCatalog(CatalogRead(), (int) (values.minMag * 100), values.maxStars, DegToRad(values.minSeparation));
     std::cerr << "Narrowed catalog has " << narrowedCatalog.size() << " stars." << std::endl;
 
-    MultiDatabaseDescriptor dbEntries = GenerateDatabases(narrowedCatalog, values);
-    SerializeContext ser = serFromDbValues(values);
-
     // Create & Set Flags.
     uint32_t dbFlags = 0;
     dbFlags |= typeid(decimal) == typeid(float) ? MULTI_DB_FLOAT_FLAG : 0;
 
-    // Serialize Flags
-    SerializeMultiDatabase(&ser, dbEntries, dbFlags);
+    UserSpecifiedOutputStream pos = UserSpecifiedOutputStream(values.outputPath, true);
+    // Stream the database straight to the output if sub-database lengths can be filled in once
+    // they're known, otherwise (eg, to a pipe) build the whole thing in memory first.
+    StreamSerializeSink sink(&pos.Stream());
+    SerializeContext ser = serFromDbValues(values, sink.CanOverwrite() ? &sink : nullptr);
 
-    std::cerr << "Generated database with " << ser.buffer.size() << " bytes" << std::endl;
-    std::cerr << "Database flagged with " << std::bitset<8*sizeof(dbFlags)>(dbFlags) << std::endl;
+    GenerateDatabases(&ser, narrowedCatalog, values, dbFlags);
 
-    UserSpecifiedOutputStream pos = UserSpecifiedOutputStream(values.outputPath, true);
-    pos.Stream().write((char *) ser.buffer.data(), ser.buffer.size());
+    std::cerr << "Generated database with " << ser.Size() << " bytes" << std::endl;
+    std::cerr << "Database flagged with " << std::bitset<8*sizeof(dbFlags)>(dbFlags) << std::endl;
 
+    if (sink.CanOverwrite()) {
+        ser.Flush();
+    } else {
+        pos.Stream().write((char *) ser.buffer.data(), ser.buffer.size());
+    }
+    pos.Stream().flush();
+    if (!pos.Stream()) {
+        std::cerr << "Error writing database to " << values.outputPath << std::endl;
+        exit(1);
+    }
 }
 
 /// Run a star-tracking pipeline (possibly including generating inputs and analyzing outputs) based on command line options in \p values.
 static void PipelineRun(const PipelineOptions &values) {
+    if (values.benchmarkStarId != "") {
+        BenchmarkStarId(values);
+        return;
+    }
     PipelineInputList input = GetPipelineInput(values);
     Pipeline pipeline = SetPipeline(values);
     std::vector<PipelineOutput> outputs = pipeline.Go(input);
@@ -28,12 +28,39 @@ LOST_CLI_OPTION("centroid-dummy-stars"     , int        , centroidDummyNumStars
 LOST_CLI_OPTION("centroid-mag-filter"      , decimal    , centroidMagFilter             , -1  , STR_TO_DECIMAL(optarg)  , 5)
 LOST_CLI_OPTION("centroid-filter-brightest", int        , centroidFilterBrightest       , -1  , atoi(optarg)            , 10)
 LOST_CLI_OPTION("database"                 , std::string, databasePath                  , ""  , optarg                  , kNoDefaultArgument)
+LOST_CLI_OPTION("database-mmap"            , std::string, databaseMmap                  , ""  , optarg                  , "shared")
+LOST_CLI_OPTION("database-populate"        , bool       , databasePopulate              , false, atobool(optarg)        , true)
+LOST_CLI_OPTION("database-advice"          , std::string, databaseAdvice                , ""  , optarg                  , kNoDefaultArgument)
 LOST_CLI_OPTION("star-id-algo"             , std::string, idAlgo                        , ""  , optarg                  , "pyramid")
+LOST_CLI_OPTION("star-id-deadline-us"      , long       , starIdDeadlineUs              , 0   , atol(optarg)            , kNoDefaultArgument)
+LOST_CLI_OPTION("cascade-stages"           , std::string, cascadeStages                 , "tracking,py,gv", optarg  , kNoDefaultArgument)
+LOST_CLI_OPTION("cascade-min-stars"        , long       , cascadeMinStars               , 4   , atol(optarg)            , kNoDefaultArgument)
+LOST_CLI_OPTION("star-id-cache"            , long       , starIdCache                   , 0   , atol(optarg)            , 64)
+LOST_CLI_OPTION("gv-early-termination"     , bool       , gvEarlyTermination            , false, atobool(optarg)        , true)
 LOST_CLI_OPTION("angular-tolerance"        , decimal    , angularTolerance              , .04 , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("focal-length-tolerance"   , decimal    , focalLengthTolerance          , .1  , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("tracking-ra"              , decimal    , trackingRa                    , NAN , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("tracking-de"              , decimal    , trackingDe                    , NAN , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("tracking-roll"            , decimal    , trackingRoll                  , 0   , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("tracking-angular-rate"    , decimal    , trackingAngularRate           , 1   , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("tracking-frame-interval"  , decimal    , trackingFrameInterval         , .1  , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("incremental-max-pixel-motion", decimal , incrementalMaxPixelMotion     , 10  , STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
 LOST_CLI_OPTION("false-stars-estimate"     , int        , estimatedNumFalseStars        , 500 , atoi(optarg)            , kNoDefaultArgument)
 LOST_CLI_OPTION("max-mismatch-probability" , decimal    , maxMismatchProb               , .001, STR_TO_DECIMAL(optarg)  , kNoDefaultArgument)
+LOST_CLI_OPTION("identify-remaining"       , std::string, identifyRemaining             , "pair-distance", optarg   , kNoDefaultArgument)
+LOST_CLI_OPTION("pyramid-brightest-first"  , int        , pyramidBrightestFirst         , 0   , atoi(optarg)            , 8)
+LOST_CLI_OPTION("pyramid-magnitude-margin" , decimal    , pyramidMagnitudeMargin        , -1  , STR_TO_DECIMAL(optarg)  , 1)
+LOST_CLI_OPTION("pyramid-tolerance-sigmas" , decimal    , pyramidToleranceSigmas        , 0   , STR_TO_DECIMAL(optarg)  , 3)
 LOST_CLI_OPTION("attitude-algo"            , std::string, attitudeAlgo                  , ""  , optarg                  , "dqm")
 
+// STAR-ID BENCHMARK
+LOST_CLI_OPTION("benchmark-star-id"         , std::string, benchmarkStarId         , "", optarg                 , "-")
+LOST_CLI_OPTION("benchmark-star-id-algos"   , std::string, benchmarkStarIdAlgos    , "", optarg                 , kNoDefaultArgument)
+LOST_CLI_OPTION("benchmark-false-stars"     , std::string, benchmarkFalseStars     , "0,100,1000", optarg       , kNoDefaultArgument)
+LOST_CLI_OPTION("benchmark-perturbations"   , std::string, benchmarkPerturbations  , "0,0.2,0.5", optarg        , kNoDefaultArgument)
+LOST_CLI_OPTION("benchmark-images"          , int        , benchmarkImages         , 100, atoi(optarg)          , kNoDefaultArgument)
+LOST_CLI_OPTION("benchmark-repeats"         , int        , benchmarkRepeats        , 3 , atoi(optarg)           , kNoDefaultArgument)
+
 // OUTPUT COMPARISON
 LOST_CLI_OPTION("centroid-compare-threshold", decimal    , centroidCompareThreshold, 2 , STR_TO_DECIMAL(optarg) , kNoDefaultArgument)
 LOST_CLI_OPTION("attitude-compare-threshold", decimal    , attitudeCompareThreshold, 1 , STR_TO_DECIMAL(optarg) , kNoDefaultArgument)
@@ -48,6 +75,7 @@ LOST_CLI_OPTION("print-actual-centroids"    , std::string, printActualCentroids
 LOST_CLI_OPTION("print-attitude"            , std::string, printAttitude           , "", optarg                 , "-")
 LOST_CLI_OPTION("print-expected-attitude"   , std::string, printExpectedAttitude   , "", optarg                 , "-")
 LOST_CLI_OPTION("print-speed"               , std::string, printSpeed              , "", optarg                 , "-")
+LOST_CLI_OPTION("print-starid-stats"        , std::string, printStarIdStats        , "", optarg                 , "-")
 LOST_CLI_OPTION("compare-centroids"         , std::string, compareCentroids        , "", optarg                 , "-")
 LOST_CLI_OPTION("compare-star-ids"          , std::string, compareStarIds          , "", optarg                 , "-")
 LOST_CLI_OPTION("compare-attitudes"         , std::string, compareAttitudes        , "", optarg                 , "-")
@@ -17,8 +17,10 @@
 #ifndef SERIALIZE_HELPERS_H
 #define SERIALIZE_HELPERS_H
 
+#include <assert.h>
 #include <string.h>
 
+#include <ostream>
 #include <utility>
 #include <vector>
 #include <algorithm>
@@ -27,15 +29,116 @@
 
 namespace lost {
 
+/**
+ * Where a SerializeContext passes serialized bytes on to, so that they don't all have to be kept in
+ * memory. Bytes arrive in order, in large chunks, but a few may later be overwritten, eg to fill in
+ * the length of a sub-database once it's known.
+ */
+class SerializeSink {
+public:
+    virtual ~SerializeSink() { };
+
+    /// Append bytes to the end of the output
+    virtual void Write(const unsigned char *bytes, size_t length) = 0;
+    /// Replace bytes that were already written, starting `offset` bytes into the output
+    virtual void Overwrite(size_t offset, const unsigned char *bytes, size_t length) = 0;
+};
+
+/// Writes to an output stream, which must be seekable (eg, a file, but not a pipe) to overwrite bytes.
+class StreamSerializeSink : public SerializeSink {
+public:
+    explicit StreamSerializeSink(std::ostream *stream) : stream(stream), start(stream->tellp()) { };
+
+    /// Whether bytes can be overwritten, i.e., whether the stream is seekable
+    bool CanOverwrite() const { return start != std::streampos(-1); };
+
+    void Write(const unsigned char *bytes, size_t length) override {
+        stream->write((const char *)bytes, length);
+    }
+
+    void Overwrite(size_t offset, const unsigned char *bytes, size_t length) override {
+        assert(CanOverwrite());
+        std::streampos end = stream->tellp();
+        stream->seekp(start + (std::streamoff)offset);
+        stream->write((const char *)bytes, length);
+        stream->seekp(end);
+    }
+
+private:
+    std::ostream *stream;
+    std::streampos start;
+};
+
+/// Serialized bytes are passed on to the sink, if any, whenever this many have piled up
+const size_t kSerializeBufferSize = 1 << 20;
+
+/**
+ * Keeps track of where values are serialized to.
+ * Without a sink, everything is serialized into `buffer`, which grows as needed. With a sink,
+ * `buffer` only holds the last few serialized bytes, and call Flush() when done so that the sink gets
+ * all of them.
+ */
 class SerializeContext {
 public:
-    SerializeContext(bool swapIntegerEndianness, bool swapDecimalEndianness)
-        : swapIntegerEndianness(swapIntegerEndianness), swapDecimalEndianness(swapDecimalEndianness) { }
+    SerializeContext(bool swapIntegerEndianness, bool swapDecimalEndianness, SerializeSink *sink = nullptr)
+        : swapIntegerEndianness(swapIntegerEndianness), swapDecimalEndianness(swapDecimalEndianness),
+          sink(sink), flushedSize(0) {
+        if (sink != nullptr) {
+            buffer.reserve(kSerializeBufferSize);
+        }
+    }
     SerializeContext() : SerializeContext(false, false) { }
 
+    /// Number of bytes serialized so far, including those already passed on to the sink
+    size_t Size() const {
+        return flushedSize + buffer.size();
+    }
+
+    /// Append raw bytes
+    void Write(const unsigned char *bytes, size_t length) {
+        buffer.insert(buffer.end(), bytes, bytes+length);
+        if (sink != nullptr && buffer.size() >= kSerializeBufferSize) {
+            Flush();
+        }
+    }
+
+    /// Replace bytes that were already serialized, starting `offset` bytes from the start
+    void Overwrite(size_t offset, const unsigned char *bytes, size_t length) {
+        assert(offset + length <= Size());
+        if (offset < flushedSize) {
+            size_t flushedLength = std::min(length, flushedSize - offset);
+            sink->Overwrite(offset, bytes, flushedLength);
+            offset += flushedLength;
+            bytes += flushedLength;
+            length -= flushedLength;
+        }
+        std::copy(bytes, bytes+length, buffer.begin() + (offset - flushedSize));
+    }
+
+    /// Make room for `length` more bytes up front, rather than growing the buffer several times
+    void Reserve(size_t length) {
+        if (sink == nullptr) {
+            buffer.reserve(buffer.size() + length);
+        }
+    }
+
+    /// Pass all buffered bytes on to the sink. Does nothing without a sink.
+    void Flush() {
+        if (sink != nullptr) {
+            sink->Write(buffer.data(), buffer.size());
+            flushedSize += buffer.size();
+            buffer.clear();
+        }
+    }
+
     bool swapIntegerEndianness;
     bool swapDecimalEndianness;
+    /// Bytes not passed on to the sink yet (which, without a sink, is all of them)
     std::vector<unsigned char> buffer;
+
+private:
+    SerializeSink *sink;
+    size_t flushedSize;
 };
 
 class DeserializeContext {
@@ -112,9 +215,8 @@ const T *DeserializeArray(DeserializeContext *des, long arrLength) {
 
 template <typename T>
 void SerializePadding(SerializeContext *ser) {
-    for (int i = ser->buffer.size(); i%sizeof(T) != 0; i++) {
-        ser->buffer.push_back(0);
-    }
+    unsigned char zeros[sizeof(T)] = { 0 };
+    ser->Write(zeros, (sizeof(T) - ser->Size()%sizeof(T))%sizeof(T));
 }
 
 template <typename T>
@@ -123,7 +225,27 @@ void SerializePrimitive(SerializeContext *ser, const T &val) {
     memcpy(&buf, &val, sizeof(T));
     SwapEndiannessIfNecessary<T>(buf, ser);
     SerializePadding<T>(ser);
-    std::copy(buf, buf+sizeof(T), std::back_inserter(ser->buffer));
+    ser->Write(buf, sizeof(T));
+}
+
+/// Serialize `length` values at once. Same result as calling SerializePrimitive on each, but faster.
+template <typename T>
+void SerializeArray(SerializeContext *ser, const T *values, long length) {
+    if (length == 0) {
+        return;
+    }
+    SerializePadding<T>(ser);
+    ser->Reserve(sizeof(T)*length);
+    const long valuesPerChunk = 4096/sizeof(T);
+    unsigned char chunk[valuesPerChunk*sizeof(T)];
+    for (long i = 0; i < length; i += valuesPerChunk) {
+        long chunkLength = std::min(valuesPerChunk, length - i);
+        memcpy(chunk, values + i, sizeof(T)*chunkLength);
+        for (long k = 0; k < chunkLength; k++) {
+            SwapEndiannessIfNecessary<T>(chunk + sizeof(T)*k, ser);
+        }
+        ser->Write(chunk, sizeof(T)*chunkLength);
+    }
 }
 
 }
@@ -3,7 +3,13 @@
 #ifndef STAR_ID_PRIVATE_H
 #define STAR_ID_PRIVATE_H
 
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
 #include <limits>
+#include <queue>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -12,6 +18,54 @@
 
 namespace lost {
 
+/**
+ * An angular tolerance, with its cosine and sine worked out ahead of time so that many AngleWindows
+ * can be built with it without any trigonometry.
+ */
+class AngleTolerance {
+public:
+    explicit AngleTolerance(decimal tolerance)
+        : cosTolerance(DECIMAL_COS(tolerance)), sinTolerance(DECIMAL_SIN(tolerance)) { };
+
+    decimal cosTolerance;
+    decimal sinTolerance;
+};
+
+/**
+ * The dot products of unit vectors which are `angle` apart, give or take `tolerance`.
+ * Checking a dot product against the window gives the same answer as taking its arccosine and
+ * checking that against the angle, but it is much cheaper when there are many dot products to check
+ * against the same angle.
+ */
+class AngleWindow {
+public:
+    AngleWindow(decimal angle, decimal tolerance)
+        // Dot products of unit vectors can be slightly outside [-1,1] due to rounding, so leave the
+        // window open at the ends that are clamped.
+        : minCos(angle + tolerance >= DECIMAL_M_PI ? -INFINITY : DECIMAL_COS(angle + tolerance)),
+          maxCos(angle - tolerance <= 0 ? INFINITY : DECIMAL_COS(angle - tolerance)) { };
+
+    /**
+     * The window around the angle between two unit vectors. Uses the angle sum identities on their
+     * dot and cross products instead of taking the arccosine, for when there is a window to build
+     * for every pair of vectors.
+     */
+    AngleWindow(const Vec3 &unit1, const Vec3 &unit2, const AngleTolerance &tolerance) {
+        decimal cosAngle = unit1 * unit2;
+        decimal sinAngle = unit1.CrossProduct(unit2).Magnitude();
+        // angle + tolerance >= pi exactly when cos(angle) <= cos(pi - tolerance), and likewise below
+        minCos = cosAngle <= -tolerance.cosTolerance
+            ? -INFINITY : cosAngle*tolerance.cosTolerance - sinAngle*tolerance.sinTolerance;
+        maxCos = cosAngle >= tolerance.cosTolerance
+            ? INFINITY : cosAngle*tolerance.cosTolerance + sinAngle*tolerance.sinTolerance;
+    };
+
+    bool Contains(decimal dot) const { return dot >= minCos && dot <= maxCos; };
+private:
+    decimal minCos;
+    decimal maxCos;
+};
+
 /// unidentified centroid used in IdentifyRemainingStarsPairDistance
 /// The "angles" through here are "triangular angles". A triangular angle is a 2D angle in a triangle formed by three centroids.
 class IRUnidentifiedCentroid {
@@ -46,18 +100,132 @@ public:
     void AddIdentifiedStar(const StarIdentifier &starId, const Stars &stars);
 };
 
+/**
+ * The unidentified centroids not yet below the soft threshold, in a uniform grid so that the ones
+ * within some distance of a star can be found without looking at all of them.
+ *
+ * The grid is over the y and z components of each centroid's unit vector (the camera looks along
+ * x). Two unit vectors are never closer in the grid than their chord length, so a box around the
+ * query with half-width equal to the chord of the maximum distance contains every centroid in range.
+ */
+class IRUnidentifiedCentroidSet {
+public:
+    IRUnidentifiedCentroidSet(const Stars &, const Camera &, decimal maxDistance);
+
+    void Insert(IRUnidentifiedCentroid *);
+    void Remove(IRUnidentifiedCentroid *);
+    void BestAngleDecreased(IRUnidentifiedCentroid *);
+    IRUnidentifiedCentroid *Best();
+    std::vector<IRUnidentifiedCentroid *> FindInRange(int16_t starIndex, decimal minDistance, decimal maxDistance) const;
+
+    /// Every centroid in the set, in no particular order.
+    const std::vector<IRUnidentifiedCentroid *> &Centroids() const { return centroids; };
+    bool IsEmpty() const { return centroids.empty(); };
+
+private:
+    long CellFor(const Vec3 &) const;
+    long CellCoordinate(decimal value, decimal min) const;
+
+    /// Normalized spatial vector of every star, by star index
+    std::vector<Vec3> spatials;
+    decimal minY;
+    decimal minZ;
+    decimal cellSize;
+    long gridWidth;
+    long gridHeight;
+    std::vector<std::vector<IRUnidentifiedCentroid *>> cells;
+    std::vector<IRUnidentifiedCentroid *> centroids;
+    /// Where each star is in `centroids` and in its cell, by star index, so removal is constant time
+    std::vector<long> centroidsPositions;
+    std::vector<long> cellPositions;
+    /**
+     * Min-heap on bestAngleFrom90, with an entry pushed each time a centroid's angle changes. Entries
+     * for removed centroids, or with an angle the centroid has since improved on, are stale and
+     * discarded when they reach the top.
+     */
+    std::priority_queue<std::pair<decimal, int16_t>,
+                        std::vector<std::pair<decimal, int16_t>>,
+                        std::greater<std::pair<decimal, int16_t>>> bestAngles;
+    /// The centroid with each star index, while it is in the set
+    std::vector<IRUnidentifiedCentroid *> byIndex;
+};
+
+/**
+ * A set of catalog stars, stored as one bit per catalog star, so that sets can be intersected a word
+ * at a time.
+ */
+class CatalogStarSet {
+public:
+    explicit CatalogStarSet(long catalogSize) : words((catalogSize + 63) / 64, 0) { };
+
+    void Clear() { std::fill(words.begin(), words.end(), 0); };
+    void Insert(int16_t star) { words[star / 64] |= UINT64_C(1) << (star % 64); };
+    bool Contains(int16_t star) const { return (words[star / 64] >> (star % 64)) & 1; };
+
+    /// Insert both stars of every pair in a pair distance query
+    void InsertPairs(const int16_t *pairs, const int16_t *end) {
+        for (const int16_t *p = pairs; p != end; p++) {
+            Insert(*p);
+        }
+    };
+
+    /// Remove every star not also in `other`. Returns whether any stars are left.
+    bool IntersectWith(const CatalogStarSet &other) {
+        uint64_t any = 0;
+        for (size_t i = 0; i < words.size(); i++) {
+            words[i] &= other.words[i];
+            any |= words[i];
+        }
+        return any != 0;
+    };
+private:
+    std::vector<uint64_t> words;
+};
+
+std::unordered_multimap<int16_t, int16_t> PairDistanceQueryToMap(const int16_t *pairs, const int16_t *end);
+std::unordered_multimap<int16_t, int16_t> PairDistanceQueryToMap(const int16_t *pairs, const int16_t *end,
+                                                                 const CatalogStarSet &keys);
+
 std::vector<int16_t> IdentifyThirdStar(const PairDistanceKVectorDatabase &db,
                                        const Catalog &catalog,
                                        int16_t catalogIndex1, int16_t catalogIndex2,
                                        decimal distance1, decimal distance2,
                                        decimal tolerance);
 
+std::vector<int16_t> IdentifyThirdStar(const CompactPairDistanceDatabase &db,
+                                       const Catalog &catalog,
+                                       int16_t catalogIndex1, int16_t catalogIndex2,
+                                       decimal distance1, decimal distance2,
+                                       decimal tolerance);
+
+std::vector<int16_t> IdentifyThirdStar(const NeighborAdjacencyDatabase &db,
+                                       const Catalog &catalog,
+                                       int16_t catalogIndex1, int16_t catalogIndex2,
+                                       decimal distance1, decimal distance2,
+                                       decimal tolerance);
+
 int IdentifyRemainingStarsPairDistance(StarIdentifiers *,
                                        const Stars &,
                                        const PairDistanceKVectorDatabase &,
                                        const Catalog &,
                                        const Camera &,
-                                       decimal tolerance);
+                                       decimal tolerance,
+                                       const NeighborAdjacencyDatabase *neighbors = NULL);
+
+int IdentifyRemainingStarsPairDistance(StarIdentifiers *,
+                                       const Stars &,
+                                       const CompactPairDistanceDatabase &,
+                                       const Catalog &,
+                                       const Camera &,
+                                       decimal tolerance,
+                                       const NeighborAdjacencyDatabase *neighbors = NULL);
+
+int IdentifyRemainingStarsProjection(StarIdentifiers *,
+                                     const Stars &,
+                                     const SkyIndexDatabase &,
+                                     const Catalog &,
+                                     const Camera &,
+                                     decimal tolerance);
 
 }
 
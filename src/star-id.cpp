@@ -5,16 +5,66 @@
 #include <algorithm>
 #include <chrono>
 #include <unordered_map>
+#include <numeric>
+#include <array>
+#include <map>
 
 #include "star-id.hpp"
 #include "star-id-private.hpp"
 #include "databases.hpp"
 #include "attitude-utils.hpp"
+#include "attitude-estimators.hpp"
 
 namespace lost {
 
+/// Nanoseconds elapsed since `start`
+static long long NanosecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// The neighbor adjacency database inside the multi-database, or null if it has none
+static std::unique_ptr<NeighborAdjacencyDatabase> FindNeighborAdjacency(const MultiDatabase &multiDatabase) {
+    const unsigned char *buffer = multiDatabase.SubDatabasePointer(NeighborAdjacencyDatabase::kMagicValue);
+    if (buffer == NULL) {
+        return nullptr;
+    }
+    DeserializeContext des(buffer);
+    return std::unique_ptr<NeighborAdjacencyDatabase>(new NeighborAdjacencyDatabase(&des));
+}
+
+/// How many times StarIdDeadline::Passed is called between reads of the clock, by default
+const int kDeadlineCheckInterval = 8;
+
+/**
+ * A wall-clock deadline for a star-id algorithm. Cheap enough to check every iteration, because it
+ * only actually reads the clock every few checks.
+ */
+class StarIdDeadline {
+public:
+    /**
+     * @param deadlineUs Microseconds after `start` that the deadline passes. Zero or negative means never.
+     * @param checkInterval Read the clock once per this many calls to Passed. Use 1 if each iteration is slow.
+     */
+    StarIdDeadline(std::chrono::steady_clock::time_point start, long deadlineUs,
+                   int checkInterval = kDeadlineCheckInterval)
+        : deadline(start + std::chrono::microseconds(deadlineUs)), enabled(deadlineUs > 0),
+          checkInterval(checkInterval) { };
+
+    bool Passed() {
+        if (!enabled || ++numChecks % checkInterval != 0) {
+            return false;
+        }
+        return std::chrono::steady_clock::now() > deadline;
+    };
+private:
+    std::chrono::steady_clock::time_point deadline;
+    bool enabled;
+    int checkInterval;
+    long numChecks = 0;
+};
+
 StarIdentifiers DummyStarIdAlgorithm::Go(
-    const unsigned char *, const Stars &stars, const Catalog &catalog, const Camera &) const {
+    const unsigned char *, const Stars &stars, const Catalog &catalog, const Camera &, StarIdStats *) const {
 
     StarIdentifiers result;
 
@@ -27,7 +77,15 @@ StarIdentifiers DummyStarIdAlgorithm::Go(
 }
 
 StarIdentifiers GeometricVotingStarIdAlgorithm::Go(
-    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    StarIdStats *stats) const {
+
+    StarIdStats unusedStats;
+    if (stats == NULL) {
+        stats = &unusedStats;
+    }
+    // each iteration queries the database for every other star
+    StarIdDeadline deadline(std::chrono::steady_clock::now(), deadlineUs, 1);
 
     StarIdentifiers identified;
     MultiDatabase multiDatabase(database);
@@ -38,47 +96,94 @@ StarIdentifiers GeometricVotingStarIdAlgorithm::Go(
     DeserializeContext des(databaseBuffer);
     PairDistanceKVectorDatabase vectorDatabase(&des);
 
+    std::vector<Vec3> spatials;
+    for (const Star &star : stars) {
+        spatials.push_back(camera.CameraToSpatial(star.position).Normalize());
+    }
+    // the other stars, brightest first, for early termination
+    std::vector<int> byBrightness(stars.size());
+    if (earlyTermination) {
+        if (maxVotesDatabase != database) {
+            maxVotesPerQuery = vectorDatabase.MaxPairsPerStarInQuery(2*tolerance);
+            maxVotesDatabase = database;
+        }
+        std::iota(byBrightness.begin(), byBrightness.end(), 0);
+        std::stable_sort(byBrightness.begin(), byBrightness.end(), [&stars](int a, int b) {
+            return stars[a].magnitude > stars[b].magnitude;
+        });
+    }
     for (int i = 0; i < (int)stars.size(); i++) {
+        // votes are only meaningful once every star has them, so there's nothing partial to return
+        if (deadline.Passed()) {
+            stats->timedOut = true;
+            return StarIdentifiers();
+        }
         std::vector<int16_t> votes(catalog.size(), 0);
-        Vec3 iSpatial = camera.CameraToSpatial(stars[i].position).Normalize();
-        for (int j = 0; j < (int)stars.size(); j++) {
-            if (i != j) {
-                // TODO: find a faster way to do this:
-                std::vector<bool> votedInPair(catalog.size(), false);
-                Vec3 jSpatial = camera.CameraToSpatial(stars[j].position).Normalize();
-                decimal greatCircleDistance = AngleUnit(iSpatial, jSpatial);
-                //give a greater range for min-max Query for bigger radius (GreatCircleDistance)
-                decimal lowerBoundRange = greatCircleDistance - tolerance;
-                decimal upperBoundRange = greatCircleDistance + tolerance;
-                const int16_t *upperBoundSearch;
-                const int16_t *lowerBoundSearch = vectorDatabase.FindPairsLiberal(
-                    lowerBoundRange, upperBoundRange, &upperBoundSearch);
-                //loop from lowerBoundSearch till numReturnedPairs, add one vote to each star in the pairs in the datastructure
-                for (const int16_t *k = lowerBoundSearch; k != upperBoundSearch; k++) {
-                    if ((k - lowerBoundSearch) % 2 == 0) {
-                        decimal actualAngle = AngleUnit(catalog[*k].spatial, catalog[*(k+1)].spatial);
-                        assert(actualAngle <= greatCircleDistance + tolerance * 2);
-                        assert(actualAngle >= greatCircleDistance - tolerance * 2);
-                    }
-                    if (!votedInPair[*k] || true) {
-                        // if (i == 542 && *k == 9085) {
-                        //     printf("INC, distance %f from query %f to %f\n", greatCircleDistance,
-                        //         lowerBoundRange, upperBoundRange);
-                        // }
-                        votes[*k]++;
-                        votedInPair[*k] = true;
+        int indexOfMax = -1;
+        if (earlyTermination) {
+            // Track the leader and the runner up as votes come in. Votes only go up, so the
+            // runner up can only be overtaken by the leader. Once even the runner up getting the
+            // most votes possible from every remaining query can't catch the leader, it has won.
+            int leader = -1;
+            long leaderVotes = 0;
+            long runnerUpVotes = 0;
+            long remainingQueries = stars.size() - 1;
+            for (int j : byBrightness) {
+                if (i == j) {
+                    continue;
+                }
+                if (leaderVotes - runnerUpVotes > remainingQueries * maxVotesPerQuery) {
+                    indexOfMax = leader;
+                    break;
+                }
+                remainingQueries--;
+                decimal greatCircleDistance = AngleUnit(spatials[i], spatials[j]);
+                const int16_t *end;
+                const int16_t *pairs = vectorDatabase.FindPairsLiberal(
+                    greatCircleDistance - tolerance, greatCircleDistance + tolerance, &end);
+                stats->databaseQueries++;
+                stats->candidatesExamined += end - pairs;
+                for (const int16_t *k = pairs; k != end; k++) {
+                    long kVotes = ++votes[*k];
+                    if (*k == leader) {
+                        leaderVotes = kVotes;
+                    } else if (kVotes > leaderVotes) {
+                        runnerUpVotes = leaderVotes;
+                        leader = *k;
+                        leaderVotes = kVotes;
+                    } else if (kVotes > runnerUpVotes) {
+                        runnerUpVotes = kVotes;
                     }
                 }
-                // US voting system
+            }
+        } else {
+            // give a greater range for min-max Query for bigger radius (GreatCircleDistance)
+            std::vector<std::pair<decimal, decimal>> ranges;
+            for (int j = 0; j < (int)stars.size(); j++) {
+                if (i != j) {
+                    decimal greatCircleDistance = AngleUnit(spatials[i], spatials[j]);
+                    ranges.emplace_back(greatCircleDistance - tolerance, greatCircleDistance + tolerance);
+                }
+            }
+            // Every star in every pair within range of some centroid pair gets a vote. Batching the
+            // queries for all of star i's pairs reads the database in a single sweep.
+            stats->databaseQueries += ranges.size();
+            for (const PairDistanceSpan &span : vectorDatabase.FindPairsLiberalBatch(ranges)) {
+                stats->candidatesExamined += (span.end - span.begin) * span.multiplicity;
+                for (const int16_t *k = span.begin; k != span.end; k++) {
+                    votes[*k] += span.multiplicity;
+                }
             }
         }
-        // Find star w most votes
-        int16_t maxVotes = votes[0];
-        int indexOfMax = 0;
-        for (int v = 1; v < (int)votes.size(); v++) {
-            if (votes[v] > maxVotes) {
-                maxVotes = votes[v];
-                indexOfMax = v;
+        // Find star w most votes, unless it was already decided. Ties go to the lowest index.
+        if (indexOfMax == -1) {
+            int16_t maxVotes = votes[0];
+            indexOfMax = 0;
+            for (int v = 1; v < (int)votes.size(); v++) {
+                if (votes[v] > maxVotes) {
+                    maxVotes = votes[v];
+                    indexOfMax = v;
+                }
             }
         }
         // if (i == 542) {
@@ -141,7 +246,6 @@ StarIdentifiers GeometricVotingStarIdAlgorithm::Go(
     // maximal votes = maxVotes
     StarIdentifiers verified;
     int thresholdVotes = maxVotes * 3 / 4;
-    printf("Verification threshold: %d\n", thresholdVotes);
     for (int i = 0; i < (int)verificationVotes.size(); i++) {
         if (verificationVotes[i] > thresholdVotes) {
             verified.push_back(identified[i]);
@@ -265,6 +369,111 @@ std::unordered_multimap<int16_t, int16_t> PairDistanceQueryToMap(const int16_t *
     return result;
 }
 
+/// Same as PairDistanceQueryToMap, but only includes the entries for stars in `keys`
+std::unordered_multimap<int16_t, int16_t> PairDistanceQueryToMap(const int16_t *pairs, const int16_t *end,
+                                                                 const CatalogStarSet &keys) {
+    std::unordered_multimap<int16_t, int16_t> result;
+    for (const int16_t *p = pairs; p != end; p += 2) {
+        if (keys.Contains(p[0])) {
+            result.emplace(p[0], p[1]);
+        }
+        if (keys.Contains(p[1])) {
+            result.emplace(p[1], p[0]);
+        }
+    }
+    return result;
+}
+
+/**
+ * Liberal pair distance query which works the same way for either kind of pair distance database.
+ * @param buffer Where pairs are decoded to, if the database needs it. Overwritten by the next query
+ * using the same buffer.
+ */
+static const int16_t *FindPairs(const PairDistanceKVectorDatabase &db, decimal min, decimal max,
+                                std::vector<int16_t> *, const int16_t **end) {
+    return db.FindPairsLiberal(min, max, end);
+}
+
+/// @copydoc FindPairs
+static const int16_t *FindPairs(const CompactPairDistanceDatabase &db, decimal min, decimal max,
+                                std::vector<int16_t> *buffer, const int16_t **end) {
+    db.FindPairsLiberal(min, max, buffer);
+    *end = buffer->data() + buffer->size();
+    return buffer->data();
+}
+
+/// Replace `result` with all the stars paired with `star` in a map from PairDistanceQueryToMap
+static void PairedStars(const std::unordered_multimap<int16_t, int16_t> &map, int16_t star,
+                        std::vector<int16_t> *result) {
+    result->clear();
+    for (auto it = map.equal_range(star); it.first != it.second; it.first++) {
+        result->push_back(it.first->second);
+    }
+}
+
+/// Keep only the stars whose dot product, at the same index in `dots`, is in the window
+static void FilterByDot(std::vector<int16_t> *stars, const std::vector<decimal> &dots,
+                        const AngleWindow &window) {
+    size_t numKept = 0;
+    for (size_t n = 0; n < stars->size(); n++) {
+        if (window.Contains(dots[n])) {
+            (*stars)[numKept++] = (*stars)[n];
+        }
+    }
+    stars->resize(numKept);
+}
+
+/**
+ * Whether two catalog stars could be two centroids, judging only by which centroid is brighter: the
+ * catalog star for the brighter centroid must not be more than `margin` (in hundredths of a
+ * magnitude) fainter than the other. Always true if the margin is negative.
+ */
+static bool BrightnessAgrees(const Star &star1, const Star &star2,
+                             const CatalogStar &catalogStar1, const CatalogStar &catalogStar2, int margin) {
+    if (margin < 0) {
+        return true;
+    }
+    // Star::magnitude is larger for brighter stars, CatalogStar::magnitude is smaller
+    if (star1.magnitude > star2.magnitude) {
+        return catalogStar1.magnitude <= catalogStar2.magnitude + margin;
+    }
+    if (star2.magnitude > star1.magnitude) {
+        return catalogStar2.magnitude <= catalogStar1.magnitude + margin;
+    }
+    return true;
+}
+
+/// Keep only the candidates for `star` whose brightness agrees with `other` being `otherCandidate`
+static void FilterByBrightness(std::vector<int16_t> *candidates, const Star &star,
+                               const Star &other, int16_t otherCandidate,
+                               const Catalog &catalog, int margin) {
+    if (margin < 0) {
+        return;
+    }
+    size_t numKept = 0;
+    for (size_t n = 0; n < candidates->size(); n++) {
+        if (BrightnessAgrees(star, other, catalog[(*candidates)[n]], catalog[otherCandidate], margin)) {
+            (*candidates)[numKept++] = (*candidates)[n];
+        }
+    }
+    candidates->resize(numKept);
+}
+
+/**
+ * Half-width of the window to query for the distance between two centroids: `sigmas` times the
+ * combined uncertainty of the two centroids, but never more than `maxTolerance`. If `sigmas` is not
+ * positive or either centroid's uncertainty is unknown, just `maxTolerance`.
+ * @param uncertainties Angular uncertainty of each centroid, in radians
+ */
+static decimal PairTolerance(const std::vector<decimal> &uncertainties, int star1, int star2,
+                             decimal sigmas, decimal maxTolerance) {
+    if (sigmas <= 0 || uncertainties[star1] <= 0 || uncertainties[star2] <= 0) {
+        return maxTolerance;
+    }
+    decimal combined = DECIMAL_SQRT(uncertainties[star1]*uncertainties[star1] + uncertainties[star2]*uncertainties[star2]);
+    return std::min(maxTolerance, sigmas*combined);
+}
+
 decimal IRUnidentifiedCentroid::VerticalAnglesToAngleFrom90(decimal v1, decimal v2) {
     return DECIMAL_ABS(DecimalModulo(v1-v2, DECIMAL_M_PI) - DECIMAL_M_PI_2);
 }
@@ -290,57 +499,126 @@ void IRUnidentifiedCentroid::AddIdentifiedStar(const StarIdentifier &starId, con
     identifiedStarsInRange.emplace_back(angleFromVertical, starId);
 }
 
+/// Most cells along either side of a grid of centroids. More would mostly be empty.
+const long kIRMaxGridSide = 64;
+
+IRUnidentifiedCentroidSet::IRUnidentifiedCentroidSet(const Stars &stars, const Camera &camera, decimal maxDistance)
+    : centroidsPositions(stars.size(), -1), cellPositions(stars.size(), -1), byIndex(stars.size(), NULL) {
+
+    spatials.reserve(stars.size());
+    minY = minZ = std::numeric_limits<decimal>::max();
+    decimal maxY = -std::numeric_limits<decimal>::max();
+    decimal maxZ = -std::numeric_limits<decimal>::max();
+    for (const Star &star : stars) {
+        spatials.push_back(camera.CameraToSpatial(star.position).Normalize());
+        minY = std::min(minY, spatials.back().y);
+        maxY = std::max(maxY, spatials.back().y);
+        minZ = std::min(minZ, spatials.back().z);
+        maxZ = std::max(maxZ, spatials.back().z);
+    }
+
+    decimal maxChord = 2*DECIMAL_SIN(std::min(maxDistance, DECIMAL_M_PI)/2);
+    cellSize = std::max(maxChord, std::max(maxY - minY, maxZ - minZ) / kIRMaxGridSide);
+    gridWidth = stars.empty() ? 1 : CellCoordinate(maxY, minY) + 1;
+    gridHeight = stars.empty() ? 1 : CellCoordinate(maxZ, minZ) + 1;
+    cells.resize(gridWidth * gridHeight);
+}
+
+long IRUnidentifiedCentroidSet::CellCoordinate(decimal value, decimal min) const {
+    return std::max(0L, (long)((value - min) / cellSize));
+}
+
+long IRUnidentifiedCentroidSet::CellFor(const Vec3 &spatial) const {
+    return std::min(CellCoordinate(spatial.z, minZ), gridHeight-1) * gridWidth
+        + std::min(CellCoordinate(spatial.y, minY), gridWidth-1);
+}
+
+/// Add a centroid to the set. It must not already be in it.
+void IRUnidentifiedCentroidSet::Insert(IRUnidentifiedCentroid *centroid) {
+    assert(centroidsPositions[centroid->index] == -1);
+    std::vector<IRUnidentifiedCentroid *> &cell = cells[CellFor(spatials[centroid->index])];
+    centroidsPositions[centroid->index] = centroids.size();
+    centroids.push_back(centroid);
+    cellPositions[centroid->index] = cell.size();
+    cell.push_back(centroid);
+    byIndex[centroid->index] = centroid;
+    bestAngles.emplace(centroid->bestAngleFrom90, centroid->index);
+}
+
+/// Call whenever the bestAngleFrom90 of a centroid in the set decreases, so Best() sees it.
+void IRUnidentifiedCentroidSet::BestAngleDecreased(IRUnidentifiedCentroid *centroid) {
+    assert(centroidsPositions[centroid->index] != -1);
+    bestAngles.emplace(centroid->bestAngleFrom90, centroid->index);
+}
+
 /**
- * Return all the unidentified centroids within the requested distance bounds from `star`
- *
- * The returned vector has pointers into the vector passed as an argument. Thus, it's important not
- * to modify the `centroids` argument after calling.
+ * The centroid in the set with the smallest bestAngleFrom90, or NULL if the set is empty. Amortized
+ * logarithmic time.
+ */
+IRUnidentifiedCentroid *IRUnidentifiedCentroidSet::Best() {
+    while (!bestAngles.empty()) {
+        const std::pair<decimal, int16_t> &top = bestAngles.top();
+        IRUnidentifiedCentroid *centroid = byIndex[top.second];
+        if (centroid != NULL && centroid->bestAngleFrom90 == top.first) {
+            return centroid;
+        }
+        bestAngles.pop();
+    }
+    return NULL;
+}
+
+/// Swap-and-pop a vector element, keeping the positions of the moved element up to date.
+static void IRSwapRemove(std::vector<IRUnidentifiedCentroid *> *centroids, std::vector<long> *positions, long position) {
+    IRUnidentifiedCentroid *last = centroids->back();
+    (*centroids)[position] = last;
+    (*positions)[last->index] = position;
+    centroids->pop_back();
+}
+
+/// Remove a centroid from the set in constant time. It must be in it.
+void IRUnidentifiedCentroidSet::Remove(IRUnidentifiedCentroid *centroid) {
+    assert(centroidsPositions[centroid->index] != -1);
+    IRSwapRemove(&centroids, &centroidsPositions, centroidsPositions[centroid->index]);
+    IRSwapRemove(&cells[CellFor(spatials[centroid->index])], &cellPositions, cellPositions[centroid->index]);
+    centroidsPositions[centroid->index] = -1;
+    cellPositions[centroid->index] = -1;
+    byIndex[centroid->index] = NULL;
+}
+
+/**
+ * Return all the centroids in the set within the requested distance bounds from the star with the
+ * given index.
  */
-std::vector<std::vector<IRUnidentifiedCentroid *>::iterator> FindUnidentifiedCentroidsInRange(
-    std::vector<IRUnidentifiedCentroid *> *centroids, const Star &star, const Camera &camera,
-    decimal minDistance, decimal maxDistance) {
+std::vector<IRUnidentifiedCentroid *> IRUnidentifiedCentroidSet::FindInRange(
+    int16_t starIndex, decimal minDistance, decimal maxDistance) const {
 
-    Vec3 ourSpatial = camera.CameraToSpatial(star.position).Normalize();
+    const Vec3 &ourSpatial = spatials[starIndex];
 
     decimal minCos = DECIMAL_COS(maxDistance);
     decimal maxCos = DECIMAL_COS(minDistance);
-
-    std::vector<std::vector<IRUnidentifiedCentroid *>::iterator> result;
-    for (auto it = centroids->begin(); it != centroids->end(); ++it) {
-        Vec3 theirSpatial = camera.CameraToSpatial((*it)->star->position).Normalize();
-        decimal angleCos = ourSpatial * theirSpatial;
-        if (angleCos >= minCos && angleCos <= maxCos) {
-            result.push_back(it);
+    decimal maxChord = 2*DECIMAL_SIN(std::min(maxDistance, DECIMAL_M_PI)/2);
+
+    long minCellY = CellCoordinate(ourSpatial.y - maxChord, minY);
+    long maxCellY = std::min(CellCoordinate(ourSpatial.y + maxChord, minY), gridWidth-1);
+    long minCellZ = CellCoordinate(ourSpatial.z - maxChord, minZ);
+    long maxCellZ = std::min(CellCoordinate(ourSpatial.z + maxChord, minZ), gridHeight-1);
+
+    std::vector<IRUnidentifiedCentroid *> result;
+    for (long cellZ = minCellZ; cellZ <= maxCellZ; cellZ++) {
+        for (long cellY = minCellY; cellY <= maxCellY; cellY++) {
+            for (IRUnidentifiedCentroid *centroid : cells[cellZ*gridWidth + cellY]) {
+                decimal angleCos = ourSpatial * spatials[centroid->index];
+                if (angleCos >= minCos && angleCos <= maxCos) {
+                    result.push_back(centroid);
+                }
+            }
         }
     }
-
     return result;
-
-    // TODO: optimize by sorting on x-coordinate (like in tracking), or maybe even kd-tree
-
-    // // Find the first centroid that is within range of the given centroid.
-    // auto firstInRange = std::lower_bound(centroids->begin(), centroids->end(), star.position.x - maxDistance,
-    //     [](const IRUnidentifiedCentroid &centroid, decimal x) {
-    //         return centroid.star.position.x < x;
-    //     });
-
-    // // Find the first centroid that is not within range of the given centroid.
-    // auto firstNotInRange = std::lower_bound(firstInRange, centroids->end(), star.position.x + maxDistance,
-    //     [](const IRUnidentifiedCentroid &centroid, decimal x) {
-    //         return centroid.star.position.x <= x;
-    //     });
-
-    // // Copy the pointers to the stars into the result vector.
-    // for (auto it = firstInRange; it != firstNotInRange; ++it) {
-    //     decimal distance = Distance(star.position, it->star.position);
-    //     if (distance >= minDistance && distance <= maxDistance) {
-    //         result.push_back(&*it);
-    //     }
-    // }
 }
 
 /**
- * Given a list of unidentified centroids not yet at the soft threshold, and a list of unidentified
+ * Given a set of unidentified centroids not yet at the soft threshold, and a list of unidentified
  * centroids already below the soft threshold, appropriately add the given centroid to all the
  * unidentified centroids still above the threshold, and perhaps move them to the below threshold
  * list.
@@ -348,26 +626,42 @@ std::vector<std::vector<IRUnidentifiedCentroid *>::iterator> FindUnidentifiedCen
  * @param angleFrom90Threshold Once an IRUnidentifiedCentroid's best angle from 90 goes below this threshold
  */
 void AddToAllUnidentifiedCentroids(const StarIdentifier &starId, const Stars &stars,
-                                   std::vector<IRUnidentifiedCentroid *> *aboveThresholdCentroids,
+                                   IRUnidentifiedCentroidSet *aboveThresholdCentroids,
                                    std::vector<IRUnidentifiedCentroid *> *belowThresholdCentroids,
                                    decimal minDistance, decimal maxDistance,
-                                   decimal angleFrom90Threshold,
-                                   const Camera &camera) {
+                                   decimal angleFrom90Threshold) {
 
-    std::vector<int16_t> nowBelowThreshold; // centroid indices newly moved above the threshold
     // don't need to iterate through the centroids that are already below the threshold, for performance.
-    for (auto centroidIt : FindUnidentifiedCentroidsInRange(aboveThresholdCentroids, stars[starId.starIndex], camera, minDistance, maxDistance)) {
-        (*centroidIt)->AddIdentifiedStar(starId, stars);
-        if ((*centroidIt)->bestAngleFrom90 <= angleFrom90Threshold) {
-            belowThresholdCentroids->push_back(*centroidIt);
-            nowBelowThreshold.push_back((*centroidIt)->index);
+    for (IRUnidentifiedCentroid *centroid : aboveThresholdCentroids->FindInRange(starId.starIndex, minDistance, maxDistance)) {
+        decimal oldBestAngleFrom90 = centroid->bestAngleFrom90;
+        centroid->AddIdentifiedStar(starId, stars);
+        if (centroid->bestAngleFrom90 <= angleFrom90Threshold) {
+            belowThresholdCentroids->push_back(centroid);
+            aboveThresholdCentroids->Remove(centroid);
+        } else if (centroid->bestAngleFrom90 < oldBestAngleFrom90) {
+            aboveThresholdCentroids->BestAngleDecreased(centroid);
         }
     }
-    // remove all centroids with indices in nowBelowThreshold from aboveThresholdCentroids
-    aboveThresholdCentroids->erase(std::remove_if(aboveThresholdCentroids->begin(), aboveThresholdCentroids->end(),
-        [&nowBelowThreshold](const IRUnidentifiedCentroid *centroid) {
-            return std::find(nowBelowThreshold.begin(), nowBelowThreshold.end(), centroid->index) != nowBelowThreshold.end();
-        }), aboveThresholdCentroids->end());
+}
+
+/**
+ * Whether a catalog star already known to be the right distance from the first star of
+ * IdentifyThirdStar is also the right distance from the second star, and on the correct side.
+ * @param cross The cross product of the first and second stars
+ * @param window2 The distance to the second star
+ */
+static bool IsThirdStar(const Vec3 &candidateSpatial, const Vec3 &spatial2, const Vec3 &cross,
+                        const AngleWindow &window2) {
+    // check distance to second star
+    if (!window2.Contains(candidateSpatial * spatial2)) {
+        return false;
+    }
+
+    // check spectrality
+    decimal spectralTorch = cross * candidateSpatial;
+    // if they are nearly coplanar, don't need to check spectrality
+    // TODO: Implement ^^. Not high priority, since always checking spectrality is conservative.
+    return spectralTorch > 0;
 }
 
 /**
@@ -393,6 +687,7 @@ std::vector<int16_t> IdentifyThirdStar(const PairDistanceKVectorDatabase &db,
     const Vec3 &spatial1 = catalog[catalogIndex1].spatial;
     const Vec3 &spatial2 = catalog[catalogIndex2].spatial;
     const Vec3 cross = spatial1.CrossProduct(spatial2);
+    AngleWindow window2(distance2, tolerance);
 
     // Use PairDistanceInvolvingIterator to find catalog candidates for the unidentified centroid from both sides.
 
@@ -402,31 +697,71 @@ std::vector<int16_t> IdentifyThirdStar(const PairDistanceKVectorDatabase &db,
          candidateIt.HasValue();
          ++candidateIt) {
 
-        Vec3 candidateSpatial = catalog[*candidateIt].spatial;
+        if (IsThirdStar(catalog[*candidateIt].spatial, spatial2, cross, window2)) {
+            result.push_back(*candidateIt);
+        }
+    }
 
-        decimal angle2 = AngleUnit(candidateSpatial, spatial2);
+    return result;
+}
 
-        // check distance to second star
-        if (!(angle2 >= distance2-tolerance && angle2 <= distance2+tolerance)) {
-            continue;
-        }
+/// Same as the pair distance version of IdentifyThirdStar
+std::vector<int16_t> IdentifyThirdStar(const CompactPairDistanceDatabase &db,
+                                       const Catalog &catalog,
+                                       int16_t catalogIndex1, int16_t catalogIndex2,
+                                       decimal distance1, decimal distance2,
+                                       decimal tolerance) {
 
-        // check spectrality
-        decimal spectralTorch = cross * candidateSpatial;
-        // if they are nearly coplanar, don't need to check spectrality
-        // TODO: Implement ^^. Not high priority, since always checking spectrality is conservative.
-        if (spectralTorch <= 0) {
-            continue;
+    std::vector<int16_t> candidates;
+    db.FindPartnersLiberal(catalogIndex1, distance1-tolerance, distance1+tolerance, &candidates);
+
+    const Vec3 &spatial1 = catalog[catalogIndex1].spatial;
+    const Vec3 &spatial2 = catalog[catalogIndex2].spatial;
+    const Vec3 cross = spatial1.CrossProduct(spatial2);
+    // the query may return pairs slightly outside the range
+    AngleWindow window1(distance1, tolerance);
+    AngleWindow window2(distance2, tolerance);
+
+    std::vector<int16_t> result;
+    for (int16_t candidate : candidates) {
+        const Vec3 &candidateSpatial = catalog[candidate].spatial;
+        if (window1.Contains(candidateSpatial * spatial1)
+            && IsThirdStar(candidateSpatial, spatial2, cross, window2)) {
+            result.push_back(candidate);
         }
+    }
+
+    return result;
+}
+
+/**
+ * Same as the pair distance version of IdentifyThirdStar, but only looks through the neighbors of the
+ * first star instead of every pair at the right distance.
+ */
+std::vector<int16_t> IdentifyThirdStar(const NeighborAdjacencyDatabase &db,
+                                       const Catalog &catalog,
+                                       int16_t catalogIndex1, int16_t catalogIndex2,
+                                       decimal distance1, decimal distance2,
+                                       decimal tolerance) {
+
+    const int16_t *neighborsEnd;
+    const int16_t *neighbors = db.FindNeighbors(catalogIndex1, distance1-tolerance, distance1+tolerance, &neighborsEnd);
+
+    const Vec3 &spatial2 = catalog[catalogIndex2].spatial;
+    const Vec3 cross = catalog[catalogIndex1].spatial.CrossProduct(spatial2);
+    AngleWindow window2(distance2, tolerance);
 
-        // we've made it through the gauntlet!
-        result.push_back(*candidateIt);
+    std::vector<int16_t> result;
+    for (const int16_t *candidate = neighbors; candidate != neighborsEnd; candidate++) {
+        if (IsThirdStar(catalog[*candidate].spatial, spatial2, cross, window2)) {
+            result.push_back(*candidate);
+        }
     }
 
     return result;
 }
 
-IRUnidentifiedCentroid *SelectNextUnidentifiedCentroid(std::vector<IRUnidentifiedCentroid *> *aboveThresholdCentroids,
+IRUnidentifiedCentroid *SelectNextUnidentifiedCentroid(IRUnidentifiedCentroidSet *aboveThresholdCentroids,
                                                       std::vector<IRUnidentifiedCentroid *> *belowThresholdCentroids) {
     if (!belowThresholdCentroids->empty()) {
         auto result = belowThresholdCentroids->back();
@@ -435,16 +770,12 @@ IRUnidentifiedCentroid *SelectNextUnidentifiedCentroid(std::vector<IRUnidentifie
     }
 
     // need to find the best in aboveThreshold, if any
-    auto bestAboveThreshold = std::min_element(aboveThresholdCentroids->begin(), aboveThresholdCentroids->end(),
-        [](const IRUnidentifiedCentroid *a, const IRUnidentifiedCentroid *b) {
-            return a->bestAngleFrom90 < b->bestAngleFrom90;
-        });
+    IRUnidentifiedCentroid *bestAboveThreshold = aboveThresholdCentroids->Best();
 
     // 10 is arbitrary; but really it should be less than DECIMAL_M_PI_2 when set
-    if (bestAboveThreshold != aboveThresholdCentroids->end() && (*bestAboveThreshold)->bestAngleFrom90 < 10) {
-        auto result = *bestAboveThreshold;
-        aboveThresholdCentroids->erase(bestAboveThreshold);
-        return result;
+    if (bestAboveThreshold != NULL && bestAboveThreshold->bestAngleFrom90 < 10) {
+        aboveThresholdCentroids->Remove(bestAboveThreshold);
+        return bestAboveThreshold;
     }
 
     return NULL;
@@ -452,62 +783,52 @@ IRUnidentifiedCentroid *SelectNextUnidentifiedCentroid(std::vector<IRUnidentifie
 
 const decimal kAngleFrom90SoftThreshold = DECIMAL_M_PI_4; // TODO: tune this
 
-/**
- * Given some identified stars, attempt to identify the rest.
- *
- * Requires a pair distance database to be present. Iterates through the unidentified centroids in
- * an intelligent order, identifying them one by one.
- */
-int IdentifyRemainingStarsPairDistance(StarIdentifiers *identifiers,
-                                       const Stars &stars,
-                                       const PairDistanceKVectorDatabase &db,
-                                       const Catalog &catalog,
-                                       const Camera &camera,
-                                       decimal tolerance) {
+/// Implementation of IdentifyRemainingStarsPairDistance for either kind of pair distance database
+template <typename PairDatabase>
+static int IdentifyRemainingStarsPairDistanceImpl(StarIdentifiers *identifiers,
+                                                  const Stars &stars,
+                                                  const PairDatabase &db,
+                                                  const Catalog &catalog,
+                                                  const Camera &camera,
+                                                  decimal tolerance,
+                                                  const NeighborAdjacencyDatabase *neighbors) {
 #ifdef LOST_DEBUG_PERFORMANCE
     auto startTimestamp = std::chrono::steady_clock::now();
 #endif
     // initialize all unidentified centroids
     std::vector<IRUnidentifiedCentroid> allUnidentifiedCentroids;
-    std::vector<IRUnidentifiedCentroid *> aboveThresholdUnidentifiedCentroids;
+    IRUnidentifiedCentroidSet aboveThresholdUnidentifiedCentroids(stars, camera, db.MaxDistance());
     std::vector<IRUnidentifiedCentroid *> belowThresholdUnidentifiedCentroids;
     allUnidentifiedCentroids.reserve(stars.size());
     for (size_t i = 0; i < stars.size(); i++) {
         allUnidentifiedCentroids.push_back(IRUnidentifiedCentroid(stars[i], i));
     }
-    // add everything from allUnidentifiedCentroids to above threshold
-    aboveThresholdUnidentifiedCentroids.reserve(allUnidentifiedCentroids.size());
+    std::vector<bool> alreadyIdentified(stars.size(), false);
+    for (const StarIdentifier &identifier : *identifiers) {
+        alreadyIdentified[identifier.starIndex] = true;
+    }
+    // add everything not yet identified to above threshold
     for (size_t i = 0; i < allUnidentifiedCentroids.size(); i++) {
-        // only add if index is not equal to any starIndex in identifiers already
-        if (std::find_if(identifiers->begin(), identifiers->end(),
-            [&allUnidentifiedCentroids, i](const StarIdentifier &identifier) {
-                return identifier.starIndex == allUnidentifiedCentroids[i].index;
-            }) == identifiers->end()) {
-
-            aboveThresholdUnidentifiedCentroids.push_back(&allUnidentifiedCentroids[i]);
+        if (!alreadyIdentified[i]) {
+            aboveThresholdUnidentifiedCentroids.Insert(&allUnidentifiedCentroids[i]);
         }
     }
 
-    // sort unidentified centroids by x coordinate
-    // Don't need this until we fix the Find thing
-    // std::sort(unidentifiedCentroids.begin(), unidentifiedCentroids.end(),
-    //     [](const IRUnidentifiedCentroid &a, const IRUnidentifiedCentroid &b) {
-    //         return a.star->position.x < b.star->position.x;
-    //     });
-
     // for each identified star, add it to the list of identified stars for each unidentified centroid within range
     for (const auto &starId : *identifiers) {
         AddToAllUnidentifiedCentroids(starId, stars,
                                       &aboveThresholdUnidentifiedCentroids, &belowThresholdUnidentifiedCentroids,
                                       db.MinDistance(), db.MaxDistance(),
-                                      kAngleFrom90SoftThreshold,
-                                      camera);
+                                      kAngleFrom90SoftThreshold);
     }
 
     int numExtraIdentifiedStars = 0;
+    if (neighbors != NULL && neighbors->MaxDistance() < db.MaxDistance()) {
+        neighbors = NULL;
+    }
 
     // keep getting the best unidentified centroid and identifying it
-    while (!belowThresholdUnidentifiedCentroids.empty() || !aboveThresholdUnidentifiedCentroids.empty()) {
+    while (!belowThresholdUnidentifiedCentroids.empty() || !aboveThresholdUnidentifiedCentroids.IsEmpty()) {
         IRUnidentifiedCentroid *nextUnidentifiedCentroid
             = SelectNextUnidentifiedCentroid(&aboveThresholdUnidentifiedCentroids, &belowThresholdUnidentifiedCentroids);
         if (nextUnidentifiedCentroid == NULL) {
@@ -524,24 +845,20 @@ int IdentifyRemainingStarsPairDistance(StarIdentifiers *identifiers,
 
         // find all the catalog stars that are in both annuli
         // flip arguments for appropriate spectrality.
+        const StarIdentifier &first = spectralTorch > 0 ? nextUnidentifiedCentroid->bestStar1 : nextUnidentifiedCentroid->bestStar2;
+        const StarIdentifier &second = spectralTorch > 0 ? nextUnidentifiedCentroid->bestStar2 : nextUnidentifiedCentroid->bestStar1;
+        decimal firstDistance = spectralTorch > 0 ? d1 : d2;
+        decimal secondDistance = spectralTorch > 0 ? d2 : d1;
         std::vector<int16_t> candidates =
-            spectralTorch > 0
-            ? IdentifyThirdStar(db,
-                                catalog,
-                                nextUnidentifiedCentroid->bestStar1.catalogIndex,
-                                nextUnidentifiedCentroid->bestStar2.catalogIndex,
-                                d1, d2, tolerance)
-            : IdentifyThirdStar(db,
-                                catalog,
-                                nextUnidentifiedCentroid->bestStar2.catalogIndex,
-                                nextUnidentifiedCentroid->bestStar1.catalogIndex,
-                                d2, d1, tolerance);
-
-        if (candidates.size() != 1) { // if there is not exactly one candidate, we can't identify the star. Just remove it from the list.
-            if (candidates.size() > 1) {
-                std::cerr << "WARNING: Multiple catalog stars matched during identify remaining stars. This should be rare." << std::endl;
-            }
-        } else {
+            neighbors != NULL
+            ? IdentifyThirdStar(*neighbors, catalog, first.catalogIndex, second.catalogIndex,
+                                firstDistance, secondDistance, tolerance)
+            : IdentifyThirdStar(db, catalog, first.catalogIndex, second.catalogIndex,
+                                firstDistance, secondDistance, tolerance);
+
+        // if there is not exactly one candidate, we can't identify the star. Just remove it from the
+        // list. Multiple candidates should be rare.
+        if (candidates.size() == 1) {
             // identify the centroid
             identifiers->emplace_back(nextUnidentifiedCentroid->index, candidates[0]);
 
@@ -550,8 +867,7 @@ int IdentifyRemainingStarsPairDistance(StarIdentifiers *identifiers,
                                           &aboveThresholdUnidentifiedCentroids, &belowThresholdUnidentifiedCentroids,
                                           db.MinDistance(), db.MaxDistance(),
                                           // TODO should probably tune this:
-                                          kAngleFrom90SoftThreshold,
-                                          camera);
+                                          kAngleFrom90SoftThreshold);
 
             ++numExtraIdentifiedStars;
         }
@@ -568,204 +884,1556 @@ int IdentifyRemainingStarsPairDistance(StarIdentifiers *identifiers,
     return numExtraIdentifiedStars;
 }
 
+/**
+ * Given some identified stars, attempt to identify the rest.
+ *
+ * Requires a pair distance database to be present. Iterates through the unidentified centroids in
+ * an intelligent order, identifying them one by one.
+ *
+ * @param neighbors If not null, and it stores neighbors at least as far out as the pair distance
+ * database stores pairs, candidates are looked up in it instead of the pair distance database.
+ */
+int IdentifyRemainingStarsPairDistance(StarIdentifiers *identifiers,
+                                       const Stars &stars,
+                                       const PairDistanceKVectorDatabase &db,
+                                       const Catalog &catalog,
+                                       const Camera &camera,
+                                       decimal tolerance,
+                                       const NeighborAdjacencyDatabase *neighbors) {
+    return IdentifyRemainingStarsPairDistanceImpl(identifiers, stars, db, catalog, camera, tolerance, neighbors);
+}
+
+/// @copydoc IdentifyRemainingStarsPairDistance
+int IdentifyRemainingStarsPairDistance(StarIdentifiers *identifiers,
+                                       const Stars &stars,
+                                       const CompactPairDistanceDatabase &db,
+                                       const Catalog &catalog,
+                                       const Camera &camera,
+                                       decimal tolerance,
+                                       const NeighborAdjacencyDatabase *neighbors) {
+    return IdentifyRemainingStarsPairDistanceImpl(identifiers, stars, db, catalog, camera, tolerance, neighbors);
+}
+
+/**
+ * IdentifyRemainingStarsPairDistance with whichever pair distance database the multi-database has,
+ * preferring the uncompressed one. Does nothing if it has neither.
+ */
+static void IdentifyRemainingStarsFromDatabase(StarIdentifiers *identifiers,
+                                               const Stars &stars,
+                                               const MultiDatabase &multiDatabase,
+                                               const Catalog &catalog,
+                                               const Camera &camera,
+                                               decimal tolerance) {
+    const unsigned char *pairDistanceBuffer = multiDatabase.SubDatabasePointer(PairDistanceKVectorDatabase::kMagicValue);
+    const unsigned char *compactBuffer = multiDatabase.SubDatabasePointer(CompactPairDistanceDatabase::kMagicValue);
+    if (pairDistanceBuffer != NULL) {
+        DeserializeContext des(pairDistanceBuffer);
+        PairDistanceKVectorDatabase vectorDatabase(&des);
+        IdentifyRemainingStarsPairDistance(identifiers, stars, vectorDatabase, catalog, camera, tolerance,
+                                           FindNeighborAdjacency(multiDatabase).get());
+    } else if (compactBuffer != NULL) {
+        DeserializeContext des(compactBuffer);
+        CompactPairDistanceDatabase vectorDatabase(&des);
+        IdentifyRemainingStarsPairDistance(identifiers, stars, vectorDatabase, catalog, camera, tolerance,
+                                           FindNeighborAdjacency(multiDatabase).get());
+    }
+}
+
+/**
+ * Match centroids to catalog stars by projecting the catalog stars onto the sensor with the given
+ * attitude. A centroid is matched if exactly one projected star is within `matchAngle` of it, and
+ * that catalog star isn't matched to any other centroid.
+ *
+ * @param skip Centroids to leave alone, by star index
+ */
+static StarIdentifiers ProjectionMatches(const Stars &stars, const std::vector<bool> &skip,
+                                         const SkyIndexDatabase &skyIndex, const Catalog &catalog,
+                                         const Camera &camera, const Attitude &attitude,
+                                         decimal matchAngle) {
+
+    // The camera frame has the boresight along +x, so rotating +x back to the celestial frame gives
+    // the boresight.
+    Vec3 boresight = attitude.GetQuaternion().Conjugate().Rotate({1, 0, 0});
+    decimal halfDiagonal = DECIMAL_SQRT(camera.XResolution()*camera.XResolution()
+                                        + camera.YResolution()*camera.YResolution()) / 2;
+    decimal fovRadius = DECIMAL_ATAN(halfDiagonal / camera.FocalLength());
+    std::vector<int16_t> nearby = skyIndex.ConeQuery(boresight, fovRadius + matchAngle);
+
+    // Each centroid is matched to projected stars within this many pixels. Pixels get a bit smaller
+    // than 1/focalLength radians towards the edges, which callers' angular checks make up for.
+    decimal matchRadius = matchAngle * camera.FocalLength();
+
+    // Bucket the projected stars into a grid over the sensor (plus a margin of one cell), with cells
+    // at least matchRadius across, so each centroid only has to look at the 3x3 cells around it.
+    decimal cellSize = std::max(matchRadius, (decimal)std::max(camera.XResolution(), camera.YResolution()) / kIRMaxGridSide);
+    int gridWidth = (int)DECIMAL_CEIL(camera.XResolution() / cellSize) + 2;
+    int gridHeight = (int)DECIMAL_CEIL(camera.YResolution() / cellSize) + 2;
+    std::vector<std::vector<std::pair<Vec2, int16_t>>> grid(gridWidth * gridHeight);
+    for (int16_t catalogIndex : nearby) {
+        Vec3 rotated = attitude.Rotate(catalog[catalogIndex].spatial);
+        if (rotated.x <= 0) {
+            continue;
+        }
+        Vec2 projected = camera.SpatialToCamera(rotated);
+        int gridX = (int)DECIMAL_FLOOR(projected.x / cellSize) + 1;
+        int gridY = (int)DECIMAL_FLOOR(projected.y / cellSize) + 1;
+        if (gridX < 0 || gridX >= gridWidth || gridY < 0 || gridY >= gridHeight) {
+            continue;
+        }
+        grid[gridY*gridWidth + gridX].emplace_back(projected, catalogIndex);
+    }
+
+    // Only keep centroids with exactly one projected star in range; anything else is ambiguous.
+    StarIdentifiers candidates;
+    std::unordered_map<int16_t, int> timesMatched;
+    for (int i = 0; i < (int)stars.size(); i++) {
+        if (skip[i]) {
+            continue;
+        }
+        int gridX = (int)DECIMAL_FLOOR(stars[i].position.x / cellSize) + 1;
+        int gridY = (int)DECIMAL_FLOOR(stars[i].position.y / cellSize) + 1;
+        int numInRange = 0;
+        int16_t match = -1;
+        for (int y = std::max(0, gridY-1); y <= std::min(gridHeight-1, gridY+1); y++) {
+            for (int x = std::max(0, gridX-1); x <= std::min(gridWidth-1, gridX+1); x++) {
+                for (const std::pair<Vec2, int16_t> &projected : grid[y*gridWidth + x]) {
+                    if ((projected.first - stars[i].position).Magnitude() <= matchRadius) {
+                        numInRange++;
+                        match = projected.second;
+                    }
+                }
+            }
+        }
+        if (numInRange == 1) {
+            candidates.push_back(StarIdentifier(i, match));
+            timesMatched[match]++;
+        }
+    }
+
+    StarIdentifiers result;
+    for (const StarIdentifier &candidate : candidates) {
+        if (timesMatched[candidate.catalogIndex] == 1) {
+            result.push_back(candidate);
+        }
+    }
+    return result;
+}
+
+/**
+ * Given some identified stars, attempt to identify the rest by projecting the catalog onto the sensor.
+ *
+ * Requires a sky index database. Estimates the attitude from the stars already identified, then
+ * matches each unidentified centroid to the nearest projected catalog star. This takes a single cone
+ * query, instead of a pair distance query per centroid like IdentifyRemainingStarsPairDistance.
+ * Each new match must also be the right distance from every star identified before.
+ */
+int IdentifyRemainingStarsProjection(StarIdentifiers *identifiers,
+                                     const Stars &stars,
+                                     const SkyIndexDatabase &skyIndex,
+                                     const Catalog &catalog,
+                                     const Camera &camera,
+                                     decimal tolerance) {
+    if (identifiers->size() < 2) {
+        return 0;
+    }
+
+    DavenportQAlgorithm attitudeEstimator;
+    Attitude attitude = attitudeEstimator.Go(camera, stars, catalog, *identifiers);
+
+    std::vector<bool> alreadyIdentified(stars.size(), false);
+    std::vector<int16_t> alreadyIdentifiedCatalog;
+    for (const StarIdentifier &identifier : *identifiers) {
+        alreadyIdentified[identifier.starIndex] = true;
+        alreadyIdentifiedCatalog.push_back(identifier.catalogIndex);
+    }
+    // The estimated attitude is only as good as the few stars it's based on, so allow for some
+    // error on top of the centroid's own.
+    StarIdentifiers candidates = ProjectionMatches(stars, alreadyIdentified, skyIndex, catalog,
+                                                   camera, attitude, 2*tolerance);
+
+    int numInitiallyIdentified = identifiers->size();
+    std::vector<Vec3> identifiedSpatials;
+    for (const StarIdentifier &identified : *identifiers) {
+        identifiedSpatials.push_back(camera.CameraToSpatial(stars[identified.starIndex].position).Normalize());
+    }
+    AngleTolerance verifyTolerance(2*tolerance);
+    for (const StarIdentifier &candidate : candidates) {
+        if (std::find(alreadyIdentifiedCatalog.begin(), alreadyIdentifiedCatalog.end(), candidate.catalogIndex)
+            != alreadyIdentifiedCatalog.end()) {
+            continue;
+        }
+        Vec3 candidateSpatial = camera.CameraToSpatial(stars[candidate.starIndex].position).Normalize();
+        bool distancesAgree = true;
+        for (int i = 0; i < numInitiallyIdentified && distancesAgree; i++) {
+            distancesAgree = AngleWindow(candidateSpatial, identifiedSpatials[i], verifyTolerance).Contains(
+                catalog[candidate.catalogIndex].spatial * catalog[(*identifiers)[i].catalogIndex].spatial);
+        }
+        if (distancesAgree) {
+            identifiers->push_back(candidate);
+        }
+    }
+
+    return identifiers->size() - numInitiallyIdentified;
+}
+
+/**
+ * Uses a pair distance database if there is one, or else a compact pair distance database.
+ */
 StarIdentifiers PyramidStarIdAlgorithm::Go(
-    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera) const {
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    StarIdStats *stats) const {
+
+    StarIdStats unusedStats;
+    if (stats == NULL) {
+        stats = &unusedStats;
+    }
 
-    StarIdentifiers identified;
     MultiDatabase multiDatabase(database);
     const unsigned char *databaseBuffer = multiDatabase.SubDatabasePointer(PairDistanceKVectorDatabase::kMagicValue);
-    if (databaseBuffer == NULL || stars.size() < 4) {
+    const unsigned char *compactBuffer = multiDatabase.SubDatabasePointer(CompactPairDistanceDatabase::kMagicValue);
+    if ((databaseBuffer == NULL && compactBuffer == NULL) || stars.size() < 4) {
         std::cerr << "Not enough stars, or database missing." << std::endl;
-        return identified;
+        return StarIdentifiers();
     }
-    DeserializeContext des(databaseBuffer);
-    PairDistanceKVectorDatabase vectorDatabase(&des);
+    if (databaseBuffer != NULL) {
+        DeserializeContext des(databaseBuffer);
+        return Go(PairDistanceKVectorDatabase(&des), multiDatabase, stars, catalog, camera, stats);
+    }
+    DeserializeContext des(compactBuffer);
+    return Go(CompactPairDistanceDatabase(&des), multiDatabase, stars, catalog, camera, stats);
+}
+
+template <typename PairDatabase>
+StarIdentifiers PyramidStarIdAlgorithm::Go(
+    const PairDatabase &vectorDatabase, const MultiDatabase &multiDatabase,
+    const Stars &stars, const Catalog &catalog, const Camera &camera, StarIdStats *stats) const {
+
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    StarIdDeadline deadline(startTime, deadlineUs);
+
+    StarIdentifiers identified;
+    // only build a view of our own if none was built when the database was loaded
+    std::unique_ptr<CatalogView> ownCatalogView;
+    if (catalogView == NULL) {
+        ownCatalogView.reset(new CatalogView(catalog));
+    }
+    const CatalogView &view = catalogView != NULL ? *catalogView : *ownCatalogView;
+    assert(view.Size() == (long)catalog.size());
+    // only used if queries have to be decoded out of the database
+    std::vector<int16_t> ijBuffer, ikBuffer, irBuffer;
+    // reused for every candidate, to avoid allocating in the inner loops
+    std::vector<int16_t> kCandidates, rCandidates;
+    std::vector<decimal> dots;
+    // stars that could be the i star of the current pyramid, and scratch space to find them
+    CatalogStarSet iCandidateSet(catalog.size());
+    CatalogStarSet querySet(catalog.size());
 
     // smallest normal single-precision decimal is around 10^-38 so we should be all good. See
     // Analytic_Star_Pattern_Probability on the HSL wiki for details.
     decimal expectedMismatchesConstant = DECIMAL_POW(numFalseStars, 4) * DECIMAL_POW(tolerance, 5) / 2 / DECIMAL_POW(DECIMAL_M_PI, 2);
+    // in the same units as CatalogStar::magnitude
+    int catalogMagnitudeMargin = magnitudeMargin < 0 ? -1 : (int)DECIMAL_ROUND(magnitudeMargin*100);
+    // positionUncertainty is in pixels, and a pixel near the center is about this many radians
+    std::vector<decimal> uncertainties(stars.size());
+    for (int s = 0; s < (int)stars.size(); s++) {
+        uncertainties[s] = stars[s].positionUncertainty / camera.FocalLength();
+    }
 
     // this iteration technique is described in the Pyramid paper. Briefly: i will always be the
     // lowest index, then dj and dk are how many indexes ahead the j-th star is from the i-th, and
     // k-th from the j-th. In addition, we here add some other numbers so that the pyramids are not
     // weird lines in wide FOV images. TODO: Select the starting points to ensure that the first pyramids are all within measurement tolerance.
-    int numStars = (int)stars.size();
-    // the idea is that the square root is about across the FOV horizontally
-    int across = floor(sqrt(numStars))*2;
-    int halfwayAcross = floor(sqrt(numStars)/2);
+    // Centroids in the order to enumerate pyramids over: either as given, or brightest first. Either
+    // way, pyramids are then enumerated over the first tierSize of them, then twice as many, and so
+    // on, skipping pyramids already tried in an earlier tier.
+    std::vector<int> order(stars.size());
+    std::iota(order.begin(), order.end(), 0);
+    int tierSize = (int)stars.size();
+    if (brightestFirst > 0) {
+        // stable, so the spread heuristic still decides between stars of the same brightness
+        std::stable_sort(order.begin(), order.end(), [&stars](int a, int b) {
+            return stars[a].magnitude > stars[b].magnitude;
+        });
+        tierSize = std::max(4, std::min(brightestFirst, tierSize));
+    }
     long totalIterations = 0;
 
-    int jMax = numStars - 3;
-    for (int jIter = 0; jIter < jMax; jIter++) {
-        int dj = 1+(jIter+halfwayAcross)%jMax;
+    for (int lastTierSize = 0; lastTierSize < (int)stars.size();
+         lastTierSize = tierSize, tierSize = std::min(2*tierSize, (int)stars.size())) {
+        int numStars = tierSize;
+        // the idea is that the square root is about across the FOV horizontally
+        int across = floor(sqrt(numStars))*2;
+        int halfwayAcross = floor(sqrt(numStars)/2);
+
+        int jMax = numStars - 3;
+        for (int jIter = 0; jIter < jMax; jIter++) {
+            int dj = 1+(jIter+halfwayAcross)%jMax;
+
+            int kMax = numStars-dj-2;
+            for (int kIter = 0; kIter < kMax; kIter++) {
+                int dk = 1+(kIter+across)%kMax;
+
+                int rMax = numStars-dj-dk-1;
+                for (int rIter = 0; rIter < rMax; rIter++) {
+                    int dr = 1+(rIter+halfwayAcross)%rMax;
+
+                    int iMax = numStars-dj-dk-dr-1;
+                    for (int iIter = 0; iIter <= iMax; iIter++) {
+                        int iRank = (iIter + iMax/2)%(iMax+1); // start near the center of the photo
+                        int jRank = iRank+dj;
+                        int kRank = jRank+dk;
+                        int rRank = kRank+dr;
+                        // already tried in an earlier tier
+                        if (rRank < lastTierSize) {
+                            continue;
+                        }
 
-        int kMax = numStars-dj-2;
-        for (int kIter = 0; kIter < kMax; kIter++) {
-            int dk = 1+(kIter+across)%kMax;
+                        // identification failure due to cutoff
+                        if (++totalIterations > cutoff) {
+                            std::cerr << "Cutoff reached." << std::endl;
+                            return identified;
+                        }
+                        if (deadline.Passed()) {
+                            stats->timedOut = true;
+                            return identified;
+                        }
 
-            int rMax = numStars-dj-dk-1;
-            for (int rIter = 0; rIter < rMax; rIter++) {
-                int dr = 1+(rIter+halfwayAcross)%rMax;
+                        int i = order[iRank];
+                        int j = order[jRank];
+                        int k = order[kRank];
+                        int r = order[rRank];
 
-                int iMax = numStars-dj-dk-dr-1;
-                for (int iIter = 0; iIter <= iMax; iIter++) {
-                    int i = (iIter + iMax/2)%(iMax+1); // start near the center of the photo
+                        assert(i != j && j != k && k != r && i != k && i != r && j != r);
 
-                    // identification failure due to cutoff
-                    if (++totalIterations > cutoff) {
-                        std::cerr << "Cutoff reached." << std::endl;
-                        return identified;
-                    }
+                        // TODO: move this out of the loop?
+                        Vec3 iSpatial = camera.CameraToSpatial(stars[i].position).Normalize();
+                        Vec3 jSpatial = camera.CameraToSpatial(stars[j].position).Normalize();
+                        Vec3 kSpatial = camera.CameraToSpatial(stars[k].position).Normalize();
 
-                    int j = i+dj;
-                    int k = j+dk;
-                    int r = k+dr;
+                        decimal ijDist = AngleUnit(iSpatial, jSpatial);
 
-                    assert(i != j && j != k && k != r && i != k && i != r && j != r);
+                        decimal iSinInner = DECIMAL_SIN(Angle(jSpatial - iSpatial, kSpatial - iSpatial));
+                        decimal jSinInner = DECIMAL_SIN(Angle(iSpatial - jSpatial, kSpatial - jSpatial));
+                        decimal kSinInner = DECIMAL_SIN(Angle(iSpatial - kSpatial, jSpatial - kSpatial));
 
-                    // TODO: move this out of the loop?
-                    Vec3 iSpatial = camera.CameraToSpatial(stars[i].position).Normalize();
-                    Vec3 jSpatial = camera.CameraToSpatial(stars[j].position).Normalize();
-                    Vec3 kSpatial = camera.CameraToSpatial(stars[k].position).Normalize();
+                        // if we made it this far, all 6 angles are confirmed! Now check
+                        // that this match would not often occur due to chance.
+                        // See Analytic_Star_Pattern_Probability on the HSL wiki for details
+                        decimal expectedMismatches = expectedMismatchesConstant
+                            * DECIMAL_SIN(ijDist)
+                            / kSinInner
+                            / std::max(std::max(iSinInner, jSinInner), kSinInner);
 
-                    decimal ijDist = AngleUnit(iSpatial, jSpatial);
+                        if (expectedMismatches > maxMismatchProbability) {
+                            continue;
+                        }
 
-                    decimal iSinInner = DECIMAL_SIN(Angle(jSpatial - iSpatial, kSpatial - iSpatial));
-                    decimal jSinInner = DECIMAL_SIN(Angle(iSpatial - jSpatial, kSpatial - jSpatial));
-                    decimal kSinInner = DECIMAL_SIN(Angle(iSpatial - kSpatial, jSpatial - kSpatial));
+                        Vec3 rSpatial = camera.CameraToSpatial(stars[r].position).Normalize();
 
-                    // if we made it this far, all 6 angles are confirmed! Now check
-                    // that this match would not often occur due to chance.
-                    // See Analytic_Star_Pattern_Probability on the HSL wiki for details
-                    decimal expectedMismatches = expectedMismatchesConstant
-                        * DECIMAL_SIN(ijDist)
-                        / kSinInner
-                        / std::max(std::max(iSinInner, jSinInner), kSinInner);
+                        // sign of determinant, to detect flipped patterns
+                        bool spectralTorch = iSpatial.CrossProduct(jSpatial)*kSpatial > 0;
 
-                    if (expectedMismatches > maxMismatchProbability) {
-                        std::cout << "skip: mismatch prob." << std::endl;
-                        continue;
-                    }
-
-                    Vec3 rSpatial = camera.CameraToSpatial(stars[r].position).Normalize();
+                        decimal ikDist = AngleUnit(iSpatial, kSpatial);
+                        decimal irDist = AngleUnit(iSpatial, rSpatial);
+                        decimal jkDist = AngleUnit(jSpatial, kSpatial);
+                        decimal jrDist = AngleUnit(jSpatial, rSpatial);
+                        decimal krDist = AngleUnit(kSpatial, rSpatial); // TODO: we don't really need to
+                                                                      // check krDist, if k has been
+                                                                      // verified by i and j it's fine.
 
-                    // sign of determinant, to detect flipped patterns
-                    bool spectralTorch = iSpatial.CrossProduct(jSpatial)*kSpatial > 0;
-
-                    decimal ikDist = AngleUnit(iSpatial, kSpatial);
-                    decimal irDist = AngleUnit(iSpatial, rSpatial);
-                    decimal jkDist = AngleUnit(jSpatial, kSpatial);
-                    decimal jrDist = AngleUnit(jSpatial, rSpatial);
-                    decimal krDist = AngleUnit(kSpatial, rSpatial); // TODO: we don't really need to
-                                                                  // check krDist, if k has been
-                                                                  // verified by i and j it's fine.
-
-                    // we check the distances with the extra tolerance requirement to ensure that
-                    // there isn't some pyramid that's just outside the database's bounds, but
-                    // within measurement tolerance of the observed pyramid, since that would
-                    // possibly cause a non-unique pyramid to be identified as unique.
+                        // we check the distances with the extra tolerance requirement to ensure that
+                        // there isn't some pyramid that's just outside the database's bounds, but
+                        // within measurement tolerance of the observed pyramid, since that would
+                        // possibly cause a non-unique pyramid to be identified as unique.
 #define _CHECK_DISTANCE(_dist) if (_dist < vectorDatabase.MinDistance() + tolerance || _dist > vectorDatabase.MaxDistance() - tolerance) { continue; }
-                    _CHECK_DISTANCE(ikDist);
-                    _CHECK_DISTANCE(irDist);
-                    _CHECK_DISTANCE(jkDist);
-                    _CHECK_DISTANCE(jrDist);
-                    _CHECK_DISTANCE(krDist);
+                        _CHECK_DISTANCE(ikDist);
+                        _CHECK_DISTANCE(irDist);
+                        _CHECK_DISTANCE(jkDist);
+                        _CHECK_DISTANCE(jrDist);
+                        _CHECK_DISTANCE(krDist);
 #undef _CHECK_DISTANCE
 
-                    const int16_t *ijEnd, *ikEnd, *irEnd;
-                    const int16_t *const ijQuery = vectorDatabase.FindPairsLiberal(ijDist - tolerance, ijDist + tolerance, &ijEnd);
-                    const int16_t *const ikQuery = vectorDatabase.FindPairsLiberal(ikDist - tolerance, ikDist + tolerance, &ikEnd);
-                    const int16_t *const irQuery = vectorDatabase.FindPairsLiberal(irDist - tolerance, irDist + tolerance, &irEnd);
-
-                    std::unordered_multimap<int16_t, int16_t> ikMap = PairDistanceQueryToMap(ikQuery, ikEnd);
-                    std::unordered_multimap<int16_t, int16_t> irMap = PairDistanceQueryToMap(irQuery, irEnd);
-
-                    int iMatch = -1, jMatch = -1, kMatch = -1, rMatch = -1;
-                    for (const int16_t *iCandidateQuery = ijQuery; iCandidateQuery != ijEnd; iCandidateQuery++) {
-                        int iCandidate = *iCandidateQuery;
-                        // depending on parity, the first or second star in the pair is the "other" one
-                        int jCandidate = (iCandidateQuery - ijQuery) % 2 == 0
-                            ? iCandidateQuery[1]
-                            : iCandidateQuery[-1];
-
-                        const Vec3 &iCandidateSpatial = catalog[iCandidate].spatial;
-                        const Vec3 &jCandidateSpatial = catalog[jCandidate].spatial;
-
-                        Vec3 ijCandidateCross = iCandidateSpatial.CrossProduct(jCandidateSpatial);
-
-                        for (auto kCandidateIt = ikMap.equal_range(iCandidate); kCandidateIt.first != kCandidateIt.second; kCandidateIt.first++) {
-                            // kCandidate.first is iterator, then ->second is the value (other star)
-                            int kCandidate = kCandidateIt.first->second;
-                            Vec3 kCandidateSpatial = catalog[kCandidate].spatial;
-                            bool candidateSpectralTorch = ijCandidateCross*kCandidateSpatial > 0;
-                            // checking the spectral-ity early to fail fast
-                            if (candidateSpectralTorch != spectralTorch) {
+                        // the uniqueness checks above still use the full tolerance, but the queries
+                        // only need to be as wide as the centroids are uncertain
+                        decimal ijTolerance = PairTolerance(uncertainties, i, j, toleranceSigmas, tolerance);
+                        decimal ikTolerance = PairTolerance(uncertainties, i, k, toleranceSigmas, tolerance);
+                        decimal irTolerance = PairTolerance(uncertainties, i, r, toleranceSigmas, tolerance);
+
+                        const int16_t *ijEnd, *ikEnd, *irEnd;
+                        const int16_t *const ijQuery = FindPairs(vectorDatabase, ijDist - ijTolerance, ijDist + ijTolerance, &ijBuffer, &ijEnd);
+                        const int16_t *const ikQuery = FindPairs(vectorDatabase, ikDist - ikTolerance, ikDist + ikTolerance, &ikBuffer, &ikEnd);
+                        const int16_t *const irQuery = FindPairs(vectorDatabase, irDist - irTolerance, irDist + irTolerance, &irBuffer, &irEnd);
+                        stats->patternsTried++;
+                        stats->databaseQueries += 3;
+
+                        // The i star must be in all three queries. Most catalog stars in one query aren't
+                        // in the others, so intersect them before building maps or looking at candidates.
+                        iCandidateSet.Clear();
+                        iCandidateSet.InsertPairs(ijQuery, ijEnd);
+                        querySet.Clear();
+                        querySet.InsertPairs(ikQuery, ikEnd);
+                        if (!iCandidateSet.IntersectWith(querySet)) {
+                            continue;
+                        }
+                        querySet.Clear();
+                        querySet.InsertPairs(irQuery, irEnd);
+                        if (!iCandidateSet.IntersectWith(querySet)) {
+                            continue;
+                        }
+
+                        std::unordered_multimap<int16_t, int16_t> ikMap = PairDistanceQueryToMap(ikQuery, ikEnd, iCandidateSet);
+                        std::unordered_multimap<int16_t, int16_t> irMap = PairDistanceQueryToMap(irQuery, irEnd, iCandidateSet);
+
+                        AngleWindow jkWindow(jkDist, PairTolerance(uncertainties, j, k, toleranceSigmas, tolerance));
+                        AngleWindow jrWindow(jrDist, PairTolerance(uncertainties, j, r, toleranceSigmas, tolerance));
+                        AngleWindow krWindow(krDist, PairTolerance(uncertainties, k, r, toleranceSigmas, tolerance));
+
+                        int iMatch = -1, jMatch = -1, kMatch = -1, rMatch = -1;
+                        for (const int16_t *iCandidateQuery = ijQuery; iCandidateQuery != ijEnd; iCandidateQuery++) {
+                            int iCandidate = *iCandidateQuery;
+                            if (!iCandidateSet.Contains(iCandidate)) {
                                 continue;
                             }
+                            // depending on parity, the first or second star in the pair is the "other" one
+                            int jCandidate = (iCandidateQuery - ijQuery) % 2 == 0
+                                ? iCandidateQuery[1]
+                                : iCandidateQuery[-1];
+                            if (!BrightnessAgrees(stars[i], stars[j], catalog[iCandidate], catalog[jCandidate],
+                                                  catalogMagnitudeMargin)) {
+                                continue;
+                            }
+                            stats->candidatesExamined++;
 
-                            // small optimization: We can calculate jk before iterating through r, so we will!
-                            decimal jkCandidateDist = AngleUnit(jCandidateSpatial, kCandidateSpatial);
-                            if (jkCandidateDist < jkDist - tolerance || jkCandidateDist > jkDist + tolerance) {
+                            PairedStars(ikMap, iCandidate, &kCandidates);
+                            FilterByBrightness(&kCandidates, stars[k], stars[i], iCandidate, catalog, catalogMagnitudeMargin);
+                            FilterByBrightness(&kCandidates, stars[k], stars[j], jCandidate, catalog, catalogMagnitudeMargin);
+                            if (kCandidates.empty()) {
+                                continue;
+                            }
+                            PairedStars(irMap, iCandidate, &rCandidates);
+                            FilterByBrightness(&rCandidates, stars[r], stars[i], iCandidate, catalog, catalogMagnitudeMargin);
+                            FilterByBrightness(&rCandidates, stars[r], stars[j], jCandidate, catalog, catalogMagnitudeMargin);
+                            if (rCandidates.empty()) {
                                 continue;
                             }
 
-                            // TODO: if there are no jr matches, there's no reason to
-                            // continue iterating through all the other k-s. Possibly
-                            // enumarete all r matches, according to ir, before this loop
-                            for (auto rCandidateIt = irMap.equal_range(iCandidate); rCandidateIt.first != rCandidateIt.second; rCandidateIt.first++) {
-                                int rCandidate = rCandidateIt.first->second;
-                                const Vec3 &rCandidateSpatial = catalog[rCandidate].spatial;
-                                decimal jrCandidateDist = AngleUnit(jCandidateSpatial, rCandidateSpatial);
-                                decimal krCandidateDist;
-                                if (jrCandidateDist < jrDist - tolerance || jrCandidateDist > jrDist + tolerance) {
-                                    continue;
+                            Vec3 jCandidateSpatial = view.Spatial(jCandidate);
+                            Vec3 ijCandidateCross = view.Spatial(iCandidate).CrossProduct(jCandidateSpatial);
+
+                            // checking the spectral-ity first to fail fast
+                            dots.resize(std::max(kCandidates.size(), rCandidates.size()));
+                            view.GatherDot(kCandidates.data(), kCandidates.size(), ijCandidateCross, dots.data());
+                            size_t numSpectralK = 0;
+                            for (size_t n = 0; n < kCandidates.size(); n++) {
+                                if ((dots[n] > 0) == spectralTorch) {
+                                    kCandidates[numSpectralK++] = kCandidates[n];
                                 }
-                                krCandidateDist = AngleUnit(kCandidateSpatial, rCandidateSpatial);
-                                if (krCandidateDist < krDist - tolerance || krCandidateDist > krDist + tolerance) {
-                                    continue;
+                            }
+                            kCandidates.resize(numSpectralK);
+                            // small optimization: we can check jk and jr before pairing up k and r candidates
+                            view.GatherDot(kCandidates.data(), kCandidates.size(), jCandidateSpatial, dots.data());
+                            FilterByDot(&kCandidates, dots, jkWindow);
+                            view.GatherDot(rCandidates.data(), rCandidates.size(), jCandidateSpatial, dots.data());
+                            FilterByDot(&rCandidates, dots, jrWindow);
+
+                            for (int16_t kCandidate : kCandidates) {
+                                view.GatherDot(rCandidates.data(), rCandidates.size(),
+                                               view.Spatial(kCandidate), dots.data());
+                                for (size_t n = 0; n < rCandidates.size(); n++) {
+                                    if (!krWindow.Contains(dots[n])
+                                        || !BrightnessAgrees(stars[k], stars[r], catalog[kCandidate], catalog[rCandidates[n]],
+                                                             catalogMagnitudeMargin)) {
+                                        continue;
+                                    }
+
+                                    // we have a match!
+
+                                    if (iMatch == -1) {
+                                        iMatch = iCandidate;
+                                        jMatch = jCandidate;
+                                        kMatch = kCandidate;
+                                        rMatch = rCandidates[n];
+                                    } else {
+                                        // uh-oh, stinky!
+                                        // TODO: test duplicate detection, it's hard to cause it in the real catalog...
+                                        goto sensorContinue;
+                                    }
                                 }
+                            }
+                        }
 
-                                // we have a match!
-
-                                if (iMatch == -1) {
-                                    iMatch = iCandidate;
-                                    jMatch = jCandidate;
-                                    kMatch = kCandidate;
-                                    rMatch = rCandidate;
-                                } else {
-                                    // uh-oh, stinky!
-                                    // TODO: test duplicate detection, it's hard to cause it in the real catalog...
-                                    std::cerr << "Pyramid not unique, skipping..." << std::endl;
-                                    goto sensorContinue;
-                                }
+                        if (iMatch != -1) {
+                            stats->firstMatchTimeNs = NanosecondsSince(startTime);
+                            identified.push_back(StarIdentifier(i, iMatch));
+                            identified.push_back(StarIdentifier(j, jMatch));
+                            identified.push_back(StarIdentifier(k, kMatch));
+                            identified.push_back(StarIdentifier(r, rMatch));
+
+                            int numAdditionallyIdentified;
+                            const unsigned char *skyIndexBuffer = identifyRemaining == IdentifyRemainingMode::Projection
+                                ? multiDatabase.SubDatabasePointer(SkyIndexDatabase::kMagicValue)
+                                : NULL;
+                            // without a sky index, fall back to pair distance
+                            if (skyIndexBuffer != NULL) {
+                                DeserializeContext skyIndexDes(skyIndexBuffer);
+                                SkyIndexDatabase skyIndex(&skyIndexDes);
+                                numAdditionallyIdentified = IdentifyRemainingStarsProjection(&identified, stars, skyIndex, catalog, camera, tolerance);
+                            } else {
+                                numAdditionallyIdentified = IdentifyRemainingStarsPairDistance(&identified, stars, vectorDatabase, catalog, camera, tolerance,
+                                                                                               FindNeighborAdjacency(multiDatabase).get());
                             }
+                            assert(numAdditionallyIdentified == (int)identified.size()-4);
+
+                            return identified;
                         }
 
+                    sensorContinue:;
+                    }
+                }
+            }
+        }
+    }
+
+    std::cerr << "Tried all pyramids; none matched." << std::endl;
+    return identified;
+}
+
+/**
+ * Largest edge ratio tolerance Tetra will query with. Patterns that are small compared to the
+ * angular tolerance have poorly determined edge ratios, and querying them would visit a huge number
+ * of bins for little chance of a unique match.
+ */
+const decimal kTetraMaxRatioTolerance = DECIMAL(0.025);
+
+StarIdentifiers TetraStarIdAlgorithm::Go(
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    StarIdStats *stats) const {
+
+    StarIdStats unusedStats;
+    if (stats == NULL) {
+        stats = &unusedStats;
+    }
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    StarIdDeadline deadline(startTime, deadlineUs);
+
+    StarIdentifiers identified;
+    MultiDatabase multiDatabase(database);
+    const unsigned char *databaseBuffer = multiDatabase.SubDatabasePointer(TetraDatabase::kMagicValue);
+    if (databaseBuffer == NULL || stars.size() < kTetraPatternSize) {
+        std::cerr << "Not enough stars, or database missing." << std::endl;
+        return identified;
+    }
+    DeserializeContext des(databaseBuffer);
+    TetraDatabase tetraDatabase(&des);
+
+    int numStars = (int)stars.size();
+    std::vector<Vec3> spatials;
+    for (const Star &star : stars) {
+        spatials.push_back(camera.CameraToSpatial(star.position).Normalize());
+    }
+    // The database was built from the brightest catalog stars, so patterns made from the brightest
+    // centroids are the most likely to be in it.
+    std::vector<int> byBrightness(numStars);
+    std::iota(byBrightness.begin(), byBrightness.end(), 0);
+    std::stable_sort(byBrightness.begin(), byBrightness.end(), [&stars](int a, int b) {
+        return stars[a].magnitude > stars[b].magnitude;
+    });
 
+    long totalIterations = 0;
+    // try every pattern among the brightest n centroids before any pattern including the n+1-th
+    for (int d = kTetraPatternSize-1; d < numStars; d++) {
+        for (int c = 2; c < d; c++) {
+            for (int b = 1; b < c; b++) {
+                for (int a = 0; a < b; a++) {
+                    // identification failure due to cutoff
+                    if (++totalIterations > cutoff) {
+                        std::cerr << "Cutoff reached." << std::endl;
+                        return identified;
+                    }
+                    if (deadline.Passed()) {
+                        stats->timedOut = true;
+                        return identified;
+                    }
+
+                    int pattern[kTetraPatternSize] = {
+                        byBrightness[a], byBrightness[b], byBrightness[c], byBrightness[d] };
+                    Vec3 patternSpatials[kTetraPatternSize];
+                    for (int i = 0; i < kTetraPatternSize; i++) {
+                        patternSpatials[i] = spatials[pattern[i]];
+                    }
+
+                    decimal edges[kTetraNumEdges];
+                    TetraPatternEdges(patternSpatials, edges);
+                    decimal longestEdge = edges[kTetraNumEdges-1];
+                    // same reasoning as in Pyramid: a catalog pattern just outside the database's
+                    // bounds could otherwise make a non-unique pattern look unique.
+                    if (longestEdge > tetraDatabase.MaxAngle() - tolerance) {
+                        continue;
+                    }
+                    // each ratio is off by up to about 2*tolerance/longestEdge when both of its
+                    // edges are off by tolerance
+                    decimal ratioTolerance = 2*tolerance/longestEdge;
+                    if (ratioTolerance > kTetraMaxRatioTolerance) {
+                        continue;
+                    }
+                    decimal edgeRatios[kTetraNumEdges-1];
+                    for (int i = 0; i < kTetraNumEdges-1; i++) {
+                        edgeRatios[i] = edges[i] / longestEdge;
+                    }
+
+                    std::vector<const int16_t *> candidates =
+                        tetraDatabase.FindPatterns(catalog, edgeRatios, ratioTolerance);
+                    stats->patternsTried++;
+                    stats->databaseQueries++;
+                    stats->candidatesExamined += candidates.size();
+                    if (candidates.empty()) {
+                        continue;
+                    }
+
+                    // sign of determinant, to detect flipped patterns
+                    bool spectralTorch = patternSpatials[0].CrossProduct(patternSpatials[1])*patternSpatials[2] > 0;
+
+                    std::vector<AngleWindow> windows; // one for each i < j, in order
+                    windows.reserve(kTetraNumEdges);
+                    for (int i = 0; i < kTetraPatternSize; i++) {
+                        for (int j = i+1; j < kTetraPatternSize; j++) {
+                            windows.push_back(AngleWindow(AngleUnit(patternSpatials[i], patternSpatials[j]), tolerance));
+                        }
                     }
 
-                    if (iMatch != -1) {
-                        std::cout.precision(6);
-                        std::cout << "Matched unique pyramid!" << std::endl << "Expected mismatches: " << std::scientific << expectedMismatches << std::endl << std::fixed;
-                        identified.push_back(StarIdentifier(i, iMatch));
-                        identified.push_back(StarIdentifier(j, jMatch));
-                        identified.push_back(StarIdentifier(k, kMatch));
-                        identified.push_back(StarIdentifier(r, rMatch));
+                    // Stars within a database pattern are in no particular order, so try every
+                    // assignment of catalog stars to centroids, checking the actual angles.
+                    int numMatches = 0;
+                    int16_t match[kTetraPatternSize];
+                    for (const int16_t *candidate : candidates) {
+                        int permutation[kTetraPatternSize] = { 0, 1, 2, 3 };
+                        do {
+                            const Vec3 &candidate0 = catalog[candidate[permutation[0]]].spatial;
+                            const Vec3 &candidate1 = catalog[candidate[permutation[1]]].spatial;
+                            const Vec3 &candidate2 = catalog[candidate[permutation[2]]].spatial;
+                            if ((candidate0.CrossProduct(candidate1)*candidate2 > 0) != spectralTorch) {
+                                continue;
+                            }
 
-                        int numAdditionallyIdentified = IdentifyRemainingStarsPairDistance(&identified, stars, vectorDatabase, catalog, camera, tolerance);
-                        printf("Identified an additional %d stars.\n", numAdditionallyIdentified);
-                        assert(numAdditionallyIdentified == (int)identified.size()-4);
+                            bool anglesMatch = true;
+                            int edge = 0;
+                            for (int i = 0; i < kTetraPatternSize && anglesMatch; i++) {
+                                for (int j = i+1; j < kTetraPatternSize; j++) {
+                                    if (!windows[edge++].Contains(catalog[candidate[permutation[i]]].spatial
+                                                                  * catalog[candidate[permutation[j]]].spatial)) {
+                                        anglesMatch = false;
+                                        break;
+                                    }
+                                }
+                            }
+                            if (anglesMatch) {
+                                numMatches++;
+                                for (int i = 0; i < kTetraPatternSize; i++) {
+                                    match[i] = candidate[permutation[i]];
+                                }
+                            }
+                        } while (std::next_permutation(permutation, permutation + kTetraPatternSize));
+                    }
+
+                    if (numMatches > 1) {
+                        continue;
+                    }
+                    if (numMatches == 1) {
+                        stats->firstMatchTimeNs = NanosecondsSince(startTime);
+                        for (int i = 0; i < kTetraPatternSize; i++) {
+                            identified.push_back(StarIdentifier(pattern[i], match[i]));
+                        }
+
+                        IdentifyRemainingStarsFromDatabase(&identified, stars, multiDatabase, catalog, camera, tolerance);
 
                         return identified;
                     }
+                }
+            }
+        }
+    }
+
+    std::cerr << "Tried all patterns; none matched." << std::endl;
+    return identified;
+}
 
-                sensorContinue:;
+/**
+ * Largest error in the inner angle of a triangle that Non-Dimensional will query with. Triangles with
+ * sides that are short compared to the angular tolerance have poorly determined inner angles, and
+ * would match large parts of the database.
+ */
+const decimal kNonDimensionalMaxInnerTolerance = DECIMAL(0.02);
+
+/**
+ * How far off each inner angle of an image triangle may be.
+ * @param sides sides[c] is the side opposite corner c
+ * @param tolerance How far each centroid may be from where it should be, in radians
+ */
+static void NonDimensionalInnerTolerances(const decimal *sides, decimal tolerance, decimal *innerTolerances) {
+    // Moving the far end of a side adjacent to a corner by `tolerance` changes the corner's angle by
+    // up to tolerance/side. Moving the corner itself could double that, but centroid errors are
+    // rarely all worst-case at once.
+    for (int c = 0; c < 3; c++) {
+        innerTolerances[c] = tolerance*(1/sides[(c+1)%3] + 1/sides[(c+2)%3]);
+    }
+}
+
+/// Whether the image triangle abc has the same inner angles as the catalog triangle with the given corners.
+static bool NonDimensionalTriangleAgrees(const Vec3 &a, const Vec3 &b, const Vec3 &c,
+                                         const Vec3 &catalogA, const Vec3 &catalogB, const Vec3 &catalogC,
+                                         decimal tolerance) {
+    decimal sides[3] = { AngleUnit(b, c), AngleUnit(a, c), AngleUnit(a, b) };
+    decimal innerTolerances[3];
+    NonDimensionalInnerTolerances(sides, tolerance, innerTolerances);
+    decimal angles[3], catalogAngles[3];
+    TriangleInnerAngles(a, b, c, angles);
+    TriangleInnerAngles(catalogA, catalogB, catalogC, catalogAngles);
+    for (int corner = 0; corner < 3; corner++) {
+        if (DECIMAL_ABS(angles[corner] - catalogAngles[corner]) > innerTolerances[corner]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Find every way the corners of an image triangle could correspond to a catalog triangle, judging
+ * by the inner angles and handedness of the triangles, and only roughly by their size.
+ * @param spatials The corners of the image triangle
+ * @param tolerance How far each centroid may be from where it should be, in radians
+ * @param focalLengthTolerance How far the true focal length may be from the camera's, relative to it.
+ * @param matches[out] For each possible correspondence, the catalog index of each image corner.
+ * @return false if the triangle is unsuitable for querying, eg because it is too small.
+ */
+static bool NonDimensionalTriangleMatches(const TripleInnerKVectorDatabase &db,
+                                          const Catalog &catalog,
+                                          const Vec3 *spatials,
+                                          decimal tolerance,
+                                          decimal focalLengthTolerance,
+                                          std::vector<std::array<int16_t, 3>> *matches,
+                                          StarIdStats *stats) {
+    decimal sides[3]; // sides[c] is opposite corner c
+    for (int c = 0; c < 3; c++) {
+        sides[c] = AngleUnit(spatials[(c+1)%3], spatials[(c+2)%3]);
+        // same reasoning as in Pyramid; we don't know the true scale of the image, but this is
+        // still right to first order.
+        if (sides[c] < db.MinDistance() + tolerance || sides[c] > db.MaxDistance() - tolerance) {
+            return false;
+        }
+    }
+
+    decimal angles[3];
+    TriangleInnerAngles(spatials[0], spatials[1], spatials[2], angles);
+    decimal innerTolerances[3];
+    NonDimensionalInnerTolerances(sides, tolerance, innerTolerances);
+    decimal maxInnerTolerance = std::max(std::max(innerTolerances[0], innerTolerances[1]), innerTolerances[2]);
+    if (maxInnerTolerance > kNonDimensionalMaxInnerTolerance) {
+        return false;
+    }
+
+    // sign of determinant, to detect flipped patterns
+    bool spectralTorch = spatials[0].CrossProduct(spatials[1])*spatials[2] > 0;
+
+    // Shape alone matches similar triangles of any size, which makes spurious matches (especially
+    // with false stars) far too likely. Distances in the image scale with the focal length, so the
+    // longest side of the catalog triangle can't be too far off from the image's.
+    decimal longestSide = std::max(std::max(sides[0], sides[1]), sides[2]);
+    decimal minLongestCos = DECIMAL_COS(longestSide*(1+focalLengthTolerance) + tolerance);
+    decimal maxLongestCos = DECIMAL_COS(std::max(DECIMAL(0.0), longestSide*(1-focalLengthTolerance) - tolerance));
+
+    // The smallest angle of the catalog triangle is within maxInnerTolerance of the smallest image
+    // angle, even if the two are at different corners because the triangle is nearly isosceles.
+    decimal smallestAngle = std::min(std::min(angles[0], angles[1]), angles[2]);
+    const int16_t *end;
+    const int16_t *query = db.FindTriplesLiberal(smallestAngle - maxInnerTolerance, smallestAngle + maxInnerTolerance, &end);
+    stats->patternsTried++;
+    stats->databaseQueries++;
+    stats->candidatesExamined += (end - query) / 3;
+    for (const int16_t *triple = query; triple != end; triple += 3) {
+        const Vec3 &spatial0 = catalog[triple[0]].spatial;
+        const Vec3 &spatial1 = catalog[triple[1]].spatial;
+        const Vec3 &spatial2 = catalog[triple[2]].spatial;
+        // smallest cosine is the longest side
+        decimal longestCos = std::min(std::min(spatial0*spatial1, spatial0*spatial2), spatial1*spatial2);
+        if (longestCos < minLongestCos || longestCos > maxLongestCos) {
+            continue;
+        }
+
+        decimal catalogAngles[3];
+        TriangleInnerAngles(spatial0, spatial1, spatial2, catalogAngles);
+
+        // triple[permutation[c]] is the catalog star at image corner c
+        int permutation[3] = { 0, 1, 2 };
+        do {
+            bool anglesMatch = true;
+            for (int c = 0; c < 3; c++) {
+                if (DECIMAL_ABS(angles[c] - catalogAngles[permutation[c]]) > innerTolerances[c]) {
+                    anglesMatch = false;
+                    break;
                 }
             }
+            if (!anglesMatch) {
+                continue;
+            }
+            const Vec3 &candidate0 = catalog[triple[permutation[0]]].spatial;
+            const Vec3 &candidate1 = catalog[triple[permutation[1]]].spatial;
+            const Vec3 &candidate2 = catalog[triple[permutation[2]]].spatial;
+            if ((candidate0.CrossProduct(candidate1)*candidate2 > 0) != spectralTorch) {
+                continue;
+            }
+            matches->push_back({{ triple[permutation[0]], triple[permutation[1]], triple[permutation[2]] }});
+        } while (std::next_permutation(permutation, permutation+3));
+    }
+    return true;
+}
+
+/**
+ * Fit the ratio between centroid and catalog distances (the true focal length divided by the
+ * camera's) of some identified stars.
+ * @return false if no single ratio explains all the distances to within tolerance.
+ */
+static bool NonDimensionalScale(const StarIdentifiers &identifiers, const std::vector<Vec3> &spatials,
+                                const Catalog &catalog, decimal tolerance, decimal *scale) {
+    std::vector<std::pair<decimal, decimal>> distances; // (centroid, catalog)
+    decimal numerator = 0, denominator = 0;
+    for (int a = 0; a < (int)identifiers.size(); a++) {
+        for (int b = a+1; b < (int)identifiers.size(); b++) {
+            decimal distance = AngleUnit(spatials[identifiers[a].starIndex], spatials[identifiers[b].starIndex]);
+            decimal catalogDistance = AngleUnit(catalog[identifiers[a].catalogIndex].spatial,
+                                                catalog[identifiers[b].catalogIndex].spatial);
+            distances.push_back(std::make_pair(distance, catalogDistance));
+            numerator += distance*catalogDistance;
+            denominator += catalogDistance*catalogDistance;
         }
     }
+    // least squares
+    *scale = numerator/denominator;
+    for (const std::pair<decimal, decimal> &distance : distances) {
+        if (DECIMAL_ABS(distance.first - *scale*distance.second) > 2*tolerance) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    std::cerr << "Tried all pyramids; none matched." << std::endl;
+/**
+ * How many other centroids must line up with catalog stars before Non-Dimensional accepts a pattern.
+ * A correct pattern lines up almost every true star in the image, while in a crowded image a few
+ * centroids can line up by chance, so both an absolute and a relative minimum are needed.
+ */
+const int kNonDimensionalMinVerified = 2;
+/// @copydoc kNonDimensionalMinVerified
+const decimal kNonDimensionalMinVerifiedFraction = DECIMAL(0.25);
+
+/**
+ * Finds the catalog stars at about some distance from a catalog star, using whichever database the
+ * multi-database has for it: the neighbor adjacency database, the pair distance kvector, or the
+ * compact pair distance database, in that order.
+ */
+class CatalogPartnerFinder {
+public:
+    explicit CatalogPartnerFinder(const MultiDatabase &multiDatabase) : neighbors(FindNeighborAdjacency(multiDatabase)) {
+        const unsigned char *pairDistanceBuffer = multiDatabase.SubDatabasePointer(PairDistanceKVectorDatabase::kMagicValue);
+        const unsigned char *compactBuffer = multiDatabase.SubDatabasePointer(CompactPairDistanceDatabase::kMagicValue);
+        if (pairDistanceBuffer != NULL) {
+            DeserializeContext des(pairDistanceBuffer);
+            pairDistance.reset(new PairDistanceKVectorDatabase(&des));
+        }
+        if (compactBuffer != NULL) {
+            DeserializeContext des(compactBuffer);
+            compact.reset(new CompactPairDistanceDatabase(&des));
+        }
+    };
+
+    /**
+     * Set `partners` to the catalog stars between `min` and `max` from `catalogIndex`, and perhaps a
+     * few more. Returns false if no database stores all pairs in that range.
+     */
+    bool Find(const Catalog &catalog, int16_t catalogIndex, decimal min, decimal max,
+              std::vector<int16_t> *partners) const {
+        partners->clear();
+        if (neighbors && max <= neighbors->MaxDistance()) {
+            const int16_t *end;
+            const int16_t *first = neighbors->FindNeighbors(catalogIndex, min, max, &end);
+            partners->assign(first, end);
+            return true;
+        }
+        if (pairDistance && min >= pairDistance->MinDistance() && max <= pairDistance->MaxDistance()) {
+            const int16_t *end;
+            const int16_t *pairs = pairDistance->FindPairsExact(catalog, min, max, &end);
+            for (PairDistanceInvolvingIterator partner(pairs, end, catalogIndex); partner.HasValue(); ++partner) {
+                partners->push_back(*partner);
+            }
+            return true;
+        }
+        if (compact && min >= compact->MinDistance() && max <= compact->MaxDistance()) {
+            compact->FindPartnersLiberal(catalogIndex, min, max, partners);
+            return true;
+        }
+        return false;
+    };
+
+private:
+    std::unique_ptr<NeighborAdjacencyDatabase> neighbors;
+    std::unique_ptr<PairDistanceKVectorDatabase> pairDistance;
+    std::unique_ptr<CompactPairDistanceDatabase> compact;
+};
+
+/**
+ * Count how many of the unidentified centroids are at the right distances from the identified
+ * stars to be some catalog star.
+ * Candidates for each centroid are the catalog stars at the right distance from the nearest
+ * identified star, looked up in `partnerFinder`. Only if it can't look up that distance from any of
+ * the identified stars is every catalog star tried.
+ * @param scale The ratio between centroid and catalog distances, as from NonDimensionalScale
+ */
+static int NonDimensionalVerify(const StarIdentifiers &identifiers, const std::vector<Vec3> &spatials,
+                                const Catalog &catalog, const CatalogPartnerFinder &partnerFinder,
+                                decimal scale, decimal tolerance) {
+    int numVerified = 0;
+    std::vector<int16_t> candidates;
+    for (int centroid = 0; centroid < (int)spatials.size(); centroid++) {
+        bool identified = false;
+        for (const StarIdentifier &identifier : identifiers) {
+            identified = identified || identifier.starIndex == centroid;
+        }
+        if (identified) {
+            continue;
+        }
+
+        std::vector<decimal> distances;
+        std::vector<AngleWindow> windows;
+        std::vector<int> byDistance;
+        for (const StarIdentifier &identifier : identifiers) {
+            byDistance.push_back(distances.size());
+            distances.push_back(AngleUnit(spatials[centroid], spatials[identifier.starIndex]) / scale);
+            windows.push_back(AngleWindow(distances.back(), 2*tolerance));
+        }
+        std::sort(byDistance.begin(), byDistance.end(), [&distances](int a, int b) {
+            return distances[a] < distances[b];
+        });
+
+        bool found = false;
+        for (int i : byDistance) {
+            if (partnerFinder.Find(catalog, identifiers[i].catalogIndex,
+                                   distances[i] - 2*tolerance, distances[i] + 2*tolerance, &candidates)) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            candidates.resize(catalog.size());
+            std::iota(candidates.begin(), candidates.end(), 0);
+        }
+
+        for (int16_t candidate : candidates) {
+            const Vec3 &candidateSpatial = catalog[candidate].spatial;
+            bool matches = true;
+            for (int i = 0; i < (int)identifiers.size() && matches; i++) {
+                matches = windows[i].Contains(candidateSpatial * catalog[identifiers[i].catalogIndex].spatial);
+            }
+            if (matches) {
+                numVerified++;
+                break;
+            }
+        }
+    }
+    return numVerified;
+}
+
+StarIdentifiers NonDimensionalStarIdAlgorithm::Go(
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    StarIdStats *stats) const {
+
+    StarIdStats unusedStats;
+    if (stats == NULL) {
+        stats = &unusedStats;
+    }
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    StarIdDeadline deadline(startTime, deadlineUs);
+
+    StarIdentifiers identified;
+    MultiDatabase multiDatabase(database);
+    const unsigned char *databaseBuffer = multiDatabase.SubDatabasePointer(TripleInnerKVectorDatabase::kMagicValue);
+    if (databaseBuffer == NULL || stars.size() < 4) {
+        std::cerr << "Not enough stars, or database missing." << std::endl;
+        return identified;
+    }
+    DeserializeContext des(databaseBuffer);
+    TripleInnerKVectorDatabase tripleDatabase(&des);
+    CatalogPartnerFinder partnerFinder(multiDatabase);
+
+    int numStars = (int)stars.size();
+    std::vector<Vec3> spatials;
+    for (const Star &star : stars) {
+        spatials.push_back(camera.CameraToSpatial(star.position).Normalize());
+    }
+    // bright centroids are the least likely to be false stars
+    std::vector<int> byBrightness(numStars);
+    std::iota(byBrightness.begin(), byBrightness.end(), 0);
+    std::stable_sort(byBrightness.begin(), byBrightness.end(), [&stars](int a, int b) {
+        return stars[a].magnitude > stars[b].magnitude;
+    });
+
+    int minVerified = std::max(kNonDimensionalMinVerified,
+                               (int)((numStars - 5) * kNonDimensionalMinVerifiedFraction));
+
+    // Since the scale of the image is only loosely known, even a 4-star pattern is fairly likely to
+    // match by chance, especially when it contains a false star. So we look for 5-star patterns:
+    // Three triangles which share their first two stars i and j and agree on which catalog stars
+    // those are, such that the triangles between their third stars and i or j match too. Triangles
+    // are queried once per shared pair, rather than once per pattern.
+    long totalIterations = 0;
+    for (int j = 1; j < numStars; j++) {
+        for (int i = 0; i < j; i++) {
+            int iStar = byBrightness[i], jStar = byBrightness[j];
+            // For each pair of catalog stars that i and j might be, the (centroid, catalog) indices
+            // of the third stars of the triangles that agreed so far.
+            std::map<std::pair<int16_t, int16_t>, std::vector<std::pair<int, int16_t>>> thirdStars;
+
+            for (int r = 0; r < numStars; r++) {
+                int rStar = byBrightness[r];
+                if (r == i || r == j) {
+                    continue;
+                }
+                // identification failure due to cutoff
+                if (++totalIterations > cutoff) {
+                    std::cerr << "Cutoff reached." << std::endl;
+                    return identified;
+                }
+                if (deadline.Passed()) {
+                    stats->timedOut = true;
+                    return identified;
+                }
+
+                Vec3 ijrSpatials[3] = { spatials[iStar], spatials[jStar], spatials[rStar] };
+                std::vector<std::array<int16_t, 3>> ijrMatches;
+                if (!NonDimensionalTriangleMatches(tripleDatabase, catalog, ijrSpatials,
+                                                   tolerance, focalLengthTolerance, &ijrMatches, stats)) {
+                    continue;
+                }
+
+                // whether the triangles formed by i and j with two third stars are consistent
+                auto agrees = [&](int aStar, int16_t aCatalog, int bStar, int16_t bCatalog, int16_t iCatalog, int16_t jCatalog) {
+                    return aStar != bStar && aCatalog != bCatalog
+                        && NonDimensionalTriangleAgrees(spatials[iStar], spatials[aStar], spatials[bStar],
+                                                        catalog[iCatalog].spatial, catalog[aCatalog].spatial, catalog[bCatalog].spatial,
+                                                        tolerance)
+                        && NonDimensionalTriangleAgrees(spatials[jStar], spatials[aStar], spatials[bStar],
+                                                        catalog[jCatalog].spatial, catalog[aCatalog].spatial, catalog[bCatalog].spatial,
+                                                        tolerance);
+                };
+
+                int numMatches = 0;
+                StarIdentifiers match;
+                decimal scale = 1;
+                for (const std::array<int16_t, 3> &ijrMatch : ijrMatches) {
+                    std::vector<std::pair<int, int16_t>> &seen = thirdStars[std::make_pair(ijrMatch[0], ijrMatch[1])];
+                    std::vector<int> agreeing;
+                    for (int a = 0; a < (int)seen.size(); a++) {
+                        if (agrees(seen[a].first, seen[a].second, rStar, ijrMatch[2], ijrMatch[0], ijrMatch[1])) {
+                            agreeing.push_back(a);
+                        }
+                    }
+                    bool found = false;
+                    for (int a = 0; a < (int)agreeing.size() && !found; a++) {
+                        for (int b = a+1; b < (int)agreeing.size() && !found; b++) {
+                            const std::pair<int, int16_t> &aThird = seen[agreeing[a]];
+                            const std::pair<int, int16_t> &bThird = seen[agreeing[b]];
+                            if (!agrees(aThird.first, aThird.second, bThird.first, bThird.second, ijrMatch[0], ijrMatch[1])) {
+                                continue;
+                            }
+                            StarIdentifiers candidate = {
+                                StarIdentifier(iStar, ijrMatch[0]),
+                                StarIdentifier(jStar, ijrMatch[1]),
+                                StarIdentifier(aThird.first, aThird.second),
+                                StarIdentifier(bThird.first, bThird.second),
+                                StarIdentifier(rStar, ijrMatch[2]),
+                            };
+                            // The inner angle tolerances are loose enough that a similar pattern
+                            // at a slightly different scale could match, but then the distances
+                            // would not all scale by the same amount. Even so, with so many
+                            // patterns in the catalog, a chance match is still plausible, so check
+                            // that the pattern explains other centroids too.
+                            decimal candidateScale;
+                            if (NonDimensionalScale(candidate, spatials, catalog, tolerance, &candidateScale)
+                                && NonDimensionalVerify(candidate, spatials, catalog, partnerFinder,
+                                                        candidateScale, tolerance) >= minVerified) {
+                                found = true;
+                                numMatches++;
+                                match = candidate;
+                                scale = candidateScale;
+                            }
+                        }
+                    }
+                    seen.push_back(std::make_pair(rStar, ijrMatch[2]));
+                }
+
+                if (numMatches != 1) {
+                    continue;
+                }
+
+                stats->firstMatchTimeNs = NanosecondsSince(startTime);
+                identified = match;
+                // The pair-distance method is sensitive to the focal length, so use the one the
+                // identified stars imply; distances in the image scale inversely with it.
+                Camera correctedCamera(camera);
+                correctedCamera.SetFocalLength(camera.FocalLength() * scale);
+                IdentifyRemainingStarsFromDatabase(&identified, stars, multiDatabase, catalog, correctedCamera, tolerance);
+
+                return identified;
+            }
+        }
+    }
+
+    std::cerr << "Tried all triangles; none matched." << std::endl;
+    return identified;
+}
+
+
+/// Fewest mutually consistent matches Tracking needs to succeed without falling back.
+const int kTrackingMinStars = 3;
+
+void TrackingStarIdAlgorithm::SetCatalogView(const CatalogView *catalogView) {
+    if (fallback != nullptr) {
+        fallback->SetCatalogView(catalogView);
+    }
+}
+
+StarIdentifiers TrackingStarIdAlgorithm::Fallback(
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    StarIdStats *stats) const {
+
+    if (fallback == nullptr) {
+        return StarIdentifiers();
+    }
+    return fallback->Go(database, stars, catalog, camera, stats);
+}
+
+StarIdentifiers TrackingStarIdAlgorithm::Go(
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    StarIdStats *stats) const {
+
+    StarIdStats unusedStats;
+    if (stats == NULL) {
+        stats = &unusedStats;
+    }
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    MultiDatabase multiDatabase(database);
+    const unsigned char *databaseBuffer = multiDatabase.SubDatabasePointer(SkyIndexDatabase::kMagicValue);
+    if (databaseBuffer == NULL || stars.size() < kTrackingMinStars) {
+        std::cerr << "Not enough stars, or database missing." << std::endl;
+        return Fallback(database, stars, catalog, camera, stats);
+    }
+    // nothing to track from yet, eg on the first frame
+    if (!prior.IsKnown()) {
+        return Fallback(database, stars, catalog, camera, stats);
+    }
+    DeserializeContext des(databaseBuffer);
+    SkyIndexDatabase skyIndex(&des);
+
+    // How far the camera may have turned since the prior
+    decimal uncertainty = maxAngularRate * frameInterval;
+    StarIdentifiers candidates = ProjectionMatches(stars, std::vector<bool>(stars.size(), false),
+                                                   skyIndex, catalog, camera, prior, uncertainty + tolerance);
+    stats->patternsTried++;
+    stats->databaseQueries++;
+    stats->candidatesExamined += candidates.size();
+
+    // A rotation preserves the distances between stars, so a match is only kept if its distances to
+    // at least half the other matches agree with the catalog.
+    std::vector<Vec3> spatials;
+    for (const StarIdentifier &candidate : candidates) {
+        spatials.push_back(camera.CameraToSpatial(stars[candidate.starIndex].position).Normalize());
+    }
+    // agreement is symmetric, so check each pair once
+    AngleTolerance verifyTolerance(2*tolerance);
+    std::vector<int> numAgree(candidates.size(), 0);
+    for (int i = 0; i < (int)candidates.size(); i++) {
+        for (int j = i+1; j < (int)candidates.size(); j++) {
+            AngleWindow window(spatials[i], spatials[j], verifyTolerance);
+            if (window.Contains(catalog[candidates[i].catalogIndex].spatial
+                                * catalog[candidates[j].catalogIndex].spatial)) {
+                numAgree[i]++;
+                numAgree[j]++;
+            }
+        }
+    }
+    StarIdentifiers identified;
+    for (int i = 0; i < (int)candidates.size(); i++) {
+        if (2*numAgree[i] >= (int)candidates.size() - 1) {
+            identified.push_back(candidates[i]);
+        }
+    }
+
+    if (identified.size() < kTrackingMinStars) {
+        return Fallback(database, stars, catalog, camera, stats);
+    }
+    stats->firstMatchTimeNs = NanosecondsSince(startTime);
+    return identified;
+}
+
+/// Fewest verified associations Incremental needs to succeed without falling back.
+const int kIncrementalMinStars = 4;
+/// How many other associations each association's distances are checked against
+const int kIncrementalNumChecks = 3;
+
+void IncrementalStarIdAlgorithm::Reset() {
+    lastStars.clear();
+    lastIdentifiers.clear();
+    lastMotions.clear();
+}
+
+void IncrementalStarIdAlgorithm::SetPriorIdentification(const Stars &stars, const StarIdentifiers &identifiers) {
+    // nothing to predict the next frame's motion from
+    lastStars = stars;
+    lastIdentifiers = identifiers;
+    lastMotions.assign(identifiers.size(), Vec2{0, 0});
+}
+
+void IncrementalStarIdAlgorithm::SetCatalogView(const CatalogView *catalogView) {
+    if (fallback != nullptr) {
+        fallback->SetCatalogView(catalogView);
+    }
+}
+
+StarIdentifiers IncrementalStarIdAlgorithm::Fallback(
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    StarIdStats *stats) const {
+
+    StarIdentifiers result;
+    if (fallback != nullptr) {
+        result = fallback->Go(database, stars, catalog, camera, stats);
+    }
+    // nothing to predict the next frame's motion from
+    lastStars = stars;
+    lastIdentifiers = result;
+    lastMotions.assign(result.size(), Vec2{0, 0});
+    return result;
+}
+
+StarIdentifiers IncrementalStarIdAlgorithm::Go(
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    StarIdStats *stats) const {
+
+    StarIdStats unusedStats;
+    if (stats == NULL) {
+        stats = &unusedStats;
+    }
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    if ((int)lastIdentifiers.size() < kIncrementalMinStars || (int)stars.size() < kIncrementalMinStars) {
+        return Fallback(database, stars, catalog, camera, stats);
+    }
+
+    // Bucket the new centroids into a grid over the sensor (plus a margin of one cell), with cells at
+    // least maxPixelMotion across, so each predicted position only has to look at the 3x3 cells around it.
+    decimal cellSize = std::max(maxPixelMotion, (decimal)std::max(camera.XResolution(), camera.YResolution()) / kIRMaxGridSide);
+    int gridWidth = (int)DECIMAL_CEIL(camera.XResolution() / cellSize) + 2;
+    int gridHeight = (int)DECIMAL_CEIL(camera.YResolution() / cellSize) + 2;
+    std::vector<std::vector<int>> grid(gridWidth * gridHeight);
+    for (int i = 0; i < (int)stars.size(); i++) {
+        int gridX = std::max(0, std::min(gridWidth-1, (int)DECIMAL_FLOOR(stars[i].position.x / cellSize) + 1));
+        int gridY = std::max(0, std::min(gridHeight-1, (int)DECIMAL_FLOOR(stars[i].position.y / cellSize) + 1));
+        grid[gridY*gridWidth + gridX].push_back(i);
+    }
+
+    // Associate each star identified last frame with the only centroid near where it should be now.
+    StarIdentifiers candidates;
+    std::vector<Vec2> candidateMotions;
+    std::vector<int> timesAssociated(stars.size(), 0);
+    for (int last = 0; last < (int)lastIdentifiers.size(); last++) {
+        const Vec2 &lastPosition = lastStars[lastIdentifiers[last].starIndex].position;
+        Vec2 predicted = lastPosition + lastMotions[last];
+        int gridX = (int)DECIMAL_FLOOR(predicted.x / cellSize) + 1;
+        int gridY = (int)DECIMAL_FLOOR(predicted.y / cellSize) + 1;
+        int numInRange = 0;
+        int match = -1;
+        for (int y = std::max(0, gridY-1); y <= std::min(gridHeight-1, gridY+1); y++) {
+            for (int x = std::max(0, gridX-1); x <= std::min(gridWidth-1, gridX+1); x++) {
+                for (int i : grid[y*gridWidth + x]) {
+                    if ((stars[i].position - predicted).Magnitude() <= maxPixelMotion) {
+                        numInRange++;
+                        match = i;
+                    }
+                }
+            }
+        }
+        if (numInRange == 1) {
+            candidates.push_back(StarIdentifier(match, lastIdentifiers[last].catalogIndex));
+            candidateMotions.push_back(stars[match].position - lastPosition);
+            timesAssociated[match]++;
+        }
+    }
+    stats->candidatesExamined += candidates.size();
+
+    // Check each association's distances to the next few associations against the catalog, and keep it
+    // if most of them agree.
+    std::vector<Vec3> spatials;
+    for (const StarIdentifier &candidate : candidates) {
+        spatials.push_back(camera.CameraToSpatial(stars[candidate.starIndex].position).Normalize());
+    }
+    int numChecks = std::min(kIncrementalNumChecks, (int)candidates.size() - 1);
+    AngleTolerance verifyTolerance(2*tolerance);
+    StarIdentifiers identified;
+    std::vector<Vec2> motions;
+    for (int i = 0; i < (int)candidates.size(); i++) {
+        if (timesAssociated[candidates[i].starIndex] != 1) {
+            continue;
+        }
+        int numAgree = 0;
+        for (int check = 1; check <= numChecks; check++) {
+            int j = (i + check) % candidates.size();
+            AngleWindow window(spatials[i], spatials[j], verifyTolerance);
+            if (window.Contains(catalog[candidates[i].catalogIndex].spatial
+                                * catalog[candidates[j].catalogIndex].spatial)) {
+                numAgree++;
+            }
+        }
+        if (2*numAgree > numChecks) {
+            identified.push_back(candidates[i]);
+            motions.push_back(candidateMotions[i]);
+        }
+    }
+
+    if ((int)identified.size() < kIncrementalMinStars) {
+        return Fallback(database, stars, catalog, camera, stats);
+    }
+    stats->firstMatchTimeNs = NanosecondsSince(startTime);
+
+    // Stars that just came into view, or weren't identified last frame
+    MultiDatabase multiDatabase(database);
+    int numAssociated = identified.size();
+    IdentifyRemainingStarsFromDatabase(&identified, stars, multiDatabase, catalog, camera, tolerance);
+
+    // newly identified stars haven't been seen moving yet, so assume they move like the rest
+    Vec2 meanMotion = {0, 0};
+    for (const Vec2 &motion : motions) {
+        meanMotion = meanMotion + motion;
+    }
+    meanMotion = meanMotion * (DECIMAL(1.0) / numAssociated);
+    motions.resize(identified.size(), meanMotion);
+
+    lastStars = stars;
+    lastIdentifiers = identified;
+    lastMotions = motions;
+    return identified;
+}
+
+CascadeStarIdAlgorithm::CascadeStarIdAlgorithm(const std::vector<StarIdAlgorithm *> &stages, long minIdentified)
+    : minIdentified(minIdentified) {
+
+    for (StarIdAlgorithm *stage : stages) {
+        this->stages.push_back(std::unique_ptr<StarIdAlgorithm>(stage));
+    }
+}
+
+void CascadeStarIdAlgorithm::SetPriorAttitude(const Attitude &attitude) {
+    for (const std::unique_ptr<StarIdAlgorithm> &stage : stages) {
+        stage->SetPriorAttitude(attitude);
+    }
+}
+
+void CascadeStarIdAlgorithm::SetPriorIdentification(const Stars &stars, const StarIdentifiers &identifiers) {
+    for (const std::unique_ptr<StarIdAlgorithm> &stage : stages) {
+        stage->SetPriorIdentification(stars, identifiers);
+    }
+}
+
+void CascadeStarIdAlgorithm::SetCatalogView(const CatalogView *catalogView) {
+    for (const std::unique_ptr<StarIdAlgorithm> &stage : stages) {
+        stage->SetCatalogView(catalogView);
+    }
+}
+
+StarIdentifiers CascadeStarIdAlgorithm::Go(
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    StarIdStats *stats) const {
+
+    StarIdStats unusedStats;
+    if (stats == NULL) {
+        stats = &unusedStats;
+    }
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    // only checked between stages, so each stage should have a deadline of its own too
+    StarIdDeadline deadline(startTime, deadlineUs, 1);
+
+    StarIdentifiers best;
+    bool anyTimedOut = false;
+    for (int i = 0; i < (int)stages.size(); i++) {
+        if (deadline.Passed()) {
+            anyTimedOut = true;
+            break;
+        }
+        long long stageStartNs = NanosecondsSince(startTime);
+        StarIdStats stageStats;
+        StarIdentifiers identified = stages[i]->Go(database, stars, catalog, camera, &stageStats);
+
+        stats->patternsTried += stageStats.patternsTried;
+        stats->databaseQueries += stageStats.databaseQueries;
+        stats->candidatesExamined += stageStats.candidatesExamined;
+        if (stats->firstMatchTimeNs < 0 && stageStats.firstMatchTimeNs >= 0) {
+            stats->firstMatchTimeNs = stageStartNs + stageStats.firstMatchTimeNs;
+        }
+        anyTimedOut = anyTimedOut || stageStats.timedOut;
+
+        if ((long)identified.size() >= minIdentified) {
+            stats->cascadeStage = i;
+            // the stages that didn't succeed would otherwise remember their own failure
+            for (int j = 0; j < (int)stages.size(); j++) {
+                if (j != i) {
+                    stages[j]->SetPriorIdentification(stars, identified);
+                }
+            }
+            return identified;
+        }
+        if (identified.size() > best.size()) {
+            best = identified;
+        }
+    }
+    stats->timedOut = anyTimedOut;
+    return best;
+}
+
+/// Number of brightest centroids whose distances make up the signature of a star field
+const int kCacheSignatureStars = 4;
+/// Width of the bins signature distances are quantized into, in tolerances
+const int kCacheBinTolerances = 8;
+
+/**
+ * Hash of the distances between the signature stars, each quantized into bins of the given width.
+ * The distances are sorted first, so the hash doesn't depend on the order of the stars.
+ */
+static uint64_t CacheSignature(const std::vector<Vec3> &spatials, decimal binWidth) {
+    std::vector<long> bins;
+    for (int i = 0; i < (int)spatials.size(); i++) {
+        for (int j = i+1; j < (int)spatials.size(); j++) {
+            bins.push_back((long)DECIMAL_FLOOR(AngleUnit(spatials[i], spatials[j]) / binWidth));
+        }
+    }
+    std::sort(bins.begin(), bins.end());
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (long bin : bins) {
+        for (int byte = 0; byte < (int)sizeof(bin); byte++) {
+            hash ^= (uint64_t)((bin >> (8*byte)) & 0xFF);
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Find an order of the remembered catalog stars whose distances all agree with the distances between
+ * the signature stars. Sorting the distances in the signature threw away which star is which, but
+ * with only a few stars it's cheap to try every order.
+ * @return Whether any order agrees. If so, catalogIndices is left in that order.
+ */
+static bool CacheVerify(const std::vector<Vec3> &spatials, const Catalog &catalog,
+                        std::vector<int16_t> *catalogIndices, decimal tolerance) {
+    // the windows only depend on the signature stars, not the order being tried
+    AngleTolerance verifyTolerance(tolerance);
+    std::vector<AngleWindow> windows; // one for each i < j, in order
+    for (int i = 0; i < (int)spatials.size(); i++) {
+        for (int j = i+1; j < (int)spatials.size(); j++) {
+            windows.push_back(AngleWindow(spatials[i], spatials[j], verifyTolerance));
+        }
+    }
+    std::vector<int> order(catalogIndices->size());
+    std::iota(order.begin(), order.end(), 0);
+    do {
+        bool agrees = true;
+        int window = 0;
+        for (int i = 0; i < (int)spatials.size() && agrees; i++) {
+            for (int j = i+1; j < (int)spatials.size() && agrees; j++) {
+                agrees = windows[window++].Contains(catalog[(*catalogIndices)[order[i]]].spatial
+                                                    * catalog[(*catalogIndices)[order[j]]].spatial);
+            }
+        }
+        if (agrees) {
+            std::vector<int16_t> ordered;
+            for (int i : order) {
+                ordered.push_back((*catalogIndices)[i]);
+            }
+            *catalogIndices = ordered;
+            return true;
+        }
+    } while (std::next_permutation(order.begin(), order.end()));
+    return false;
+}
+
+StarIdentifiers CachedStarIdAlgorithm::Go(
+    const unsigned char *database, const Stars &stars, const Catalog &catalog, const Camera &camera,
+    StarIdStats *stats) const {
+
+    StarIdStats unusedStats;
+    if (stats == NULL) {
+        stats = &unusedStats;
+    }
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    if ((int)stars.size() < kCacheSignatureStars || maxEntries <= 0) {
+        return algorithm->Go(database, stars, catalog, camera, stats);
+    }
+
+    // the brightest centroids are the most likely to be seen again
+    std::vector<int> signatureStars(stars.size());
+    std::iota(signatureStars.begin(), signatureStars.end(), 0);
+    std::partial_sort(signatureStars.begin(), signatureStars.begin() + kCacheSignatureStars, signatureStars.end(),
+                      [&stars](int a, int b) { return stars[a].magnitude > stars[b].magnitude; });
+    signatureStars.resize(kCacheSignatureStars);
+    std::vector<Vec3> spatials;
+    for (int star : signatureStars) {
+        spatials.push_back(camera.CameraToSpatial(stars[star].position).Normalize());
+    }
+    uint64_t signature = CacheSignature(spatials, kCacheBinTolerances*tolerance);
+
+    auto found = entriesBySignature.find(signature);
+    if (found != entriesBySignature.end()) {
+        stats->patternsTried++;
+        stats->candidatesExamined++;
+        std::vector<int16_t> catalogIndices = found->second->catalogIndices;
+        if (CacheVerify(spatials, catalog, &catalogIndices, tolerance)) {
+            entries.splice(entries.begin(), entries, found->second);
+            stats->firstMatchTimeNs = NanosecondsSince(startTime);
+            stats->cacheHit = true;
+
+            StarIdentifiers identified;
+            for (int i = 0; i < kCacheSignatureStars; i++) {
+                identified.push_back(StarIdentifier(signatureStars[i], catalogIndices[i]));
+            }
+            MultiDatabase multiDatabase(database);
+            IdentifyRemainingStarsFromDatabase(&identified, stars, multiDatabase, catalog, camera, tolerance);
+            return identified;
+        }
+    }
+
+    StarIdentifiers identified = algorithm->Go(database, stars, catalog, camera, stats);
+
+    // only remember fields where every signature star was identified
+    Entry entry{signature, std::vector<int16_t>(kCacheSignatureStars, -1)};
+    for (const StarIdentifier &identifier : identified) {
+        for (int i = 0; i < kCacheSignatureStars; i++) {
+            if (identifier.starIndex == signatureStars[i]) {
+                entry.catalogIndices[i] = identifier.catalogIndex;
+            }
+        }
+    }
+    if (std::find(entry.catalogIndices.begin(), entry.catalogIndices.end(), -1) != entry.catalogIndices.end()) {
+        return identified;
+    }
+    if (found != entriesBySignature.end()) {
+        // the remembered stars didn't check out, so replace them
+        entries.erase(found->second);
+    }
+    entries.push_front(entry);
+    entriesBySignature[signature] = entries.begin();
+    if ((long)entries.size() > maxEntries) {
+        entriesBySignature.erase(entries.back().signature);
+        entries.pop_back();
+    }
     return identified;
 }
 
@@ -2,30 +2,92 @@
 #define STAR_ID_H
 
 #include <vector>
+#include <memory>
+#include <list>
+#include <unordered_map>
 
 #include "centroiders.hpp"
 #include "star-utils.hpp"
 #include "camera.hpp"
+#include "attitude-utils.hpp"
 
 namespace lost {
 
+class MultiDatabase;
+
+/**
+ * Counters describing how much work a star-id algorithm did on one image, for benchmarking.
+ * They cover the search for the first pattern match, not the identification of the remaining stars
+ * afterwards. Not every algorithm fills in every counter.
+ */
+struct StarIdStats {
+    /// Number of patterns (pyramids, triangles, etc) looked up in the database
+    long patternsTried = 0;
+    /// Number of range queries or lookups into the database
+    long databaseQueries = 0;
+    /// Number of catalog candidates returned by those queries and examined
+    long candidatesExamined = 0;
+    /// Nanoseconds from the start of identification until the first pattern matched. Negative if none did.
+    long long firstMatchTimeNs = -1;
+    /// Whether the algorithm gave up because its deadline passed
+    bool timedOut = false;
+    /// Index of the stage of a CascadeStarIdAlgorithm which identified the stars. -1 if none did, or if not a cascade.
+    int cascadeStage = -1;
+    /// Whether a CachedStarIdAlgorithm recognized the star field, instead of running its algorithm
+    bool cacheHit = false;
+};
+
 /**
  * A star idenification algorithm.
  * An algorithm which takes a list of centroids plus some (possibly algorithm-specific) database, and then determines which centroids corresponds to which catalog stars.
  */
 class StarIdAlgorithm {
 public:
-    /// Actualy perform the star idenification. This is the "main" function for StarIdAlgorithm
+    /**
+     * Actualy perform the star idenification. This is the "main" function for StarIdAlgorithm
+     * @param stats If not null, filled in with counters describing the work done.
+     */
     virtual StarIdentifiers Go(
-        const unsigned char *database, const Stars &, const Catalog &, const Camera &) const = 0;
+        const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+        StarIdStats *stats = NULL) const = 0;
 
     virtual ~StarIdAlgorithm() { };
+
+    /**
+     * Give up searching for a match once this many microseconds have passed since Go was called.
+     * Zero or negative means no deadline. Iteration cutoffs still apply either way.
+     */
+    void SetDeadline(long deadlineUs) { this->deadlineUs = deadlineUs; };
+
+    /**
+     * Tell algorithms which track the attitude from frame to frame what the attitude was at the last
+     * frame. An unknown attitude means there's no usable prior. Ignored by other algorithms.
+     */
+    virtual void SetPriorAttitude(const Attitude &) { };
+
+    /**
+     * Tell algorithms which carry identifications from frame to frame what was identified in the
+     * last frame, when something else identified it. Ignored by other algorithms.
+     */
+    virtual void SetPriorIdentification(const Stars &, const StarIdentifiers &) { };
+
+    /**
+     * Use this view of the catalog that will be passed to Go, instead of building one each time it's
+     * needed. Meant to be built once when the database is loaded. Null means build one when needed.
+     * Not owned, so it must outlive every call to Go.
+     */
+    virtual void SetCatalogView(const CatalogView *catalogView) { this->catalogView = catalogView; };
+
+protected:
+    long deadlineUs = 0;
+    const CatalogView *catalogView = NULL;
 };
 
 /// A star-id algorithm that returns random results. For debugging.
 class DummyStarIdAlgorithm final : public StarIdAlgorithm {
 public:
-    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &) const;
+    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                       StarIdStats *stats = NULL) const;
 };
 
 /**
@@ -34,24 +96,43 @@ public:
  */
 class GeometricVotingStarIdAlgorithm : public StarIdAlgorithm {
 public:
-    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &) const;
+    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                       StarIdStats *stats = NULL) const;
 
     /**
      * @param tolerance Angular tolerance (Two inter-star distances are considered the same if within this many radians)
+     * @param earlyTermination Query each star's pairs brightest first, and stop once the remaining
+     * queries can't change which catalog star wins the vote. Gives exactly the same result.
      */
-    explicit GeometricVotingStarIdAlgorithm(decimal tolerance): tolerance(tolerance) { };
+    explicit GeometricVotingStarIdAlgorithm(decimal tolerance, bool earlyTermination = false)
+        : tolerance(tolerance), earlyTermination(earlyTermination) { };
 private:
     decimal tolerance;
+    bool earlyTermination;
+
+    // The most votes one query can give one catalog star, for earlyTermination. Reads the whole
+    // database, so it's only worked out again when the database changes.
+    mutable const unsigned char *maxVotesDatabase = NULL;
+    mutable long maxVotesPerQuery = 0;
 };
 
 
+/// How to identify the rest of the stars once the first few have been matched.
+enum class IdentifyRemainingMode {
+    /// Use pair distance queries to find each remaining star from two identified ones
+    PairDistance,
+    /// Estimate the attitude and project the catalog onto the sensor. Needs a sky index database.
+    Projection,
+};
+
 /**
  * The "de facto" star-id algorithm used in many real-world missions.
  * Pyramid searches through groups of 4 stars in the image. For each one it tries to find a corresponding 4-star pattern in the database. Four stars is enough that pyramid is often able to uniquely match the first 4-star pattern it tries, making it fast and reliable. However, this only holds true if the camera is calibrated and has low centroid error.
  */
 class PyramidStarIdAlgorithm final : public StarIdAlgorithm {
 public:
-    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &) const;
+    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                       StarIdStats *stats = NULL) const;
     /**
      * @param tolerance Angular tolerance (Two inter-star distances are considered the same if within this many radians)
      * @param numFalseStars an estimate of the number of false stars in the whole celestial sphere
@@ -59,15 +140,234 @@ public:
      * want to multiply that up to a hundred-something numFalseStars.
      * @param maxMismatchProbability The maximum allowable probability for any star to be mis-id'd.
      * @param cutoff Maximum number of pyramids to iterate through before giving up.
+     * @param identifyRemaining How to identify the other stars once a pyramid has matched.
+     * @param brightestFirst If positive, try pyramids made of only this many of the brightest
+     * centroids first, then twice as many, and so on. Bright centroids are less likely to be false
+     * stars. If zero, centroids are taken in the order given.
+     * @param magnitudeMargin If non-negative, skip candidates where the brighter of two centroids
+     * would be a catalog star more than this many magnitudes fainter than the other. Has no effect
+     * unless the catalog in the database includes magnitudes.
+     * @param toleranceSigmas If positive, query each pair of centroids with a window this many times
+     * their combined Star::positionUncertainty wide, up to `tolerance`. Centroids with unknown
+     * uncertainty always use `tolerance`.
      */
-    PyramidStarIdAlgorithm(decimal tolerance, int numFalseStars, decimal maxMismatchProbability, long cutoff)
+    PyramidStarIdAlgorithm(decimal tolerance, int numFalseStars, decimal maxMismatchProbability, long cutoff,
+                           IdentifyRemainingMode identifyRemaining = IdentifyRemainingMode::PairDistance,
+                           int brightestFirst = 0, decimal magnitudeMargin = -1, decimal toleranceSigmas = 0)
         : tolerance(tolerance), numFalseStars(numFalseStars),
-          maxMismatchProbability(maxMismatchProbability), cutoff(cutoff) { };
+          maxMismatchProbability(maxMismatchProbability), cutoff(cutoff),
+          identifyRemaining(identifyRemaining), brightestFirst(brightestFirst),
+          magnitudeMargin(magnitudeMargin), toleranceSigmas(toleranceSigmas) { };
 private:
+    template <typename PairDatabase>
+    StarIdentifiers Go(const PairDatabase &, const MultiDatabase &,
+                       const Stars &, const Catalog &, const Camera &, StarIdStats *) const;
+
     decimal tolerance;
     int numFalseStars;
     decimal maxMismatchProbability;
     long cutoff;
+    IdentifyRemainingMode identifyRemaining;
+    int brightestFirst;
+    decimal magnitudeMargin;
+    decimal toleranceSigmas;
+};
+
+/**
+ * Mortari's Non-Dimensional star-id algorithm.
+ * Instead of inter-star distances, matches the inner angles of triangles formed by three stars, which do not change when the whole image is scaled. This makes it insensitive to first-order errors in the focal length, so the angular tolerance can stay tight even if the camera isn't well calibrated. The size of triangles is only checked loosely, to rule out similar triangles of wildly different sizes. Since triangles alone are not very distinctive, a 5-star pattern made of triangles sharing two stars must match, and it must place a few other centroids on catalog stars. Then, the focal length is re-estimated from the identified stars and the remaining stars are identified using the pair distance database, if present.
+ */
+class NonDimensionalStarIdAlgorithm final : public StarIdAlgorithm {
+public:
+    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                       StarIdStats *stats = NULL) const;
+    /**
+     * @param tolerance Angular tolerance (How far, in radians, a centroid may be from where it should be)
+     * @param focalLengthTolerance How far off the camera's focal length may be, as a fraction of it.
+     * @param cutoff Maximum number of triangles to query before giving up.
+     */
+    NonDimensionalStarIdAlgorithm(decimal tolerance, decimal focalLengthTolerance, long cutoff)
+        : tolerance(tolerance), focalLengthTolerance(focalLengthTolerance), cutoff(cutoff) { };
+private:
+    decimal tolerance;
+    decimal focalLengthTolerance;
+    long cutoff;
+};
+
+/**
+ * A star-id algorithm which looks up whole 4-star patterns in a hash table.
+ * Tetra builds patterns out of the brightest centroids, then finds catalog patterns with the same shape (edge ratios) with a single hash lookup, instead of one range query per edge like Pyramid. Once a pattern is matched, the remaining stars are identified using the pair distance database, if present.
+ */
+class TetraStarIdAlgorithm final : public StarIdAlgorithm {
+public:
+    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                       StarIdStats *stats = NULL) const;
+    /**
+     * @param tolerance Angular tolerance (Two inter-star distances are considered the same if within this many radians)
+     * @param cutoff Maximum number of image patterns to try before giving up.
+     */
+    TetraStarIdAlgorithm(decimal tolerance, long cutoff)
+        : tolerance(tolerance), cutoff(cutoff) { };
+private:
+    decimal tolerance;
+    long cutoff;
+};
+
+/**
+ * A star-id algorithm for when the attitude is already roughly known, eg from the previous frame.
+ * Tracking looks up the catalog stars near the predicted boresight in the sky index database, projects them onto the sensor using the prior attitude, and matches each centroid to the nearest projected star. Matches whose inter-star distances disagree with the others are thrown out. If too few stars could be matched, the fallback algorithm runs instead, usually Pyramid.
+ */
+class TrackingStarIdAlgorithm final : public StarIdAlgorithm {
+public:
+    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                       StarIdStats *stats = NULL) const;
+    /**
+     * @param tolerance Angular tolerance (Two inter-star distances are considered the same if within this many radians)
+     * @param prior Attitude at the time of the last frame. If unknown, the fallback is used until
+     * SetPriorAttitude is called with a known attitude.
+     * @param maxAngularRate Upper bound on how fast the camera rotates, in radians per second
+     * @param frameInterval Seconds between the prior attitude and the current frame
+     * @param fallback Algorithm to use when tracking fails. Takes ownership. May be NULL.
+     */
+    TrackingStarIdAlgorithm(decimal tolerance, const Attitude &prior,
+                            decimal maxAngularRate, decimal frameInterval,
+                            StarIdAlgorithm *fallback)
+        : tolerance(tolerance), prior(prior),
+          maxAngularRate(maxAngularRate), frameInterval(frameInterval), fallback(fallback) { };
+
+    /// Set the attitude to track from, usually the attitude estimated from the last frame.
+    void SetPriorAttitude(const Attitude &attitude) override { prior = attitude; };
+    /// Passed on to the fallback
+    void SetCatalogView(const CatalogView *catalogView) override;
+private:
+    StarIdentifiers Fallback(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                             StarIdStats *stats) const;
+
+    decimal tolerance;
+    Attitude prior;
+    decimal maxAngularRate;
+    decimal frameInterval;
+    std::unique_ptr<StarIdAlgorithm> fallback;
+};
+
+/**
+ * A star-id algorithm for a stream of frames, which carries identifications forward from the last frame.
+ * Consecutive frames share most of their stars, which only move a little on the sensor. Each star identified in the last frame is moved by how far it moved between the two frames before, and associated with the one centroid near there, if there is exactly one. Associations are kept if the distances to a few other associated centroids agree with the catalog, then the rest of the centroids are identified from them using the pair distance database. The fallback algorithm, usually Pyramid, only runs on the first frame or when too few associations can be verified.
+ * @warning Remembers the last frame between calls to Go, so each instance should only see one stream of frames, in order.
+ */
+class IncrementalStarIdAlgorithm final : public StarIdAlgorithm {
+public:
+    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                       StarIdStats *stats = NULL) const;
+    /**
+     * @param tolerance Angular tolerance (Two inter-star distances are considered the same if within this many radians)
+     * @param maxPixelMotion How far, in pixels, a centroid may be from where its motion in the last frame predicts it to be
+     * @param fallback Algorithm to use when there's no last frame or association fails. Takes ownership. May be NULL.
+     */
+    IncrementalStarIdAlgorithm(decimal tolerance, decimal maxPixelMotion, StarIdAlgorithm *fallback)
+        : tolerance(tolerance), maxPixelMotion(maxPixelMotion), fallback(fallback) { };
+
+    /// Forget the last frame, so that the next one is identified from scratch.
+    void Reset();
+
+    /// Use these as the last frame, as if the fallback had identified them
+    void SetPriorIdentification(const Stars &stars, const StarIdentifiers &identifiers) override;
+    /// Passed on to the fallback
+    void SetCatalogView(const CatalogView *catalogView) override;
+private:
+    StarIdentifiers Fallback(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                             StarIdStats *stats) const;
+
+    decimal tolerance;
+    decimal maxPixelMotion;
+    std::unique_ptr<StarIdAlgorithm> fallback;
+
+    // The last frame, updated by every call to Go.
+    mutable Stars lastStars;
+    mutable StarIdentifiers lastIdentifiers;
+    /// How far each of lastIdentifiers moved on the sensor since the frame before
+    mutable std::vector<Vec2> lastMotions;
+};
+
+/**
+ * Runs a list of star-id algorithms in order, until one of them identifies enough stars.
+ * Put the cheap algorithms which often fail first, like tracking or pyramid with a short deadline,
+ * and the slow but dependable ones last. Every stage gets the same database buffer; deserializing a
+ * database only sets up pointers into it, so there's nothing else worth sharing between stages.
+ * The counters in StarIdStats add up over all stages that ran, and StarIdStats::cascadeStage says
+ * which stage succeeded. The other stages are then given its result with SetPriorIdentification, so
+ * a stage like incremental can carry it into the next frame even when it wasn't the one that succeeded.
+ */
+class CascadeStarIdAlgorithm final : public StarIdAlgorithm {
+public:
+    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                       StarIdStats *stats = NULL) const;
+    /**
+     * @param stages Algorithms to try, in order. Takes ownership. Each may have its own deadline.
+     * @param minIdentified A stage succeeds if it identifies at least this many stars. If no stage
+     * does, the result with the most identified stars is returned.
+     */
+    CascadeStarIdAlgorithm(const std::vector<StarIdAlgorithm *> &stages, long minIdentified);
+
+    /// Passed on to every stage
+    void SetPriorAttitude(const Attitude &attitude) override;
+    /// Passed on to every stage
+    void SetPriorIdentification(const Stars &stars, const StarIdentifiers &identifiers) override;
+    /// Passed on to every stage
+    void SetCatalogView(const CatalogView *catalogView) override;
+private:
+    std::vector<std::unique_ptr<StarIdAlgorithm>> stages;
+    long minIdentified;
+};
+
+/**
+ * Remembers which catalog stars were matched to recently seen star fields, for when the camera sees
+ * the same part of the sky over and over, like while holding an inertial attitude or during ground tests.
+ * A star field is recognized by the distances between its few brightest centroids, quantized into
+ * bins several tolerances wide, which don't change with roll or with the order of the centroids. On a
+ * hit, only the distances between the remembered catalog stars are checked, then the rest of the
+ * centroids are identified using the pair distance database. On a miss, or if the check fails, the
+ * wrapped algorithm runs and its result is remembered, forgetting the least recently used field if the
+ * cache is full.
+ * @warning A distance close to the edge of a bin may land in the other bin next time, which is a miss.
+ */
+class CachedStarIdAlgorithm final : public StarIdAlgorithm {
+public:
+    StarIdentifiers Go(const unsigned char *database, const Stars &, const Catalog &, const Camera &,
+                       StarIdStats *stats = NULL) const;
+    /**
+     * @param tolerance Angular tolerance (Two inter-star distances are considered the same if within this many radians)
+     * @param maxEntries How many star fields to remember
+     * @param algorithm Algorithm to use on a miss. Takes ownership.
+     */
+    CachedStarIdAlgorithm(decimal tolerance, long maxEntries, StarIdAlgorithm *algorithm)
+        : tolerance(tolerance), maxEntries(maxEntries), algorithm(algorithm) { };
+
+    /// Number of star fields currently remembered
+    long NumEntries() const { return entries.size(); };
+
+    /// Passed on to the wrapped algorithm
+    void SetPriorAttitude(const Attitude &attitude) override { algorithm->SetPriorAttitude(attitude); };
+    /// Passed on to the wrapped algorithm
+    void SetPriorIdentification(const Stars &stars, const StarIdentifiers &identifiers) override {
+        algorithm->SetPriorIdentification(stars, identifiers);
+    };
+    /// Passed on to the wrapped algorithm
+    void SetCatalogView(const CatalogView *catalogView) override { algorithm->SetCatalogView(catalogView); };
+private:
+    struct Entry {
+        uint64_t signature;
+        /// Catalog index of each star of the signature, in signature order
+        std::vector<int16_t> catalogIndices;
+    };
+
+    decimal tolerance;
+    long maxEntries;
+    std::unique_ptr<StarIdAlgorithm> algorithm;
+
+    /// Most recently used first
+    mutable std::list<Entry> entries;
+    mutable std::unordered_map<uint64_t, std::list<Entry>::iterator> entriesBySignature;
 };
 
 }
@@ -50,6 +50,18 @@ Catalog NarrowCatalog(const Catalog &catalog, int maxMagnitude, int maxStars, de
     return result;
 }
 
+/// Copy the positions out of the catalog.
+CatalogView::CatalogView(const Catalog &catalog) {
+    x.reserve(catalog.size());
+    y.reserve(catalog.size());
+    z.reserve(catalog.size());
+    for (const CatalogStar &star : catalog) {
+        x.push_back(star.spatial.x);
+        y.push_back(star.spatial.y);
+        z.push_back(star.spatial.z);
+    }
+}
+
 /// Return a pointer to the star with the given name, or NULL if not found.
 Catalog::const_iterator FindNamedStar(const Catalog &catalog, int name) {
     for (auto it = catalog.cbegin(); it != catalog.cend(); ++it) {
@@ -49,7 +49,7 @@ public:
 class Star {
 public:
     Star(decimal x, decimal y, decimal radiusX, decimal radiusY, int magnitude) :
-        position({x, y}), radiusX(radiusX), radiusY(radiusY), magnitude(magnitude) {};
+        position({x, y}), radiusX(radiusX), radiusY(radiusY), magnitude(magnitude), positionUncertainty(0) {};
 
     /// Convenience constructor that sets Star.radiusY = radiusX and Star.magnitude = 0
     Star(decimal x, decimal y, decimal radiusX) : Star(x, y, radiusX, radiusX, 0) {};
@@ -68,6 +68,11 @@ public:
      * It's impossible to tell the true magnitude of the star from the image, without really good camera calibration. Anyway, this field is not meant to correspond to the usual measurement of magnitude. Instead, it's just some measure of brightness which may be specific to the centroiding algorithm. For example, it might be the total number of bright pixels in the star.
      */
     int magnitude;
+    /**
+     * Estimated standard deviation of the error in `position` along each axis, in pixels, for
+     * centroid algorithms which estimate it. Zero if unknown.
+     */
+    decimal positionUncertainty;
     // eccentricity?
 };
 
@@ -101,6 +106,37 @@ typedef std::vector<CatalogStar> Catalog;
 typedef std::vector<Star> Stars;
 typedef std::vector<StarIdentifier> StarIdentifiers;
 
+/**
+ * The positions of the stars in a catalog, stored as separate packed x, y, and z arrays.
+ * Checking many candidates against the same vector then only reads the coordinates, instead of whole
+ * CatalogStar records, and the loops in GatherDot are simple enough for the compiler to vectorize.
+ * Indices are the same as in the catalog it was made from.
+ */
+class CatalogView {
+public:
+    explicit CatalogView(const Catalog &);
+
+    /// Same as catalog[index].spatial
+    Vec3 Spatial(int index) const { return {x[index], y[index], z[index]}; };
+    long Size() const { return x.size(); };
+
+    /**
+     * Dot product of `vec` with each of the given catalog stars.
+     * @param out[out] The dot product with the star at `indices[n]` is written to `out[n]`
+     */
+    void GatherDot(const int16_t *indices, long numIndices, const Vec3 &vec, decimal *out) const {
+        const decimal *xs = x.data(), *ys = y.data(), *zs = z.data();
+        for (long n = 0; n < numIndices; n++) {
+            out[n] = xs[indices[n]]*vec.x + ys[indices[n]]*vec.y + zs[indices[n]]*vec.z;
+        }
+    };
+
+private:
+    std::vector<decimal> x;
+    std::vector<decimal> y;
+    std::vector<decimal> z;
+};
+
 void SerializeCatalog(SerializeContext *, const Catalog &, bool inclMagnitude, bool inclName);
 // sets magnited and name to whether the catalog in the database contained magnitude and name
 Catalog DeserializeCatalog(DeserializeContext *des, bool *inclMagnitudeReturn, bool *inclNameReturn);
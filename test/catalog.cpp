@@ -1,4 +1,4 @@
-// Tests for catalog narrowing
+// Tests for catalog narrowing and views
 
 #include <catch.hpp>
 
@@ -47,3 +47,20 @@ TEST_CASE("Narrow catalog, minDistance", "[narrow-catalog]") {
     CHECK(FindNamedStar(narrowed2, 2061) == narrowed2.end());
     CHECK(FindNamedStar(narrowed2, 1999) == narrowed2.end());
 }
+
+TEST_CASE("Catalog view agrees with catalog", "[catalog-view] [fast]") {
+    const Catalog &catalog = CatalogRead();
+    CatalogView view(catalog);
+    REQUIRE(view.Size() == (long)catalog.size());
+
+    std::vector<int16_t> indices = { 0, 17, 4, 4, (int16_t)(catalog.size()-1) };
+    Vec3 vec = { DECIMAL(0.3), DECIMAL(-0.5), DECIMAL(0.8) };
+    std::vector<decimal> dots(indices.size());
+    view.GatherDot(indices.data(), indices.size(), vec, dots.data());
+    for (size_t n = 0; n < indices.size(); n++) {
+        CHECK(view.Spatial(indices[n]).x == catalog[indices[n]].spatial.x);
+        CHECK(view.Spatial(indices[n]).y == catalog[indices[n]].spatial.y);
+        CHECK(view.Spatial(indices[n]).z == catalog[indices[n]].spatial.z);
+        CHECK(dots[n] == Approx(catalog[indices[n]].spatial * vec));
+    }
+}
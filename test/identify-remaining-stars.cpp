@@ -1,4 +1,5 @@
 #include <random>
+#include <algorithm>
 
 #include <catch.hpp>
 
@@ -48,7 +49,102 @@ TEST_CASE("IRUnidentifiedCentroid obtuse angle", "[identify-remaining] [fast]")
     REQUIRE(centroid.bestAngleFrom90 == Approx(DECIMAL_M_PI_4));
 }
 
-// TODO: Tests for FindAllInRange if we ever make the logic more complicated
+TEST_CASE("Unidentified centroid grid finds the same centroids as checking every one", "[identify-remaining] [fast]") {
+    std::default_random_engine rng(GENERATE(take(5, random(0, 1000000))));
+    std::uniform_real_distribution<decimal> positionDist(DECIMAL(0.0), DECIMAL(1024.0));
+    std::uniform_real_distribution<decimal> distanceDist(DECIMAL(0.0), DECIMAL(3.0)*DECIMAL_M_PI/180);
+    // so that the grid has many cells
+    decimal maxDistance = DECIMAL(3.0)*DECIMAL_M_PI/180;
+    Camera camera(FovToFocalLength(DECIMAL(30.0)*DECIMAL_M_PI/180, 1024), 1024, 1024);
+    int numCentroids = 200;
+
+    Stars stars;
+    for (int i = 0; i < numCentroids; i++) {
+        stars.emplace_back(positionDist(rng), positionDist(rng), 1);
+    }
+    std::vector<IRUnidentifiedCentroid> centroids;
+    for (int i = 0; i < numCentroids; i++) {
+        centroids.push_back(IRUnidentifiedCentroid(stars[i], i));
+    }
+    IRUnidentifiedCentroidSet set(stars, camera, maxDistance);
+    std::vector<bool> inSet(numCentroids, true);
+    for (IRUnidentifiedCentroid &centroid : centroids) {
+        set.Insert(&centroid);
+    }
+    // removals swap centroids around inside the grid
+    std::bernoulli_distribution removeDist(0.3);
+    for (IRUnidentifiedCentroid &centroid : centroids) {
+        if (removeDist(rng)) {
+            set.Remove(&centroid);
+            inSet[centroid.index] = false;
+        }
+    }
+
+    for (int i = 0; i < numCentroids; i++) {
+        decimal distance1 = distanceDist(rng);
+        decimal distance2 = distanceDist(rng);
+        decimal minDistance = std::min(distance1, distance2);
+        decimal maxQueryDistance = std::max(distance1, distance2);
+
+        std::vector<int16_t> found;
+        for (const IRUnidentifiedCentroid *centroid : set.FindInRange(i, minDistance, maxQueryDistance)) {
+            found.push_back(centroid->index);
+        }
+        std::vector<int16_t> expected;
+        Vec3 spatial = camera.CameraToSpatial(stars[i].position).Normalize();
+        for (int j = 0; j < numCentroids; j++) {
+            decimal angleCos = spatial * camera.CameraToSpatial(stars[j].position).Normalize();
+            if (inSet[j] && angleCos >= DECIMAL_COS(maxQueryDistance) && angleCos <= DECIMAL_COS(minDistance)) {
+                expected.push_back(j);
+            }
+        }
+        std::sort(found.begin(), found.end());
+        CHECK(found == expected);
+    }
+}
+
+TEST_CASE("Unidentified centroid set always gives the centroid with the best angle", "[identify-remaining] [fast]") {
+    std::default_random_engine rng(GENERATE(take(5, random(0, 1000000))));
+    std::uniform_real_distribution<decimal> positionDist(DECIMAL(0.0), DECIMAL(256.0));
+    int numCentroids = 150;
+
+    Stars stars;
+    for (int i = 0; i < numCentroids; i++) {
+        stars.emplace_back(positionDist(rng), positionDist(rng), 1);
+    }
+    std::vector<IRUnidentifiedCentroid> centroids;
+    for (int i = 0; i < numCentroids; i++) {
+        centroids.push_back(IRUnidentifiedCentroid(stars[i], i));
+    }
+    IRUnidentifiedCentroidSet set(stars, smolCamera, DECIMAL_M_PI);
+    for (IRUnidentifiedCentroid &centroid : centroids) {
+        set.Insert(&centroid);
+    }
+
+    // identify random stars one at a time, taking the best centroid after each, like
+    // IdentifyRemainingStarsPairDistance does
+    std::uniform_int_distribution<int> starDist(0, numCentroids-1);
+    while (!set.IsEmpty()) {
+        StarIdentifier starId(starDist(rng), 0);
+        for (IRUnidentifiedCentroid *centroid : set.FindInRange(starId.starIndex, 0, DECIMAL_M_PI)) {
+            decimal oldBestAngleFrom90 = centroid->bestAngleFrom90;
+            centroid->AddIdentifiedStar(starId, stars);
+            if (centroid->bestAngleFrom90 < oldBestAngleFrom90) {
+                set.BestAngleDecreased(centroid);
+            }
+        }
+
+        decimal expected = (*std::min_element(set.Centroids().begin(), set.Centroids().end(),
+            [](const IRUnidentifiedCentroid *a, const IRUnidentifiedCentroid *b) {
+                return a->bestAngleFrom90 < b->bestAngleFrom90;
+            }))->bestAngleFrom90;
+        IRUnidentifiedCentroid *best = set.Best();
+        REQUIRE(best != NULL);
+        REQUIRE(best->bestAngleFrom90 == expected);
+        set.Remove(best);
+    }
+    REQUIRE(set.Best() == NULL);
+}
 
 std::vector<int16_t> IdentifyThirdStarTest(const Catalog &catalog, int16_t catalogName1, int16_t catalogName2,
                                            decimal dist1, decimal dist2, decimal tolerance) {
@@ -63,6 +159,20 @@ std::vector<int16_t> IdentifyThirdStarTest(const Catalog &catalog, int16_t catal
                                     catalog,
                                     cs1 - catalog.cbegin(), cs2 - catalog.cbegin(),
                                     dist1, dist2, tolerance);
+
+    // the neighbor adjacency version should always agree
+    SerializeContext neighborSer;
+    SerializeNeighborAdjacency(&neighborSer, integralCatalog, DECIMAL_M_PI);
+    DeserializeContext neighborDes(neighborSer.buffer.data());
+    NeighborAdjacencyDatabase neighborDb(&neighborDes);
+    auto neighborResult = IdentifyThirdStar(neighborDb,
+                                            catalog,
+                                            cs1 - catalog.cbegin(), cs2 - catalog.cbegin(),
+                                            dist1, dist2, tolerance);
+    std::sort(result.begin(), result.end());
+    std::sort(neighborResult.begin(), neighborResult.end());
+    REQUIRE(result == neighborResult);
+
     return result;
 }
 
@@ -143,6 +253,7 @@ TEST_CASE("IdentifyRemainingStars fuzz", "[identify-remaining] [fuzz]") {
     std::uniform_real_distribution<decimal> yDist(DECIMAL(0.0), DECIMAL(256.0));
     std::uniform_int_distribution<int> starIndexDist(0, numFakeStars - 1);
     std::uniform_int_distribution<int> moreStartingStars(0, 1);
+    bool useNeighborAdjacency = GENERATE(false, true);
 
     Stars fakeCentroids;
     StarIdentifiers fakeStarIds;
@@ -170,12 +281,53 @@ TEST_CASE("IdentifyRemainingStars fuzz", "[identify-remaining] [fuzz]") {
     DeserializeContext des(ser.buffer.data());
     PairDistanceKVectorDatabase db(&des);
 
-    int numIdentified = IdentifyRemainingStarsPairDistance(&someFakeStarIds, fakeCentroids, db, fakeCatalog, smolCamera, DECIMAL(1e-5));
+    SerializeContext neighborSer;
+    SerializeNeighborAdjacency(&neighborSer, fakeCatalog, DECIMAL_M_PI);
+    DeserializeContext neighborDes(neighborSer.buffer.data());
+    NeighborAdjacencyDatabase neighborDb(&neighborDes);
+
+    int numIdentified = IdentifyRemainingStarsPairDistance(&someFakeStarIds, fakeCentroids, db, fakeCatalog, smolCamera, DECIMAL(1e-5),
+                                                           useNeighborAdjacency ? &neighborDb : NULL);
 
     REQUIRE(numIdentified == numFakeStars - fakePatternSize);
     REQUIRE(AreStarIdentifiersEquivalent(fakeStarIds, someFakeStarIds));
 }
 
+TEST_CASE("IdentifyRemainingStarsProjection fuzz", "[identify-remaining] [fuzz]") {
+
+    // same setup as above, but the fake catalog goes into a sky index instead of a kvector
+    int numFakeStars = 100;
+
+    std::default_random_engine rng(GENERATE(take(kIdentifyRemainingNumImages, random(0, 1000000))));
+    std::uniform_real_distribution<decimal> yDist(DECIMAL(0.0), DECIMAL(256.0));
+
+    Stars fakeCentroids;
+    StarIdentifiers fakeStarIds;
+    Catalog fakeCatalog;
+    for (int i = 0; i < numFakeStars; i++) {
+        decimal x = i * DECIMAL(256.0) / numFakeStars;
+        decimal y = yDist(rng);
+        fakeCentroids.emplace_back(x, y, 1);
+        fakeCatalog.emplace_back(smolCamera.CameraToSpatial({x, y}).Normalize(), 1, i);
+        fakeStarIds.emplace_back(i, i);
+    }
+
+    StarIdentifiers fakeStarIdsCopy = fakeStarIds;
+    std::shuffle(fakeStarIdsCopy.begin(), fakeStarIdsCopy.end(), rng);
+    // projection needs at least two stars to estimate the attitude from
+    StarIdentifiers someFakeStarIds(fakeStarIdsCopy.begin(), fakeStarIdsCopy.begin() + 4);
+
+    SerializeContext ser;
+    SerializeSkyIndex(&ser, fakeCatalog, 90);
+    DeserializeContext des(ser.buffer.data());
+    SkyIndexDatabase db(&des);
+
+    int numIdentified = IdentifyRemainingStarsProjection(&someFakeStarIds, fakeCentroids, db, fakeCatalog, smolCamera, DECIMAL(1e-5));
+
+    REQUIRE(numIdentified == numFakeStars - 4);
+    REQUIRE(AreStarIdentifiersEquivalent(fakeStarIds, someFakeStarIds));
+}
+
 // TODO: Test if kvector MaxDistance is substantially less than FOV
 
 // TODO: Test when some stars can't be identified.
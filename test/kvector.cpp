@@ -1,6 +1,11 @@
 #include <catch.hpp>
 
+#include <algorithm>
+#include <map>
+#include <random>
+
 #include "databases.hpp"
+#include "star-id.hpp"
 #include "io.hpp"
 #include "attitude-utils.hpp"
 #include "serialize-helpers.hpp"
@@ -99,6 +104,34 @@ TEST_CASE("Tighter tolerance test", "[kvector]") {
         }
         CHECK(!outsideRangeReturned);
     }
+    SECTION("batch agrees with separate liberal queries") {
+        // overlapping and duplicate ranges, not in order
+        std::vector<std::pair<decimal, decimal>> ranges;
+        for (decimal i = DegToRad(DECIMAL(4.9)); i > DegToRad(DECIMAL(0.6)); i -= DegToRad(DECIMAL(0.0517))) {
+            ranges.emplace_back(i - DegToRad(DECIMAL(0.2)), i + DegToRad(DECIMAL(0.2)));
+        }
+        ranges.push_back(ranges[3]);
+        ranges.emplace_back(DegToRad(DECIMAL(7.0)), DegToRad(DECIMAL(8.0)));
+
+        long expectedTotal = 0;
+        for (const std::pair<decimal, decimal> &range : ranges) {
+            const int16_t *end;
+            const int16_t *pairs = db.FindPairsLiberal(range.first, range.second, &end);
+            expectedTotal += end - pairs;
+        }
+
+        std::vector<PairDistanceSpan> spans = db.FindPairsLiberalBatch(ranges);
+        long actualTotal = 0;
+        for (size_t i = 0; i < spans.size(); i++) {
+            CHECK(spans[i].begin < spans[i].end);
+            CHECK(spans[i].multiplicity > 0);
+            if (i > 0) {
+                CHECK(spans[i-1].end <= spans[i].begin);
+            }
+            actualTotal += (spans[i].end - spans[i].begin) * spans[i].multiplicity;
+        }
+        CHECK(actualTotal == expectedTotal);
+    }
 }
 
 TEST_CASE("3-star database, check exact results", "[kvector] [fast]") {
@@ -133,3 +166,160 @@ TEST_CASE("3-star database, check exact results", "[kvector] [fast]") {
         }
     }
 }
+
+TEST_CASE("No query gives one star more pairs than the per-star bound", "[kvector]") {
+    const Catalog &catalog = CatalogRead();
+    Catalog narrowedCatalog = NarrowCatalog(catalog, 600, 5000, DegToRad(DECIMAL(0.08)));
+    SerializeContext ser;
+    SerializePairDistanceKVector(&ser, narrowedCatalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(15.0)), 10000);
+    DeserializeContext des(ser.buffer.data());
+    PairDistanceKVectorDatabase db(&des);
+
+    decimal queryWidth = DegToRad(DECIMAL(0.08));
+    long bound = db.MaxPairsPerStarInQuery(queryWidth);
+    REQUIRE(bound >= 1);
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<decimal> centerDist(DegToRad(DECIMAL(0.4)), DegToRad(DECIMAL(15.1)));
+    long mostSeen = 0;
+    for (int i = 0; i < 2000; i++) {
+        decimal center = centerDist(rng);
+        const int16_t *end;
+        const int16_t *pairs = db.FindPairsLiberal(center - queryWidth/2, center + queryWidth/2, &end);
+        std::map<int16_t, long> counts;
+        for (const int16_t *star = pairs; star != end; star++) {
+            mostSeen = std::max(mostSeen, ++counts[*star]);
+        }
+    }
+    CHECK(mostSeen <= bound);
+    // the bound shouldn't be much looser than needed
+    CHECK(mostSeen >= bound/2);
+}
+
+TEST_CASE("Compact database agrees with kvector", "[kvector]") {
+    const Catalog &catalog = CatalogRead();
+    decimal minDistance = DegToRad(DECIMAL(0.5));
+    decimal maxDistance = DegToRad(DECIMAL(5.0));
+    SerializeContext kvectorSer;
+    SerializePairDistanceKVector(&kvectorSer, catalog, minDistance, maxDistance, 1000);
+    DeserializeContext kvectorDes(kvectorSer.buffer.data());
+    PairDistanceKVectorDatabase kvectorDb(&kvectorDes);
+
+    int distanceBits = GENERATE(0, 2, 8);
+    long numBins = 100;
+    SerializeContext compactSer;
+    SerializeCompactPairDistance(&compactSer, catalog, minDistance, maxDistance, numBins, distanceBits);
+    DeserializeContext compactDes(compactSer.buffer.data());
+    CompactPairDistanceDatabase compactDb(&compactDes);
+    REQUIRE(compactDb.NumPairs() == kvectorDb.NumPairs());
+
+    // how far outside the requested range returned pairs may be
+    decimal epsilon = (maxDistance - minDistance) / numBins / (1 << distanceBits) + DECIMAL(1e-6);
+    decimal delta = DegToRad(DECIMAL(0.01));
+    std::vector<int16_t> compactPairs;
+    std::vector<int16_t> partners;
+    for (decimal i = DegToRad(DECIMAL(0.6)); i < DegToRad(DECIMAL(4.9)); i += DegToRad(DECIMAL(0.1228))) {
+        compactDb.FindPairsLiberal(i - delta, i + delta, &compactPairs);
+        REQUIRE(compactPairs.size() % 2 == 0);
+        std::vector<std::pair<int16_t, int16_t>> compactSorted;
+        for (size_t p = 0; p < compactPairs.size(); p += 2) {
+            decimal distance = AngleUnit(catalog[compactPairs[p]].spatial, catalog[compactPairs[p+1]].spatial);
+            CHECK(i - delta - epsilon <= distance);
+            CHECK(distance <= i + delta + epsilon);
+            compactSorted.emplace_back(std::min(compactPairs[p], compactPairs[p+1]),
+                                       std::max(compactPairs[p], compactPairs[p+1]));
+        }
+        std::sort(compactSorted.begin(), compactSorted.end());
+
+        const int16_t *end;
+        const int16_t *pairs = kvectorDb.FindPairsExact(catalog, i - delta, i + delta, &end);
+        REQUIRE(pairs != end);
+        for (const int16_t *pair = pairs; pair != end; pair += 2) {
+            std::pair<int16_t, int16_t> sorted(std::min(pair[0], pair[1]), std::max(pair[0], pair[1]));
+            CHECK(std::binary_search(compactSorted.begin(), compactSorted.end(), sorted));
+
+            // partners of one star should be exactly the other stars of the pairs involving it
+            compactDb.FindPartnersLiberal(pair[0], i - delta, i + delta, &partners);
+            std::vector<int16_t> expectedPartners;
+            for (const std::pair<int16_t, int16_t> &compactPair : compactSorted) {
+                if (compactPair.first == pair[0]) {
+                    expectedPartners.push_back(compactPair.second);
+                } else if (compactPair.second == pair[0]) {
+                    expectedPartners.push_back(compactPair.first);
+                }
+            }
+            std::sort(partners.begin(), partners.end());
+            std::sort(expectedPartners.begin(), expectedPartners.end());
+            CHECK(partners == expectedPartners);
+        }
+    }
+}
+
+TEST_CASE("Pair distance databases don't depend on the number of threads", "[kvector]") {
+    Catalog catalog = CatalogRead();
+    decimal minDistance = DegToRad(DECIMAL(0.5));
+    decimal maxDistance = DegToRad(DECIMAL(10.0));
+
+    // Every star near the first one three times over, so that many pairs are exactly the same
+    // distance apart and only the tie breaking decides their order.
+    if (GENERATE(false, true)) {
+        Catalog tiedCatalog;
+        for (const CatalogStar &star : catalog) {
+            if (star.spatial * catalog[0].spatial > DECIMAL_COS(DegToRad(DECIMAL(20.0))) && tiedCatalog.size() < 300) {
+                tiedCatalog.insert(tiedCatalog.end(), 3, star);
+            }
+        }
+        REQUIRE(tiedCatalog.size() > 256);
+        catalog = tiedCatalog;
+    }
+    int numThreads = GENERATE(4, 7);
+
+    SerializeContext kvectorSer1, kvectorSerN;
+    SerializePairDistanceKVector(&kvectorSer1, catalog, minDistance, maxDistance, 1000, 1);
+    SerializePairDistanceKVector(&kvectorSerN, catalog, minDistance, maxDistance, 1000, numThreads);
+    CHECK(kvectorSer1.buffer == kvectorSerN.buffer);
+
+    // the sky grid must not miss any pairs
+    long numPairs = 0;
+    for (int i = 0; i < (int)catalog.size(); i++) {
+        for (int k = i+1; k < (int)catalog.size(); k++) {
+            decimal distance = AngleUnit(catalog[i].spatial, catalog[k].spatial);
+            if (minDistance <= distance && distance <= maxDistance) {
+                numPairs++;
+            }
+        }
+    }
+    DeserializeContext kvectorDes(kvectorSerN.buffer.data());
+    PairDistanceKVectorDatabase kvectorDb(&kvectorDes);
+    CHECK(kvectorDb.NumPairs() == numPairs);
+
+    SerializeContext compactSer1, compactSerN;
+    SerializeCompactPairDistance(&compactSer1, catalog, minDistance, maxDistance, 100, 2, 1);
+    SerializeCompactPairDistance(&compactSerN, catalog, minDistance, maxDistance, 100, 2, numThreads);
+    CHECK(compactSer1.buffer == compactSerN.buffer);
+
+    SerializeContext neighborSer1, neighborSerN;
+    SerializeNeighborAdjacency(&neighborSer1, catalog, maxDistance, 1);
+    SerializeNeighborAdjacency(&neighborSerN, catalog, maxDistance, numThreads);
+    CHECK(neighborSer1.buffer == neighborSerN.buffer);
+}
+
+TEST_CASE("Pair distance database with a very small max distance", "[kvector]") {
+    const Catalog &catalog = CatalogRead();
+    // a grid cell per cube this small over the whole sphere wouldn't fit in memory
+    decimal maxDistance = DegToRad(GENERATE(DECIMAL(0.1), DECIMAL(0.001)));
+
+    SerializeContext ser;
+    SerializePairDistanceKVector(&ser, catalog, 0, maxDistance, 100);
+    long numPairs = 0;
+    for (int i = 0; i < (int)catalog.size(); i++) {
+        for (int k = i+1; k < (int)catalog.size(); k++) {
+            if (AngleUnit(catalog[i].spatial, catalog[k].spatial) <= maxDistance) {
+                numPairs++;
+            }
+        }
+    }
+    DeserializeContext des(ser.buffer.data());
+    PairDistanceKVectorDatabase db(&des);
+    CHECK(db.NumPairs() == numPairs);
+}
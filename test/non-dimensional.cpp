@@ -0,0 +1,62 @@
+#include <catch.hpp>
+
+#include "databases.hpp"
+#include "star-id.hpp"
+#include "io.hpp"
+#include "attitude-utils.hpp"
+#include "serialize-helpers.hpp"
+
+#include "utils.hpp"
+
+using namespace lost; // NOLINT
+
+TEST_CASE("Triple inner kvector queries", "[non-dimensional]") {
+    const Catalog &catalog = CatalogRead();
+    Catalog narrowedCatalog = NarrowCatalog(catalog, 500, 2000, DegToRad(DECIMAL(0.08)));
+    SerializeContext ser;
+    SerializeTripleInnerKVector(&ser, narrowedCatalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(8.0)), 1000);
+    DeserializeContext des(ser.buffer.data());
+    TripleInnerKVectorDatabase db(&des);
+    REQUIRE(db.NumTriples() > 0);
+
+    decimal minAngle = DECIMAL(0.3);
+    decimal maxAngle = DECIMAL(0.4);
+    const int16_t *end;
+    const int16_t *triples = db.FindTriplesLiberal(minAngle, maxAngle, &end);
+    REQUIRE(triples != end);
+    for (const int16_t *triple = triples; triple != end; triple += 3) {
+        decimal angles[3];
+        TriangleInnerAngles(narrowedCatalog[triple[0]].spatial,
+                            narrowedCatalog[triple[1]].spatial,
+                            narrowedCatalog[triple[2]].spatial,
+                            angles);
+        // liberal query, so allow a bin's worth of slack
+        CHECK(angles[0] >= minAngle - DECIMAL(0.002));
+        CHECK(angles[0] <= maxAngle + DECIMAL(0.002));
+        // stored smallest angle first
+        CHECK(angles[0] <= angles[1] + DECIMAL(1e-5));
+        CHECK(angles[1] <= angles[2] + DECIMAL(1e-5));
+        for (int i = 0; i < 3; i++) {
+            for (int j = i+1; j < 3; j++) {
+                decimal distance = AngleUnit(narrowedCatalog[triple[i]].spatial, narrowedCatalog[triple[j]].spatial);
+                CHECK(distance <= DegToRad(DECIMAL(8.0)) + DECIMAL(1e-5));
+            }
+        }
+    }
+}
+
+TEST_CASE("Non-dimensional star-id with wrong focal length", "[non-dimensional]") {
+    StarIdFixture fixture({TripleInnerKVectorDatabase::kMagicValue, PairDistanceKVectorDatabase::kMagicValue});
+
+    // focal length off by 3%, way more than the angular tolerance allows for pair distances
+    Camera wrongCamera(fixture.camera);
+    wrongCamera.SetFocalLength(fixture.camera.FocalLength() * DECIMAL(1.03));
+
+    NonDimensionalStarIdAlgorithm algorithm(DegToRad(DECIMAL(0.04)), DECIMAL(0.1), 1000);
+    StarIdentifiers starIds = algorithm.Go(fixture.database.data(), fixture.stars, fixture.catalog, wrongCamera);
+    // more than just the pattern, thanks to the corrected focal length
+    REQUIRE(starIds.size() > 5);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.catalogIndex == fixture.starCatalogIndices[starId.starIndex]);
+    }
+}
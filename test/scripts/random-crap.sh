@@ -34,6 +34,26 @@ echo 'Run the generator without centroids a whole bunch and make sure no asserti
 echo 'Error message for database that does not exist'
 no_database_out=$(./lost pipeline --generate 1 --database 'does not.exist' --star-id-algo py 2>&1) && exit 1
 [[ $no_database_out == 'Error reading database!'* ]] || exit 1
+no_database_out=$(./lost pipeline --generate 1 --database 'does not.exist' --database-mmap --star-id-algo py 2>&1) && exit 1
+[[ $no_database_out == 'Error reading database!'* ]] || exit 1
+
+echo 'Mapping the database into memory gives the same star-ids as reading it'
+database_file=$(mktemp)
+./lost database --max-stars 2000 --kvector --output "$database_file" || exit 1
+read_out=$(./lost pipeline --generate 5 --database "$database_file" --star-id-algo py --compare-star-ids -) || exit 1
+mmap_out=$(./lost pipeline --generate 5 --database "$database_file" --database-mmap private --database-advice random --star-id-algo py --compare-star-ids -) || exit 1
+rm "$database_file"
+[[ $read_out == "$mmap_out" ]] || exit 1
+
+echo 'Benchmark with a single image and repeat, so each percentile is the only sample'
+database_file=$(mktemp)
+./lost database --max-stars 2000 --kvector --output "$database_file" || exit 1
+benchmark_out=$(./lost pipeline --benchmark-star-id - --database "$database_file" --fov 20 --benchmark-star-id-algos py,gv --benchmark-false-stars 0,5 --benchmark-perturbations 0,0.2 --benchmark-images 1 --benchmark-repeats 1) || exit 1
+rm "$database_file"
+(( $(echo "$benchmark_out" | grep -c '_p99_ns') == 8 )) || exit 1
+benchmark_p50_ns=$(echo "$benchmark_out" | grep 'starid_benchmark_py_false_0_perturb_0_p50_ns' | cut -d' ' -f2)
+benchmark_p99_ns=$(echo "$benchmark_out" | grep 'starid_benchmark_py_false_0_perturb_0_p99_ns' | cut -d' ' -f2)
+(( benchmark_p50_ns == benchmark_p99_ns )) || exit 1
 
 echo 'Speed 95-th percentile should be different than max for 20 but not 19 trials'
 nineteen_out=$(./lost pipeline --generate 19 --generate-centroids-only --attitude-algo quest --print-speed -)
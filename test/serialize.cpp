@@ -1,9 +1,11 @@
 // Tests for serialization and multidatabases
 
+#include <sstream>
 #include <vector>
 
 #include <catch.hpp>
 
+#include "databases.hpp"
 #include "serialize-helpers.hpp"
 
 using namespace lost; // NOLINT
@@ -97,3 +99,46 @@ TEST_CASE("Array", "[fast] [serialize]") {
     int8_t ninthByte = DeserializePrimitive<int16_t>(&des);
     CHECK(ninthByte == 8);
 }
+
+TEST_CASE("Bulk array serialization is the same as one value at a time", "[fast] [serialize]") {
+    bool swapEndianness = GENERATE(false, true);
+    std::vector<int32_t> values;
+    for (int32_t i = 0; i < 3000; i++) {
+        values.push_back(i*7919);
+    }
+    SerializeContext one(swapEndianness, swapEndianness);
+    SerializeContext bulk(swapEndianness, swapEndianness);
+    SerializePrimitive<int8_t>(&one, 42);
+    SerializePrimitive<int8_t>(&bulk, 42);
+    for (const int32_t &value : values) {
+        SerializePrimitive<int32_t>(&one, value);
+    }
+    SerializeArray<int32_t>(&bulk, values.data(), values.size());
+    CHECK(one.buffer == bulk.buffer);
+}
+
+TEST_CASE("Multidatabase streamed to a sink is the same as one built in memory", "[fast] [serialize]") {
+    // big enough that the first length is passed to the sink before it's filled in
+    MultiDatabaseDescriptor dbEntries;
+    dbEntries.emplace_back(1, std::vector<unsigned char>(kSerializeBufferSize + 13, 7));
+    dbEntries.emplace_back(2, std::vector<unsigned char>(5, 9));
+    SerializeContext memorySer(true, false);
+    SerializeMultiDatabase(&memorySer, dbEntries, 0);
+
+    std::stringstream stream;
+    StreamSerializeSink sink(&stream);
+    REQUIRE(sink.CanOverwrite());
+    SerializeContext streamSer(true, false, &sink);
+    for (const MultiDatabaseEntry &entry : dbEntries) {
+        size_t lengthOffset = SerializeMultiDatabaseEntryStart(&streamSer, entry.magicValue, 0);
+        SerializeArray<unsigned char>(&streamSer, entry.bytes.data(), entry.bytes.size());
+        SerializeMultiDatabaseEntryEnd(&streamSer, lengthOffset);
+    }
+    SerializeMultiDatabaseEnd(&streamSer);
+    CHECK(streamSer.buffer.size() < kSerializeBufferSize);
+    streamSer.Flush();
+
+    std::string streamed = stream.str();
+    CHECK(streamSer.Size() == memorySer.buffer.size());
+    CHECK(std::vector<unsigned char>(streamed.begin(), streamed.end()) == memorySer.buffer);
+}
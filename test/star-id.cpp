@@ -0,0 +1,358 @@
+#include <catch.hpp>
+
+#include <random>
+#include <set>
+
+#include "databases.hpp"
+#include "star-id.hpp"
+#include "star-id-private.hpp"
+#include "io.hpp"
+#include "attitude-utils.hpp"
+#include "serialize-helpers.hpp"
+
+#include "utils.hpp"
+
+using namespace lost; // NOLINT
+
+TEST_CASE("Geometric voting with early termination gives the same result", "[gv]") {
+    const Catalog &catalog = CatalogRead();
+    Catalog narrowedCatalog = NarrowCatalog(catalog, 700, 5000, DegToRad(DECIMAL(0.08)));
+
+    MultiDatabaseDescriptor dbEntries;
+    SerializeContext kvectorSer;
+    SerializePairDistanceKVector(&kvectorSer, narrowedCatalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(15.0)), 10000);
+    dbEntries.emplace_back(PairDistanceKVectorDatabase::kMagicValue, kvectorSer.buffer);
+    SerializeContext dbSer;
+    SerializeMultiDatabase(&dbSer, dbEntries, 0);
+
+    int resolution = 1024;
+    Camera camera(FovToFocalLength(DegToRad(DECIMAL(20.0)), resolution), resolution, resolution);
+    Attitude attitude(SphericalToQuaternion(DegToRad(DECIMAL(88.0)), DegToRad(DECIMAL(7.0)), 0));
+    std::vector<int> starCatalogIndices;
+    Stars stars = StarsInView(narrowedCatalog, attitude, camera, &starCatalogIndices);
+    REQUIRE(stars.size() >= 30);
+
+    // a bit of noise and a few false stars, so that not every vote is clear cut
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<decimal> perturbation(-DECIMAL(0.3), DECIMAL(0.3));
+    for (Star &star : stars) {
+        star.position.x += perturbation(rng);
+        star.position.y += perturbation(rng);
+    }
+    std::uniform_real_distribution<decimal> positionDist(0, resolution);
+    for (int i = 0; i < 5; i++) {
+        stars.emplace_back(positionDist(rng), positionDist(rng), 1);
+    }
+
+    decimal tolerance = DegToRad(DECIMAL(0.04));
+    GeometricVotingStarIdAlgorithm fullVote(tolerance);
+    GeometricVotingStarIdAlgorithm earlyTermination(tolerance, true);
+    StarIdStats fullStats, earlyStats;
+    StarIdentifiers fullStarIds = fullVote.Go(dbSer.buffer.data(), stars, narrowedCatalog, camera, &fullStats);
+    StarIdentifiers earlyStarIds = earlyTermination.Go(dbSer.buffer.data(), stars, narrowedCatalog, camera, &earlyStats);
+
+    REQUIRE(fullStarIds.size() >= 4);
+    REQUIRE(earlyStarIds.size() == fullStarIds.size());
+    for (size_t i = 0; i < fullStarIds.size(); i++) {
+        CHECK(earlyStarIds[i] == fullStarIds[i]);
+    }
+    CHECK(earlyStats.databaseQueries < fullStats.databaseQueries);
+
+    // the bound is only worked out once per database
+    StarIdentifiers againStarIds = earlyTermination.Go(dbSer.buffer.data(), stars, narrowedCatalog, camera);
+    CHECK(againStarIds == earlyStarIds);
+}
+
+TEST_CASE("Pyramid skips candidates with contradicting magnitudes", "[pyramid]") {
+    StarIdFixture fixture;
+    REQUIRE(fixture.stars.size() >= 4);
+
+    // the catalog is read back with its magnitudes
+    MultiDatabase multiDatabase(fixture.database.data());
+    DeserializeContext catalogDes(multiDatabase.SubDatabasePointer(kCatalogMagicValue));
+    bool inclMagnitude;
+    Catalog deserializedCatalog = DeserializeCatalog(&catalogDes, &inclMagnitude, NULL);
+    REQUIRE(inclMagnitude);
+    REQUIRE(deserializedCatalog.size() == fixture.catalog.size());
+    for (size_t i = 0; i < fixture.catalog.size(); i++) {
+        CHECK(deserializedCatalog[i].magnitude == fixture.catalog[i].magnitude);
+    }
+
+    PyramidStarIdAlgorithm withoutMargin(DegToRad(DECIMAL(0.04)), 500, DECIMAL(0.001), 1000);
+    PyramidStarIdAlgorithm withMargin(DegToRad(DECIMAL(0.04)), 500, DECIMAL(0.001), 1000,
+                                      IdentifyRemainingMode::PairDistance, 0, DECIMAL(0.0));
+    StarIdStats statsWithout, statsWith;
+    StarIdentifiers starIdsWithout = withoutMargin.Go(fixture.database.data(), fixture.stars, deserializedCatalog,
+                                                      fixture.camera, &statsWithout);
+    StarIdentifiers starIdsWith = withMargin.Go(fixture.database.data(), fixture.stars, deserializedCatalog,
+                                                fixture.camera, &statsWith);
+
+    REQUIRE(starIdsWith.size() >= 4);
+    for (const StarIdentifier &starId : starIdsWith) {
+        CHECK(starId.catalogIndex == fixture.starCatalogIndices[starId.starIndex]);
+    }
+    CHECK(starIdsWith.size() == starIdsWithout.size());
+    CHECK(statsWith.candidatesExamined < statsWithout.candidatesExamined);
+}
+
+TEST_CASE("Pyramid narrows queries for centroids with known uncertainty", "[pyramid]") {
+    StarIdFixture fixture;
+    REQUIRE(fixture.stars.size() >= 4);
+
+    // perturb every centroid by less than 2 times its uncertainty along each axis
+    decimal uncertainty = DECIMAL(0.2);
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<decimal> perturbation(-2*uncertainty, 2*uncertainty);
+    Stars stars = fixture.stars;
+    for (Star &star : stars) {
+        star.position.x += perturbation(rng);
+        star.position.y += perturbation(rng);
+    }
+    // the same centroids, but without an uncertainty
+    Stars unknownStars = stars;
+    for (Star &star : stars) {
+        star.positionUncertainty = uncertainty;
+    }
+
+    PyramidStarIdAlgorithm fixedTolerance(DegToRad(DECIMAL(0.04)), 500, DECIMAL(0.001), 1000);
+    PyramidStarIdAlgorithm adaptiveTolerance(DegToRad(DECIMAL(0.04)), 500, DECIMAL(0.001), 1000,
+                                             IdentifyRemainingMode::PairDistance, 0, -1, DECIMAL(3.0));
+    StarIdStats fixedStats, unknownStats, adaptiveStats;
+    StarIdentifiers fixedStarIds = fixedTolerance.Go(fixture.database.data(), stars, fixture.catalog,
+                                                     fixture.camera, &fixedStats);
+    StarIdentifiers unknownStarIds = adaptiveTolerance.Go(fixture.database.data(), unknownStars, fixture.catalog,
+                                                          fixture.camera, &unknownStats);
+    StarIdentifiers adaptiveStarIds = adaptiveTolerance.Go(fixture.database.data(), stars, fixture.catalog,
+                                                           fixture.camera, &adaptiveStats);
+
+    REQUIRE(adaptiveStarIds.size() >= 4);
+    for (const StarIdentifier &starId : adaptiveStarIds) {
+        CHECK(starId.catalogIndex == fixture.starCatalogIndices[starId.starIndex]);
+    }
+    CHECK(adaptiveStarIds.size() == fixedStarIds.size());
+
+    // centroids without an uncertainty get the full tolerance, so the queries are the same as with a
+    // fixed tolerance
+    CHECK(unknownStarIds == fixedStarIds);
+    CHECK(unknownStats.databaseQueries == fixedStats.databaseQueries);
+    CHECK(unknownStats.candidatesExamined == fixedStats.candidatesExamined);
+    // with the uncertainty known, the same queries return fewer candidates
+    CHECK(adaptiveStats.databaseQueries <= unknownStats.databaseQueries);
+    CHECK(adaptiveStats.candidatesExamined < unknownStats.candidatesExamined / 2);
+}
+
+TEST_CASE("Pyramid tries the brightest centroids first", "[pyramid]") {
+    StarIdFixture fixture;
+    REQUIRE(fixture.stars.size() >= 20);
+    decimal tolerance = DegToRad(DECIMAL(0.04));
+    int numFalseStars = GENERATE(0, 2, 4);
+
+    // false stars brighter than any real one, like reflections or a planet, at the end so that
+    // they'd be tried last if not for brightness
+    Stars stars = fixture.stars;
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<decimal> positionDist(0, fixture.camera.XResolution());
+    for (int i = 0; i < numFalseStars; i++) {
+        stars.emplace_back(positionDist(rng), positionDist(rng), 1, 1, 1000);
+    }
+
+    PyramidStarIdAlgorithm inOrder(tolerance, 500, DECIMAL(0.001), 1000);
+    PyramidStarIdAlgorithm brightestFirst(tolerance, 500, DECIMAL(0.001), 1000,
+                                          IdentifyRemainingMode::PairDistance, 8);
+    StarIdStats inOrderStats, brightestFirstStats;
+    StarIdentifiers inOrderStarIds = inOrder.Go(fixture.database.data(), stars, fixture.catalog,
+                                                fixture.camera, &inOrderStats);
+    StarIdentifiers brightestFirstStarIds = brightestFirst.Go(fixture.database.data(), stars, fixture.catalog,
+                                                              fixture.camera, &brightestFirstStats);
+
+    REQUIRE(brightestFirstStarIds.size() >= fixture.stars.size() * 9 / 10);
+    for (const StarIdentifier &starId : brightestFirstStarIds) {
+        REQUIRE(starId.starIndex < (int)fixture.stars.size());
+        CHECK(starId.catalogIndex == fixture.starCatalogIndices[starId.starIndex]);
+    }
+    CHECK(AreStarIdentifiersEquivalent(brightestFirstStarIds, inOrderStarIds));
+    if (numFalseStars == 0) {
+        CHECK(brightestFirstStats.patternsTried <= inOrderStats.patternsTried);
+    } else {
+        // every pyramid with a bright false star in it has to fail before a real one is found
+        CHECK(brightestFirstStats.patternsTried > inOrderStats.patternsTried);
+    }
+}
+
+TEST_CASE("Pyramid gives the same result with a catalog view built ahead of time", "[pyramid]") {
+    StarIdFixture fixture;
+    REQUIRE(fixture.stars.size() >= 4);
+
+    PyramidStarIdAlgorithm ownView(DegToRad(DECIMAL(0.04)), 10, DECIMAL(0.001), 1000);
+    PyramidStarIdAlgorithm sharedView(DegToRad(DECIMAL(0.04)), 10, DECIMAL(0.001), 1000);
+    CatalogView catalogView(fixture.catalog);
+    sharedView.SetCatalogView(&catalogView);
+    StarIdentifiers ownStarIds = ownView.Go(fixture.database.data(), fixture.stars, fixture.catalog, fixture.camera);
+    StarIdentifiers sharedStarIds = sharedView.Go(fixture.database.data(), fixture.stars, fixture.catalog, fixture.camera);
+
+    REQUIRE(ownStarIds.size() >= 4);
+    REQUIRE(sharedStarIds.size() == ownStarIds.size());
+    for (size_t i = 0; i < ownStarIds.size(); i++) {
+        CHECK(sharedStarIds[i] == ownStarIds[i]);
+    }
+}
+
+TEST_CASE("Pyramid gives up at the deadline", "[pyramid]") {
+    StarIdFixture fixture;
+
+    // random centroids will almost never match, so Pyramid keeps going until it runs out of time
+    std::default_random_engine rng(1234);
+    std::uniform_real_distribution<decimal> positionDist(0, fixture.camera.XResolution());
+    Stars stars;
+    for (int i = 0; i < 50; i++) {
+        stars.emplace_back(positionDist(rng), positionDist(rng), 1);
+    }
+
+    PyramidStarIdAlgorithm algorithm(DegToRad(DECIMAL(0.04)), 10, DECIMAL(0.001), 1000000000);
+    algorithm.SetDeadline(1);
+    StarIdStats stats;
+    StarIdentifiers starIds = algorithm.Go(fixture.database.data(), stars, fixture.catalog, fixture.camera, &stats);
+    CHECK(stats.timedOut);
+    CHECK(stats.firstMatchTimeNs < 0);
+    CHECK(starIds.size() == 0);
+    // the clock is only read every few pyramids, but it shouldn't get far past the deadline
+    CHECK(stats.patternsTried < 100);
+}
+
+TEST_CASE("Angle windows between two vectors agree with taking the arccosine", "[fast]") {
+    std::default_random_engine rng(GENERATE(take(5, random(0, 1000000))));
+    std::normal_distribution<decimal> componentDist(0, 1);
+    std::uniform_real_distribution<decimal> toleranceDist(0, DECIMAL(0.1));
+    std::uniform_real_distribution<decimal> dotDist(-1, 1);
+
+    for (int n = 0; n < 1000; n++) {
+        Vec3 unit1 = Vec3{componentDist(rng), componentDist(rng), componentDist(rng)}.Normalize();
+        Vec3 unit2 = Vec3{componentDist(rng), componentDist(rng), componentDist(rng)}.Normalize();
+        // sometimes close together, where the window is clamped at zero
+        if (n % 4 == 0) {
+            unit2 = (unit1 - unit2*DECIMAL(0.01)).Normalize();
+        }
+        decimal tolerance = toleranceDist(rng);
+        decimal angle = AngleUnit(unit1, unit2);
+        AngleWindow window(unit1, unit2, AngleTolerance(tolerance));
+
+        for (int m = 0; m < 10; m++) {
+            decimal dot = m == 0 ? DECIMAL(1.0) : m == 1 ? DECIMAL(-1.0) : dotDist(rng);
+            decimal distanceFromEdge = DECIMAL_ABS(DECIMAL_ACOS(dot) - angle) - tolerance;
+            // rounding could go either way right at the edge
+            if (DECIMAL_ABS(distanceFromEdge) < DECIMAL(1e-5)) {
+                continue;
+            }
+            CHECK(window.Contains(dot) == (distanceFromEdge < 0));
+            CHECK(window.Contains(dot) == AngleWindow(angle, tolerance).Contains(dot));
+        }
+    }
+}
+
+TEST_CASE("Catalog star set insert, intersect and clear", "[pyramid] [fast]") {
+    // not a multiple of 64, so the last word is partly used
+    CatalogStarSet set(200);
+    CatalogStarSet other(200);
+    for (int16_t star : {0, 63, 64, 130, 199}) {
+        set.Insert(star);
+    }
+    for (int16_t star = 0; star < 200; star++) {
+        CHECK(set.Contains(star) == (star == 0 || star == 63 || star == 64 || star == 130 || star == 199));
+    }
+
+    int16_t pairs[] = {64, 5, 199, 63};
+    other.InsertPairs(pairs, pairs + 4);
+    REQUIRE(set.IntersectWith(other));
+    for (int16_t star = 0; star < 200; star++) {
+        CHECK(set.Contains(star) == (star == 63 || star == 64 || star == 199));
+    }
+    // the other set is left alone
+    CHECK(other.Contains(5));
+
+    other.Clear();
+    for (int16_t star = 0; star < 200; star++) {
+        CHECK(!other.Contains(star));
+    }
+    CHECK(!set.IntersectWith(other));
+    CHECK(!set.Contains(64));
+}
+
+TEST_CASE("Intersecting pyramid queries keeps every possible i star", "[pyramid]") {
+    StarIdFixture fixture;
+    MultiDatabase multiDatabase(fixture.database.data());
+    DeserializeContext des(multiDatabase.SubDatabasePointer(PairDistanceKVectorDatabase::kMagicValue));
+    PairDistanceKVectorDatabase db(&des);
+    decimal tolerance = DegToRad(DECIMAL(0.04));
+    REQUIRE(fixture.stars.size() >= 20);
+
+    std::vector<Vec3> spatials;
+    for (const Star &star : fixture.stars) {
+        spatials.push_back(fixture.camera.CameraToSpatial(star.position).Normalize());
+    }
+    int numPyramids = 0;
+    for (int i = 0; i < 10; i++) {
+        // the i-j, i-k and i-r queries of a pyramid made of centroids i, i+1, i+3 and i+7
+        const int16_t *begins[3], *ends[3];
+        int others[] = {i+1, i+3, i+7};
+        bool inDatabase = true;
+        for (int q = 0; q < 3; q++) {
+            decimal distance = AngleUnit(spatials[i], spatials[others[q]]);
+            inDatabase = inDatabase && distance - tolerance > db.MinDistance() && distance + tolerance < db.MaxDistance();
+            begins[q] = db.FindPairsLiberal(distance - tolerance, distance + tolerance, &ends[q]);
+        }
+        // pyramid skips these too
+        if (!inDatabase) {
+            continue;
+        }
+        numPyramids++;
+
+        // Without intersecting, a catalog star can only be the i star if it's a key of all three
+        // query maps, and then all of its partners in each map are tried.
+        std::unordered_multimap<int16_t, int16_t> fullMaps[3];
+        std::set<int16_t> expected;
+        for (int q = 0; q < 3; q++) {
+            fullMaps[q] = PairDistanceQueryToMap(begins[q], ends[q]);
+        }
+        for (const auto &entry : fullMaps[0]) {
+            if (fullMaps[1].count(entry.first) > 0 && fullMaps[2].count(entry.first) > 0) {
+                expected.insert(entry.first);
+            }
+        }
+        // the true i star is one of them
+        CHECK(expected.count(fixture.starCatalogIndices[i]) == 1);
+
+        CatalogStarSet iCandidates(fixture.catalog.size());
+        iCandidates.InsertPairs(begins[0], ends[0]);
+        for (int q = 1; q < 3; q++) {
+            CatalogStarSet querySet(fixture.catalog.size());
+            querySet.InsertPairs(begins[q], ends[q]);
+            iCandidates.IntersectWith(querySet);
+        }
+        std::set<int16_t> actual;
+        for (int16_t star = 0; star < (int16_t)fixture.catalog.size(); star++) {
+            if (iCandidates.Contains(star)) {
+                actual.insert(star);
+            }
+        }
+        CHECK(actual == expected);
+
+        // and the maps restricted to the candidates have the same partners for each of them
+        for (int q = 0; q < 3; q++) {
+            std::unordered_multimap<int16_t, int16_t> restricted = PairDistanceQueryToMap(begins[q], ends[q], iCandidates);
+            for (int16_t star : expected) {
+                auto fullRange = fullMaps[q].equal_range(star);
+                auto restrictedRange = restricted.equal_range(star);
+                std::multiset<int16_t> fullPartners, restrictedPartners;
+                for (auto it = fullRange.first; it != fullRange.second; it++) {
+                    fullPartners.insert(it->second);
+                }
+                for (auto it = restrictedRange.first; it != restrictedRange.second; it++) {
+                    restrictedPartners.insert(it->second);
+                }
+                CHECK(restrictedPartners == fullPartners);
+            }
+            CHECK(restricted.size() <= fullMaps[q].size());
+        }
+    }
+    CHECK(numPyramids >= 3);
+}
@@ -0,0 +1,101 @@
+#include <catch.hpp>
+
+#include <set>
+#include <algorithm>
+#include <random>
+
+#include "databases.hpp"
+#include "star-id.hpp"
+#include "io.hpp"
+#include "attitude-utils.hpp"
+#include "serialize-helpers.hpp"
+
+#include "utils.hpp"
+
+using namespace lost; // NOLINT
+
+static std::vector<decimal> TetraEdgeRatios(const Catalog &catalog, const int16_t *pattern) {
+    Vec3 spatials[kTetraPatternSize];
+    for (int i = 0; i < kTetraPatternSize; i++) {
+        spatials[i] = catalog[pattern[i]].spatial;
+    }
+    decimal edges[kTetraNumEdges];
+    TetraPatternEdges(spatials, edges);
+    std::vector<decimal> result;
+    for (int i = 0; i < kTetraNumEdges-1; i++) {
+        result.push_back(edges[i] / edges[kTetraNumEdges-1]);
+    }
+    return result;
+}
+
+TEST_CASE("Tetra database queries", "[tetra]") {
+    const Catalog &catalog = CatalogRead();
+    SerializeContext ser;
+    SerializeTetraDatabase(&ser, catalog, DegToRad(DECIMAL(10.0)), DECIMAL(8.0), 50);
+    DeserializeContext des(ser.buffer.data());
+    TetraDatabase db(&des);
+    REQUIRE(db.NumPatterns() > 0);
+
+    decimal ratios[kTetraNumEdges-1] = { DECIMAL(0.3), DECIMAL(0.5), DECIMAL(0.6), DECIMAL(0.7), DECIMAL(0.8) };
+
+    SECTION("results are within tolerance and unique") {
+        decimal tolerance = DECIMAL(0.03);
+        std::vector<const int16_t *> patterns = db.FindPatterns(catalog, ratios, tolerance);
+        REQUIRE(patterns.size() > 0);
+        std::set<const int16_t *> uniquePatterns(patterns.begin(), patterns.end());
+        REQUIRE(uniquePatterns.size() == patterns.size());
+        for (const int16_t *pattern : patterns) {
+            std::vector<decimal> patternRatios = TetraEdgeRatios(catalog, pattern);
+            for (int i = 0; i < kTetraNumEdges-1; i++) {
+                CHECK(DECIMAL_ABS(patternRatios[i] - ratios[i]) <= tolerance);
+            }
+        }
+    }
+
+    SECTION("every pattern can find itself") {
+        std::vector<const int16_t *> patterns = db.FindPatterns(catalog, ratios, DECIMAL(0.03));
+        for (const int16_t *pattern : patterns) {
+            std::vector<decimal> patternRatios = TetraEdgeRatios(catalog, pattern);
+            std::vector<const int16_t *> found = db.FindPatterns(catalog, patternRatios.data(), DECIMAL(0.001));
+            CHECK(std::find(found.begin(), found.end(), pattern) != found.end());
+        }
+    }
+}
+
+TEST_CASE("Tetra identifies perfect centroids", "[tetra]") {
+    StarIdFixture fixture({TetraDatabase::kMagicValue});
+    REQUIRE(fixture.stars.size() >= kTetraPatternSize);
+
+    TetraStarIdAlgorithm algorithm(DegToRad(DECIMAL(0.04)), 1000);
+    StarIdStats stats;
+    StarIdentifiers starIds = algorithm.Go(fixture.database.data(), fixture.stars, fixture.catalog, fixture.camera, &stats);
+    CHECK(stats.patternsTried >= 1);
+    CHECK(stats.databaseQueries == stats.patternsTried);
+    CHECK(stats.candidatesExamined >= 1);
+    CHECK(stats.firstMatchTimeNs >= 0);
+    // without a pair distance database, only the pattern itself gets identified
+    REQUIRE(starIds.size() == kTetraPatternSize);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.catalogIndex == fixture.starCatalogIndices[starId.starIndex]);
+    }
+}
+
+TEST_CASE("Tetra gives up at the deadline", "[tetra]") {
+    StarIdFixture fixture({TetraDatabase::kMagicValue});
+
+    // random centroids will almost never match, so Tetra keeps going until it runs out of time
+    std::default_random_engine rng(1234);
+    std::uniform_real_distribution<decimal> positionDist(0, fixture.camera.XResolution());
+    Stars stars;
+    for (int i = 0; i < 50; i++) {
+        stars.emplace_back(positionDist(rng), positionDist(rng), 1);
+    }
+
+    TetraStarIdAlgorithm algorithm(DegToRad(DECIMAL(0.04)), 1000000000);
+    algorithm.SetDeadline(1);
+    StarIdStats stats;
+    StarIdentifiers starIds = algorithm.Go(fixture.database.data(), stars, fixture.catalog, fixture.camera, &stats);
+    CHECK(stats.timedOut);
+    CHECK(stats.firstMatchTimeNs < 0);
+    CHECK(starIds.size() == 0);
+}
@@ -0,0 +1,365 @@
+#include <catch.hpp>
+
+#include <algorithm>
+
+#include "databases.hpp"
+#include "star-id.hpp"
+#include "io.hpp"
+#include "attitude-utils.hpp"
+#include "serialize-helpers.hpp"
+#include "attitude-estimators.hpp"
+
+#include "utils.hpp"
+
+using namespace lost; // NOLINT
+
+TEST_CASE("Sky index cone query returns every star in the cone", "[tracking]") {
+    const Catalog &catalog = CatalogRead();
+    SerializeContext ser;
+    SerializeSkyIndex(&ser, catalog, 90);
+    DeserializeContext des(ser.buffer.data());
+    SkyIndexDatabase db(&des);
+
+    decimal radius = DegToRad(GENERATE(DECIMAL(1.0), DECIMAL(8.0), DECIMAL(20.0)));
+    Vec3 centers[] = {
+        SphericalToSpatial(DegToRad(DECIMAL(88.0)), DegToRad(DECIMAL(7.0))),
+        // straddling right ascension 0, from either side and right on it
+        SphericalToSpatial(DegToRad(DECIMAL(359.0)), DegToRad(DECIMAL(-40.0))),
+        SphericalToSpatial(DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(20.0))),
+        SphericalToSpatial(DegToRad(DECIMAL(0.0)), DegToRad(DECIMAL(0.0))),
+        // near the poles, with the bigger cones reaching over them
+        SphericalToSpatial(DegToRad(DECIMAL(200.0)), DegToRad(DECIMAL(85.0))),
+        SphericalToSpatial(DegToRad(DECIMAL(10.0)), DegToRad(DECIMAL(-80.0))),
+        SphericalToSpatial(DegToRad(DECIMAL(359.5)), DegToRad(DECIMAL(89.5))),
+        SphericalToSpatial(DegToRad(DECIMAL(90.0)), DegToRad(DECIMAL(-89.0))),
+        // right on the poles
+        SphericalToSpatial(DegToRad(DECIMAL(0.0)), DegToRad(DECIMAL(90.0))),
+        SphericalToSpatial(DegToRad(DECIMAL(123.0)), DegToRad(DECIMAL(-90.0))),
+    };
+    for (const Vec3 &center : centers) {
+        std::vector<int16_t> result = db.ConeQuery(center, radius);
+        std::sort(result.begin(), result.end());
+        REQUIRE(std::adjacent_find(result.begin(), result.end()) == result.end());
+        for (int16_t i = 0; i < (int16_t)catalog.size(); i++) {
+            if (AngleUnit(catalog[i].spatial, center) <= radius) {
+                CHECK(std::binary_search(result.begin(), result.end(), i));
+            }
+        }
+        // it's not just returning the whole catalog
+        CHECK(result.size() < catalog.size() / 10);
+    }
+}
+
+TEST_CASE("Tracking identifies stars from a slightly wrong prior", "[tracking]") {
+    StarIdFixture fixture({SkyIndexDatabase::kMagicValue});
+    REQUIRE(fixture.stars.size() >= 10);
+    // turned 0.05 degrees away and rolled a bit
+    Attitude prior(SphericalToQuaternion(DegToRad(DECIMAL(88.04)), DegToRad(DECIMAL(6.97)), DegToRad(DECIMAL(0.03))));
+
+    TrackingStarIdAlgorithm algorithm(DegToRad(DECIMAL(0.04)), prior, DegToRad(DECIMAL(1.0)), DECIMAL(0.1), NULL);
+    StarIdentifiers starIds = algorithm.Go(fixture.database.data(), fixture.stars, fixture.catalog, fixture.camera);
+    CHECK(starIds.size() >= fixture.stars.size() * 9 / 10);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.catalogIndex == fixture.starCatalogIndices[starId.starIndex]);
+    }
+}
+
+TEST_CASE("Tracking gives up when the prior is far off", "[tracking]") {
+    StarIdFixture fixture({SkyIndexDatabase::kMagicValue});
+    Attitude prior(SphericalToQuaternion(DegToRad(DECIMAL(95.0)), DegToRad(DECIMAL(7.0)), 0));
+
+    // with no fallback, nothing should be identified rather than something wrong
+    TrackingStarIdAlgorithm algorithm(DegToRad(DECIMAL(0.04)), prior, DegToRad(DECIMAL(1.0)), DECIMAL(0.1), NULL);
+    StarIdentifiers starIds = algorithm.Go(fixture.database.data(), fixture.stars, fixture.catalog, fixture.camera);
+    CHECK(starIds.size() == 0);
+}
+
+TEST_CASE("Tracking waits for a prior, which can be passed through a cascade", "[tracking]") {
+    StarIdFixture fixture({SkyIndexDatabase::kMagicValue});
+    const unsigned char *database = fixture.database.data();
+    REQUIRE(fixture.stars.size() >= 10);
+
+    CascadeStarIdAlgorithm algorithm(std::vector<StarIdAlgorithm *>{
+        new TrackingStarIdAlgorithm(DegToRad(DECIMAL(0.04)), Attitude(), DegToRad(DECIMAL(1.0)), DECIMAL(0.1), NULL),
+    }, 4);
+    CHECK(algorithm.Go(database, fixture.stars, fixture.catalog, fixture.camera).size() == 0);
+
+    algorithm.SetPriorAttitude(fixture.attitude);
+    StarIdentifiers starIds = algorithm.Go(database, fixture.stars, fixture.catalog, fixture.camera);
+    CHECK(starIds.size() >= fixture.stars.size() * 9 / 10);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.catalogIndex == fixture.starCatalogIndices[starId.starIndex]);
+    }
+
+    algorithm.SetPriorAttitude(Attitude());
+    CHECK(algorithm.Go(database, fixture.stars, fixture.catalog, fixture.camera).size() == 0);
+}
+
+/// Just the given centroids, as if they came from a centroid algorithm
+class CentroidsPipelineInput : public PipelineInput {
+public:
+    CentroidsPipelineInput(const Stars &stars, const Camera &camera, const Catalog &catalog)
+        : stars(stars), camera(camera), catalog(catalog) { };
+
+    const Stars *InputStars() const override { return &stars; };
+    const Camera *InputCamera() const override { return &camera; };
+    const Catalog &GetCatalog() const override { return catalog; };
+private:
+    Stars stars;
+    Camera camera;
+    const Catalog &catalog;
+};
+
+TEST_CASE("Pipeline tracks from the attitude estimated in the last frame", "[tracking]") {
+    StarIdFixture fixture({SkyIndexDatabase::kMagicValue, PairDistanceKVectorDatabase::kMagicValue});
+    decimal tolerance = DegToRad(DECIMAL(0.04));
+    unsigned char *database = new unsigned char[fixture.database.size()];
+    std::copy(fixture.database.begin(), fixture.database.end(), database);
+    // there's no prior to track from in the first frame
+    Pipeline pipeline(NULL, new CascadeStarIdAlgorithm(std::vector<StarIdAlgorithm *>{
+        new TrackingStarIdAlgorithm(tolerance, Attitude(), DegToRad(DECIMAL(1.0)), DECIMAL(0.1), NULL),
+        new PyramidStarIdAlgorithm(tolerance, 0, 0.001, 1000),
+    }, 4), new DavenportQAlgorithm(), database);
+
+    for (int frame = 0; frame < 3; frame++) {
+        Attitude attitude(SphericalToQuaternion(DegToRad(DECIMAL(88.0) + DECIMAL(0.05)*frame),
+                                                DegToRad(DECIMAL(7.0)), 0));
+        std::vector<int> starCatalogIndices;
+        Stars stars = StarsInView(fixture.catalog, attitude, fixture.camera, &starCatalogIndices);
+        REQUIRE(stars.size() >= 10);
+
+        PipelineOutput output = pipeline.Go(CentroidsPipelineInput(stars, fixture.camera, fixture.catalog));
+        REQUIRE(output.starIds);
+        REQUIRE(output.attitude);
+        // pyramid the first time, then tracking from the attitude just estimated
+        CHECK(output.starIdStats->cascadeStage == (frame == 0 ? 1 : 0));
+        CHECK(output.starIds->size() >= stars.size() * 9 / 10);
+        for (const StarIdentifier &starId : *output.starIds) {
+            CHECK(starId.catalogIndex == starCatalogIndices[starId.starIndex]);
+        }
+    }
+}
+
+TEST_CASE("Incremental carries identifications across frames", "[tracking]") {
+    StarIdFixture fixture;
+    const Catalog &catalog = fixture.catalog;
+    const Camera &camera = fixture.camera;
+    decimal tolerance = DegToRad(DECIMAL(0.04));
+    IncrementalStarIdAlgorithm algorithm(tolerance, 10,
+                                         new PyramidStarIdAlgorithm(tolerance, 0, 0.001, 1000));
+
+    // turning steadily, a few pixels per frame
+    for (int frame = 0; frame < 6; frame++) {
+        Attitude attitude(SphericalToQuaternion(DegToRad(DECIMAL(88.0) + DECIMAL(0.1)*frame),
+                                                DegToRad(DECIMAL(7.0) - DECIMAL(0.05)*frame),
+                                                DegToRad(DECIMAL(0.02)*frame)));
+        std::vector<int> starCatalogIndices;
+        Stars stars = StarsInView(catalog, attitude, camera, &starCatalogIndices);
+        REQUIRE(stars.size() >= 10);
+
+        StarIdStats stats;
+        StarIdentifiers starIds = algorithm.Go(fixture.database.data(), stars, catalog, camera, &stats);
+        // only the first frame needs pyramid
+        CHECK((stats.patternsTried > 0) == (frame == 0));
+        CHECK(starIds.size() >= stars.size() * 9 / 10);
+        for (const StarIdentifier &starId : starIds) {
+            CHECK(starId.catalogIndex == starCatalogIndices[starId.starIndex]);
+        }
+    }
+}
+
+TEST_CASE("Incremental falls back when the scene changes", "[tracking]") {
+    StarIdFixture fixture;
+    const Catalog &catalog = fixture.catalog;
+    const Camera &camera = fixture.camera;
+    decimal tolerance = DegToRad(DECIMAL(0.04));
+    IncrementalStarIdAlgorithm algorithm(tolerance, 10,
+                                         new PyramidStarIdAlgorithm(tolerance, 0, 0.001, 1000));
+
+    Attitude attitudes[] = {
+        Attitude(SphericalToQuaternion(DegToRad(DECIMAL(88.0)), DegToRad(DECIMAL(7.0)), 0)),
+        Attitude(SphericalToQuaternion(DegToRad(DECIMAL(200.0)), DegToRad(DECIMAL(-30.0)), 0)),
+    };
+    for (const Attitude &attitude : attitudes) {
+        std::vector<int> starCatalogIndices;
+        Stars stars = StarsInView(catalog, attitude, camera, &starCatalogIndices);
+
+        StarIdStats stats;
+        StarIdentifiers starIds = algorithm.Go(fixture.database.data(), stars, catalog, camera, &stats);
+        CHECK(stats.patternsTried > 0);
+        CHECK(starIds.size() > 0);
+        for (const StarIdentifier &starId : starIds) {
+            CHECK(starId.catalogIndex == starCatalogIndices[starId.starIndex]);
+        }
+    }
+}
+
+TEST_CASE("Cascade falls through to the next stage when tracking fails", "[tracking]") {
+    StarIdFixture fixture({SkyIndexDatabase::kMagicValue, PairDistanceKVectorDatabase::kMagicValue});
+    REQUIRE(fixture.stars.size() >= 10);
+
+    decimal tolerance = DegToRad(DECIMAL(0.04));
+    int expectedStage = 0;
+    Attitude prior = fixture.attitude;
+    SECTION("tracking succeeds") {
+        expectedStage = 0;
+    }
+    SECTION("tracking fails") {
+        prior = Attitude(SphericalToQuaternion(DegToRad(DECIMAL(95.0)), DegToRad(DECIMAL(7.0)), 0));
+        expectedStage = 1;
+    }
+    std::vector<StarIdAlgorithm *> stages = {
+        new TrackingStarIdAlgorithm(tolerance, prior, DegToRad(DECIMAL(1.0)), DECIMAL(0.1), NULL),
+        new PyramidStarIdAlgorithm(tolerance, 0, 0.001, 1000),
+    };
+    CascadeStarIdAlgorithm algorithm(stages, 4);
+
+    StarIdStats stats;
+    StarIdentifiers starIds = algorithm.Go(fixture.database.data(), fixture.stars, fixture.catalog, fixture.camera, &stats);
+    CHECK(stats.cascadeStage == expectedStage);
+    CHECK(starIds.size() >= fixture.stars.size() * 9 / 10);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.catalogIndex == fixture.starCatalogIndices[starId.starIndex]);
+    }
+}
+
+TEST_CASE("Cascade gives incremental the identifications of the stage that succeeded", "[tracking]") {
+    StarIdFixture fixture;
+    decimal tolerance = DegToRad(DECIMAL(0.04));
+    // incremental without a fallback of its own, like the cascade stages built from the command line
+    CascadeStarIdAlgorithm algorithm(std::vector<StarIdAlgorithm *>{
+        new IncrementalStarIdAlgorithm(tolerance, 10, NULL),
+        new PyramidStarIdAlgorithm(tolerance, 0, 0.001, 1000),
+    }, 4);
+
+    // turning steadily, a few pixels per frame
+    for (int frame = 0; frame < 4; frame++) {
+        Attitude attitude(SphericalToQuaternion(DegToRad(DECIMAL(88.0) + DECIMAL(0.1)*frame),
+                                                DegToRad(DECIMAL(7.0) - DECIMAL(0.05)*frame),
+                                                DegToRad(DECIMAL(0.02)*frame)));
+        std::vector<int> starCatalogIndices;
+        Stars stars = StarsInView(fixture.catalog, attitude, fixture.camera, &starCatalogIndices);
+        REQUIRE(stars.size() >= 10);
+
+        StarIdStats stats;
+        StarIdentifiers starIds = algorithm.Go(fixture.database.data(), stars, fixture.catalog, fixture.camera, &stats);
+        // only the first frame needs pyramid
+        CHECK(stats.cascadeStage == (frame == 0 ? 1 : 0));
+        CHECK((stats.patternsTried > 0) == (frame == 0));
+        CHECK(starIds.size() >= stars.size() * 9 / 10);
+        for (const StarIdentifier &starId : starIds) {
+            CHECK(starId.catalogIndex == starCatalogIndices[starId.starIndex]);
+        }
+    }
+}
+
+TEST_CASE("Cache recognizes a star field it has seen before", "[tracking]") {
+    StarIdFixture fixture;
+    const unsigned char *database = fixture.database.data();
+    const Stars &stars = fixture.stars;
+    REQUIRE(stars.size() >= 10);
+
+    decimal tolerance = DegToRad(DECIMAL(0.04));
+    CachedStarIdAlgorithm algorithm(tolerance, 2, new PyramidStarIdAlgorithm(tolerance, 0, 0.001, 1000));
+
+    StarIdStats firstStats;
+    algorithm.Go(database, stars, fixture.catalog, fixture.camera, &firstStats);
+    CHECK(!firstStats.cacheHit);
+    CHECK(firstStats.patternsTried > 0);
+    REQUIRE(algorithm.NumEntries() == 1);
+
+    // the signature doesn't depend on the order of the centroids
+    Stars reversed(stars.rbegin(), stars.rend());
+    StarIdStats secondStats;
+    StarIdentifiers starIds = algorithm.Go(database, reversed, fixture.catalog, fixture.camera, &secondStats);
+    CHECK(secondStats.cacheHit);
+    CHECK(secondStats.patternsTried == 1);
+    CHECK(starIds.size() >= stars.size() * 9 / 10);
+    for (const StarIdentifier &starId : starIds) {
+        CHECK(starId.catalogIndex == fixture.starCatalogIndices[stars.size() - 1 - starId.starIndex]);
+    }
+
+    // two more fields push the first one out
+    for (decimal ra : {DECIMAL(120.0), DECIMAL(150.0)}) {
+        Attitude other(SphericalToQuaternion(DegToRad(ra), DegToRad(DECIMAL(-20.0)), 0));
+        std::vector<int> otherCatalogIndices;
+        Stars otherStars = StarsInView(fixture.catalog, other, fixture.camera, &otherCatalogIndices);
+        algorithm.Go(database, otherStars, fixture.catalog, fixture.camera);
+    }
+    CHECK(algorithm.NumEntries() == 2);
+    StarIdStats evictedStats;
+    algorithm.Go(database, stars, fixture.catalog, fixture.camera, &evictedStats);
+    CHECK(!evictedStats.cacheHit);
+}
+
+/// Angular distances between each pair of the given centroids
+static std::vector<decimal> CentroidDistances(const Stars &stars, const Camera &camera) {
+    std::vector<decimal> result;
+    for (int i = 0; i < (int)stars.size(); i++) {
+        for (int j = i+1; j < (int)stars.size(); j++) {
+            result.push_back(AngleUnit(camera.CameraToSpatial(stars[i].position).Normalize(),
+                                       camera.CameraToSpatial(stars[j].position).Normalize()));
+        }
+    }
+    return result;
+}
+
+TEST_CASE("Cache doesn't trust a star field with a colliding signature", "[tracking]") {
+    StarIdFixture fixture;
+    const unsigned char *database = fixture.database.data();
+    decimal tolerance = DegToRad(DECIMAL(0.04));
+    CachedStarIdAlgorithm algorithm(tolerance, 2, new PyramidStarIdAlgorithm(tolerance, 0, 0.001, 1000));
+    algorithm.Go(database, fixture.stars, fixture.catalog, fixture.camera);
+    REQUIRE(algorithm.NumEntries() == 1);
+
+    // the 4 brightest centroids make up the signature
+    Stars signatureStars = fixture.stars;
+    std::sort(signatureStars.begin(), signatureStars.end(),
+              [](const Star &a, const Star &b) { return a.magnitude > b.magnitude; });
+    signatureStars.resize(4);
+
+    // Move one of them so that every distance stays in the same bin (8 tolerances wide), but some
+    // distance changes by a few tolerances, which the cached catalog stars can't match.
+    decimal binWidth = 8*tolerance;
+    std::vector<decimal> distances = CentroidDistances(signatureStars, fixture.camera);
+    Stars collidingStars;
+    for (int star = 0; star < 4 && collidingStars.empty(); star++) {
+        for (int angle = 0; angle < 16 && collidingStars.empty(); angle++) {
+            Stars moved = signatureStars;
+            moved[star].position.x += 6 * DECIMAL_COS(angle * DECIMAL_M_PI / 8);
+            moved[star].position.y += 6 * DECIMAL_SIN(angle * DECIMAL_M_PI / 8);
+            std::vector<decimal> movedDistances = CentroidDistances(moved, fixture.camera);
+            bool sameBins = true;
+            decimal mostChange = 0;
+            for (int i = 0; i < (int)distances.size(); i++) {
+                sameBins = sameBins && DECIMAL_FLOOR(distances[i] / binWidth) == DECIMAL_FLOOR(movedDistances[i] / binWidth);
+                mostChange = std::max(mostChange, DECIMAL_ABS(distances[i] - movedDistances[i]));
+            }
+            if (sameBins && mostChange > 2*tolerance) {
+                collidingStars = moved;
+            }
+        }
+    }
+    REQUIRE(collidingStars.size() == 4);
+
+    // the rest of the field is somewhere else entirely, and dimmer
+    Attitude other(SphericalToQuaternion(DegToRad(DECIMAL(150.0)), DegToRad(DECIMAL(-20.0)), 0));
+    std::vector<int> otherCatalogIndices;
+    for (Star star : StarsInView(fixture.catalog, other, fixture.camera, &otherCatalogIndices)) {
+        star.magnitude -= 1000;
+        collidingStars.push_back(star);
+    }
+
+    StarIdStats stats;
+    StarIdentifiers starIds = algorithm.Go(database, collidingStars, fixture.catalog, fixture.camera, &stats);
+    PyramidStarIdAlgorithm pyramid(tolerance, 0, 0.001, 1000);
+    StarIdStats pyramidStats;
+    StarIdentifiers pyramidStarIds = pyramid.Go(database, collidingStars, fixture.catalog, fixture.camera, &pyramidStats);
+
+    CHECK(!stats.cacheHit);
+    // the signature was found and checked, once, before falling back to pyramid
+    CHECK(stats.patternsTried == pyramidStats.patternsTried + 1);
+    // so the result is pyramid's, not the cached stars
+    CHECK(starIds == pyramidStarIds);
+    CHECK(starIds.size() > 0);
+}
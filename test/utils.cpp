@@ -1,9 +1,12 @@
 #include "utils.hpp"
 
+#include <assert.h>
 #include <algorithm>
 #include <vector>
 
 #include "databases.hpp"
+#include "serialize-helpers.hpp"
+#include "io.hpp"
 
 namespace lost {
 
@@ -20,4 +23,55 @@ bool AreStarIdentifiersEquivalent(const StarIdentifiers &ids1, const StarIdentif
     return true;
 }
 
+Stars StarsInView(const Catalog &catalog, const Attitude &attitude, const Camera &camera,
+                  std::vector<int> *catalogIndices) {
+    Stars result;
+    for (int i = 0; i < (int)catalog.size(); i++) {
+        Vec3 rotated = attitude.Rotate(catalog[i].spatial);
+        if (rotated.x <= 0) {
+            continue;
+        }
+        Vec2 position = camera.SpatialToCamera(rotated);
+        if (camera.InSensor(position)) {
+            // centroid magnitudes are brighter when larger, unlike catalog magnitudes
+            result.push_back(Star(position.x, position.y, 1, 1, -catalog[i].magnitude));
+            catalogIndices->push_back(i);
+        }
+    }
+    return result;
+}
+
+static const int kFixtureResolution = 1024;
+
+StarIdFixture::StarIdFixture(const std::vector<int32_t> &subDatabases)
+    : catalog(NarrowCatalog(CatalogRead(), 600, 5000, DegToRad(DECIMAL(0.08)))),
+      camera(FovToFocalLength(DegToRad(DECIMAL(20.0)), kFixtureResolution), kFixtureResolution, kFixtureResolution),
+      attitude(SphericalToQuaternion(DegToRad(DECIMAL(88.0)), DegToRad(DECIMAL(7.0)), 0)) {
+
+    MultiDatabaseDescriptor dbEntries;
+    SerializeContext catalogSer;
+    SerializeCatalog(&catalogSer, catalog, true, true);
+    dbEntries.emplace_back(kCatalogMagicValue, catalogSer.buffer);
+    for (int32_t magicValue : subDatabases) {
+        SerializeContext ser;
+        if (magicValue == PairDistanceKVectorDatabase::kMagicValue) {
+            SerializePairDistanceKVector(&ser, catalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(15.0)), 10000);
+        } else if (magicValue == SkyIndexDatabase::kMagicValue) {
+            SerializeSkyIndex(&ser, catalog, 90);
+        } else if (magicValue == TetraDatabase::kMagicValue) {
+            SerializeTetraDatabase(&ser, catalog, DegToRad(DECIMAL(12.0)), DECIMAL(10.0), 50);
+        } else if (magicValue == TripleInnerKVectorDatabase::kMagicValue) {
+            SerializeTripleInnerKVector(&ser, catalog, DegToRad(DECIMAL(0.5)), DegToRad(DECIMAL(10.0)), 10000);
+        } else {
+            assert(false);
+        }
+        dbEntries.emplace_back(magicValue, ser.buffer);
+    }
+    SerializeContext dbSer;
+    SerializeMultiDatabase(&dbSer, dbEntries, 0);
+    database = dbSer.buffer;
+
+    stars = StarsInView(catalog, attitude, camera, &starCatalogIndices);
+}
+
 }
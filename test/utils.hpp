@@ -1,13 +1,43 @@
 #ifndef TEST_UTILS_H
 #define TEST_UTILS_H
 
+#include <vector>
+
 #include "databases.hpp"
+#include "camera.hpp"
+#include "attitude-utils.hpp"
 
 namespace lost {
 
 /// simple O(n^2) check
 bool AreStarIdentifiersEquivalent(const StarIdentifiers &, const StarIdentifiers &);
 
+/// perfect centroids of every catalog star in view, without any noise
+Stars StarsInView(const Catalog &, const Attitude &, const Camera &, std::vector<int> *catalogIndices);
+
+/**
+ * What most star-id tests start from: the 5000 brightest catalog stars down to magnitude 6, a
+ * database of them, a 1024 pixel camera with a 20 degree field of view, and perfect centroids of
+ * every star in view at right ascension 88 and declination 7.
+ */
+struct StarIdFixture {
+    /**
+     * @param subDatabases Magic values of the sub-databases to build, besides the catalog (with
+     * magnitudes), which is always there. Supports the pair distance kvector (0.5-15 degrees), sky
+     * index, tetra and triple inner kvector databases.
+     */
+    explicit StarIdFixture(const std::vector<int32_t> &subDatabases
+                           = std::vector<int32_t>{PairDistanceKVectorDatabase::kMagicValue});
+
+    Catalog catalog;
+    std::vector<unsigned char> database;
+    Camera camera;
+    Attitude attitude;
+    Stars stars;
+    /// Catalog index of each of stars
+    std::vector<int> starCatalogIndices;
+};
+
 }
 
 #endif